@@ -0,0 +1,338 @@
+#include "downscale.h"
+
+#include <cstring>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIV_DOWNSCALE_X86
+#include <immintrin.h>
+#endif
+
+
+namespace Liv {
+
+
+/*! \file
+ * Area averaging downscaler for 32 bit pixels.
+ *
+ * Each destination pixel is the average of the source pixels it covers, with partial pixels
+ * at the edges weighted by how much of them is covered. This is what downscaling should be for
+ * any reduction factor, without the aliasing of sampling, and without the cost of wide filters.
+ *
+ * It is separable: each source row is first reduced horizontally into a 16 bit per channel
+ * row, kept in a small ring of rows, then those are combined vertically. Weights are 14 bit
+ * fixed point summing to exactly 1<<14, so the whole thing is integer math that fits in 32 bits.
+ *
+ * The 4 bytes of a pixel are treated as independent channels, like imlib's own scaling,
+ * so byte order does not matter. There are scalar, SSE4.1, and AVX2 versions of both passes,
+ * picked at run time. See downscale_argb().
+ */
+
+
+#define DOWNSCALE_WEIGHT_BITS  14
+#define DOWNSCALE_ONE          (1<<DOWNSCALE_WEIGHT_BITS)
+#define DOWNSCALE_HBITS        6   //horizontal pass keeps 8 extra bits: 255<<8 max
+#define DOWNSCALE_VSHIFT       (DOWNSCALE_WEIGHT_BITS + DOWNSCALE_WEIGHT_BITS - DOWNSCALE_HBITS)
+
+
+//----------------------------- weights --------------------------------------
+
+/*! Which source pixels, with what weights, contribute to each destination pixel along one axis.
+ */
+class DownscaleWeights
+{
+  public:
+	int n;       //destination pixels
+	int max;     //most source pixels contributing to any one destination pixel
+	int *first;  //first source pixel for each destination pixel
+	int *count;  //number of source pixels for each destination pixel
+	int *weights; //n*max, DOWNSCALE_ONE fixed point
+
+	DownscaleWeights(int src, int dst);
+	~DownscaleWeights();
+};
+
+DownscaleWeights::DownscaleWeights(int src, int dst)
+{
+	n = dst;
+	double scale = (double)src / dst;
+	max = (int)ceil(scale) + 1;
+	first   = new int[n];
+	count   = new int[n];
+	weights = new int[n * max];
+	memset(weights, 0, n * max * sizeof(int));
+
+	for (int i=0; i<n; i++) {
+		double start = i * scale, end = (i+1) * scale;
+		if (end > src) end = src;
+		int s = (int)floor(start);
+		int e = (int)ceil(end);
+		if (e > src) e = src;
+		if (e - s > max) e = s + max;
+
+		first[i] = s;
+		count[i] = e - s;
+
+		 //each weight is the difference of rounded coverage up to its two edges, so they
+		 //sum to exactly one, and none can go negative, however many there are
+		int *w = weights + i*max;
+		double span = end - start;
+		int done = 0;
+		for (int k=0; k<count[i]; k++) {
+			double b = s + k + 1;
+			if (b > end) b = end;
+			int upto = (k == count[i]-1 ? DOWNSCALE_ONE : (int)floor((b - start) / span * DOWNSCALE_ONE + .5));
+			w[k] = upto - done;
+			done = upto;
+		}
+	}
+}
+
+DownscaleWeights::~DownscaleWeights()
+{
+	delete[] first;
+	delete[] count;
+	delete[] weights;
+}
+
+
+//----------------------------- scalar passes --------------------------------------
+
+//! Reduce one source row into dw pixels of 4 unsigned short channels.
+static void hpass_scalar(const unsigned int *src, unsigned short *tmp, const DownscaleWeights &hw)
+{
+	for (int i=0; i<hw.n; i++) {
+		const unsigned char *p = (const unsigned char*)(src + hw.first[i]);
+		const int *w = hw.weights + i*hw.max;
+		int a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+		for (int k=0; k<hw.count[i]; k++, p+=4) {
+			a0 += p[0] * w[k];
+			a1 += p[1] * w[k];
+			a2 += p[2] * w[k];
+			a3 += p[3] * w[k];
+		}
+		const int round = 1 << (DOWNSCALE_HBITS-1);
+		tmp[0] = (a0 + round) >> DOWNSCALE_HBITS;
+		tmp[1] = (a1 + round) >> DOWNSCALE_HBITS;
+		tmp[2] = (a2 + round) >> DOWNSCALE_HBITS;
+		tmp[3] = (a3 + round) >> DOWNSCALE_HBITS;
+		tmp += 4;
+	}
+}
+
+//! Do channels x through n-1 of vpass_scalar(), for the leftovers of the vector versions.
+static void vpass_tail(unsigned short **rows, const int *w, int nrows, unsigned char *dst, int x, int n)
+{
+	const int round = 1 << (DOWNSCALE_VSHIFT-1);
+	for ( ; x<n; x++) {
+		int a = 0;
+		for (int k=0; k<nrows; k++) a += rows[k][x] * w[k];
+		a = (a + round) >> DOWNSCALE_VSHIFT;
+		dst[x] = (a > 255 ? 255 : a);
+	}
+}
+
+//! Combine nrows reduced rows with weights w into one destination row of n channels.
+static void vpass_scalar(unsigned short **rows, const int *w, int nrows, unsigned char *dst, int n)
+{
+	vpass_tail(rows, w, nrows, dst, 0, n);
+}
+
+
+//----------------------------- SSE4.1 and AVX2 passes --------------------------------------
+
+#ifdef LIV_DOWNSCALE_X86
+
+/*! Pixels are taken two at a time, with their bytes interleaved so that _mm_madd_epi16
+ * does the multiply and the add of both for each channel at once.
+ */
+__attribute__((target("sse4.1")))
+static void hpass_sse4(const unsigned int *src, unsigned short *tmp, const DownscaleWeights &hw)
+{
+	const __m128i round = _mm_set1_epi32(1 << (DOWNSCALE_HBITS-1));
+	for (int i=0; i<hw.n; i++) {
+		const unsigned int *p = src + hw.first[i];
+		const int *w = hw.weights + i*hw.max;
+		int n = hw.count[i], k = 0;
+		__m128i acc = _mm_setzero_si128();
+
+		for ( ; k+2 <= n; k += 2) {
+			__m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[k]), _mm_cvtsi32_si128(p[k+1]));
+			px = _mm_cvtepu8_epi16(px);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32((w[k+1] << 16) | w[k])));
+		}
+		if (k < n) {
+			__m128i px = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(p[k]));
+			acc = _mm_add_epi32(acc, _mm_mullo_epi32(px, _mm_set1_epi32(w[k])));
+		}
+
+		acc = _mm_srli_epi32(_mm_add_epi32(acc, round), DOWNSCALE_HBITS);
+		_mm_storel_epi64((__m128i*)(tmp + 4*i), _mm_packus_epi32(acc, acc));
+	}
+}
+
+/*! Like hpass_sse4(), but four pixels at a time, pairs interleaved in each 128 bit lane.
+ */
+__attribute__((target("avx2")))
+static void hpass_avx2(const unsigned int *src, unsigned short *tmp, const DownscaleWeights &hw)
+{
+	const __m128i round = _mm_set1_epi32(1 << (DOWNSCALE_HBITS-1));
+	 //bytes of pixels 0,1 interleaved, then bytes of pixels 2,3 interleaved
+	const __m128i interleave = _mm_setr_epi8(0,4, 1,5, 2,6, 3,7, 8,12, 9,13, 10,14, 11,15);
+
+	for (int i=0; i<hw.n; i++) {
+		const unsigned int *p = src + hw.first[i];
+		const int *w = hw.weights + i*hw.max;
+		int n = hw.count[i], k = 0;
+		__m256i acc4 = _mm256_setzero_si256();
+
+		for ( ; k+4 <= n; k += 4) {
+			__m128i px = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p+k)), interleave);
+			__m256i wk = _mm256_setr_epi32((w[k+1] << 16) | w[k],   (w[k+1] << 16) | w[k],
+										   (w[k+1] << 16) | w[k],   (w[k+1] << 16) | w[k],
+										   (w[k+3] << 16) | w[k+2], (w[k+3] << 16) | w[k+2],
+										   (w[k+3] << 16) | w[k+2], (w[k+3] << 16) | w[k+2]);
+			acc4 = _mm256_add_epi32(acc4, _mm256_madd_epi16(_mm256_cvtepu8_epi16(px), wk));
+		}
+
+		__m128i acc = _mm_add_epi32(_mm256_castsi256_si128(acc4), _mm256_extracti128_si256(acc4, 1));
+		for ( ; k+2 <= n; k += 2) {
+			__m128i px = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[k]), _mm_cvtsi32_si128(p[k+1]));
+			px = _mm_cvtepu8_epi16(px);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(px, _mm_set1_epi32((w[k+1] << 16) | w[k])));
+		}
+		if (k < n) {
+			__m128i px = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(p[k]));
+			acc = _mm_add_epi32(acc, _mm_mullo_epi32(px, _mm_set1_epi32(w[k])));
+		}
+
+		acc = _mm_srli_epi32(_mm_add_epi32(acc, round), DOWNSCALE_HBITS);
+		_mm_storel_epi64((__m128i*)(tmp + 4*i), _mm_packus_epi32(acc, acc));
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void vpass_sse4(unsigned short **rows, const int *w, int nrows, unsigned char *dst, int n)
+{
+	const __m128i round = _mm_set1_epi32(1 << (DOWNSCALE_VSHIFT-1));
+	int x = 0;
+	for ( ; x+4 <= n; x += 4) {
+		__m128i acc = _mm_setzero_si128();
+		for (int k=0; k<nrows; k++) {
+			__m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)(rows[k] + x)));
+			acc = _mm_add_epi32(acc, _mm_mullo_epi32(v, _mm_set1_epi32(w[k])));
+		}
+		acc = _mm_srli_epi32(_mm_add_epi32(acc, round), DOWNSCALE_VSHIFT);
+		acc = _mm_packus_epi32(acc, acc);
+		acc = _mm_packus_epi16(acc, acc);
+		int out = _mm_cvtsi128_si32(acc);
+		memcpy(dst + x, &out, 4);
+	}
+	vpass_tail(rows, w, nrows, dst, x, n);
+}
+
+__attribute__((target("avx2")))
+static void vpass_avx2(unsigned short **rows, const int *w, int nrows, unsigned char *dst, int n)
+{
+	const __m256i round = _mm256_set1_epi32(1 << (DOWNSCALE_VSHIFT-1));
+	int x = 0;
+	for ( ; x+8 <= n; x += 8) {
+		__m256i acc = _mm256_setzero_si256();
+		for (int k=0; k<nrows; k++) {
+			__m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(rows[k] + x)));
+			acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(v, _mm256_set1_epi32(w[k])));
+		}
+		acc = _mm256_srli_epi32(_mm256_add_epi32(acc, round), DOWNSCALE_VSHIFT);
+		 //32 -> 16 bits packs within 128 bit lanes, so gather the two halves back together
+		acc = _mm256_packus_epi32(acc, acc);
+		acc = _mm256_permute4x64_epi64(acc, 0x08);
+		__m128i v16 = _mm256_castsi256_si128(acc);
+		_mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi16(v16, v16));
+	}
+	vpass_tail(rows, w, nrows, dst, x, n);
+}
+
+#endif //LIV_DOWNSCALE_X86
+
+
+//----------------------------- public functions --------------------------------------
+
+/*! Return the fastest DownscaleImpl this cpu can do.
+ */
+int downscale_best_impl()
+{
+#ifdef LIV_DOWNSCALE_X86
+	static int best = 0;
+	if (!best) {
+		__builtin_cpu_init();
+		if      (__builtin_cpu_supports("avx2"))   best = DOWNSCALE_AVX2;
+		else if (__builtin_cpu_supports("sse4.1")) best = DOWNSCALE_SSE4;
+		else best = DOWNSCALE_Scalar;
+	}
+	return best;
+#else
+	return DOWNSCALE_Scalar;
+#endif
+}
+
+const char *downscale_impl_name(int impl)
+{
+	if (impl == DOWNSCALE_Auto) impl = downscale_best_impl();
+	if (impl == DOWNSCALE_AVX2) return "avx2";
+	if (impl == DOWNSCALE_SSE4) return "sse4.1";
+	return "scalar";
+}
+
+/*! Area average the sw x sh pixels of src down to dw x dh pixels in dst. Strides are in pixels.
+ * impl is a DownscaleImpl. DOWNSCALE_Auto uses downscale_best_impl(), and asking for
+ * something the cpu cannot do falls back to what it can.
+ *
+ * Only reduces: returns 1 without doing anything if dw > sw or dh > sh, or any dimension is
+ * not positive. Else returns 0.
+ */
+int downscale_argb(const unsigned int *src, int sw, int sh, int sstride,
+				   unsigned int *dst, int dw, int dh, int dstride, int impl)
+{
+	if (!src || !dst || sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0 || dw > sw || dh > sh) return 1;
+
+	int best = downscale_best_impl();
+	if (impl == DOWNSCALE_Auto || impl > best) impl = best;
+
+	void (*hpass)(const unsigned int*, unsigned short*, const DownscaleWeights&) = hpass_scalar;
+	void (*vpass)(unsigned short**, const int*, int, unsigned char*, int) = vpass_scalar;
+#ifdef LIV_DOWNSCALE_X86
+	if (impl >= DOWNSCALE_SSE4) { hpass = hpass_sse4; vpass = vpass_sse4; }
+	if (impl >= DOWNSCALE_AVX2) { hpass = hpass_avx2; vpass = vpass_avx2; }
+#endif
+
+	DownscaleWeights hw(sw, dw), vw(sh, dh);
+
+	 //ring of horizontally reduced rows, enough for any one destination row
+	int rowlen = dw * 4;
+	int nring = vw.max;
+	unsigned short *ring = new unsigned short[nring * rowlen];
+	unsigned short **rows = new unsigned short*[vw.max];
+	int next = 0; //next source row to reduce
+
+	for (int j=0; j<dh; j++) {
+		int f = vw.first[j];
+		for (int k=0; k<vw.count[j]; k++) {
+			int r = f + k;
+			while (next <= r) {
+				hpass(src + (long)next * sstride, ring + (next % nring) * rowlen, hw);
+				next++;
+			}
+			rows[k] = ring + (r % nring) * rowlen;
+		}
+
+		vpass(rows, vw.weights + j*vw.max, vw.count[j], (unsigned char*)(dst + (long)j * dstride), rowlen);
+	}
+
+	delete[] rows;
+	delete[] ring;
+	return 0;
+}
+
+
+} //namespace Liv
+
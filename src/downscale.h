@@ -0,0 +1,25 @@
+#ifndef LIV_DOWNSCALE_H
+#define LIV_DOWNSCALE_H
+
+
+namespace Liv {
+
+
+enum DownscaleImpl {
+	DOWNSCALE_Auto,
+	DOWNSCALE_Scalar,
+	DOWNSCALE_SSE4,
+	DOWNSCALE_AVX2,
+	DOWNSCALE_MAX
+};
+
+int downscale_argb(const unsigned int *src, int sw, int sh, int sstride,
+				   unsigned int *dst, int dw, int dh, int dstride, int impl = DOWNSCALE_Auto);
+int downscale_best_impl();
+const char *downscale_impl_name(int impl);
+
+
+} //namespace Liv
+
+#endif
+
@@ -0,0 +1,102 @@
+//
+// Microbenchmark for downscale_argb() against imlib's anti aliased scaling.
+// Also checks that every implementation gives exactly the scalar result, and exits with 1 if not.
+//
+// Build with: make downscalebench
+// Run with:   ./downscalebench [iterations]
+//
+
+#include "downscale.h"
+
+#include <Imlib2.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+using namespace Liv;
+
+
+static double now_ms()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000. + tv.tv_usec / 1000.;
+}
+
+//! Return 0 if all implementations agree with the scalar one for src scaled to dw x dh, else 1.
+static int check(unsigned int *src, int sw, int sh, int dw, int dh)
+{
+	unsigned int *expect = new unsigned int[dw * dh];
+	unsigned int *dst = new unsigned int[dw * dh];
+	downscale_argb(src, sw, sh, sw, expect, dw, dh, dw, DOWNSCALE_Scalar);
+
+	int status = 0;
+	for (int impl = DOWNSCALE_Scalar+1; impl <= downscale_best_impl(); impl++) {
+		downscale_argb(src, sw, sh, sw, dst, dw, dh, dw, impl);
+		if (memcmp(dst, expect, dw * dh * sizeof(unsigned int))) {
+			printf("  %s differs from scalar for %dx%d -> %dx%d\n", downscale_impl_name(impl), sw, sh, dw, dh);
+			status = 1;
+		}
+	}
+
+	delete[] expect;
+	delete[] dst;
+	return status;
+}
+
+static int bench(unsigned int *src, int sw, int sh, int dw, int dh, int iterations)
+{
+	unsigned int *dst = new unsigned int[dw * dh];
+	printf("%dx%d -> %dx%d\n", sw, sh, dw, dh);
+
+	for (int impl = DOWNSCALE_Scalar; impl <= downscale_best_impl(); impl++) {
+		double start = now_ms();
+		for (int c=0; c<iterations; c++) downscale_argb(src, sw, sh, sw, dst, dw, dh, dw, impl);
+		printf("  %-8s %8.2f ms\n", downscale_impl_name(impl), (now_ms() - start) / iterations);
+	}
+
+	Imlib_Image image = imlib_create_image_using_data(sw, sh, (DATA32*)src);
+	imlib_context_set_image(image);
+	imlib_context_set_anti_alias(1);
+	double start = now_ms();
+	for (int c=0; c<iterations; c++) {
+		imlib_context_set_image(image);
+		Imlib_Image scaled = imlib_create_cropped_scaled_image(0,0, sw,sh, dw,dh);
+		imlib_context_set_image(scaled);
+		imlib_free_image();
+	}
+	printf("  %-8s %8.2f ms\n", "imlib", (now_ms() - start) / iterations);
+	imlib_context_set_image(image);
+	imlib_free_image();
+
+	delete[] dst;
+	return check(src, sw, sh, dw, dh);
+}
+
+int main(int argc, char **argv)
+{
+	int iterations = (argc > 1 ? atoi(argv[1]) : 10);
+	if (iterations < 1) iterations = 1;
+
+	int sw = 6000, sh = 4000;
+	unsigned int *src = new unsigned int[sw * sh];
+	srand(1);
+	for (int c=0; c<sw*sh; c++) src[c] = ((unsigned int)rand() << 16) ^ rand();
+
+	int status = 0;
+	status |= bench(src, sw, sh, 256, 171, iterations);  //large thumbnail
+	status |= bench(src, sw, sh, 1920, 1280, iterations); //fit to screen
+
+	 //huge reductions, where rounding each weight on its own used to go wrong
+	status |= check(src, sw, sh, 2, 1);
+	status |= check(src, sw, sh, 1, 1);
+	status |= check(src, sw, 2, 3, 1);
+	status |= check(src, sw, sh, sw-1, sh-1);
+
+	if (!status) printf("all implementations agree\n");
+	delete[] src;
+	return status;
+}
+
@@ -0,0 +1,257 @@
+#include "exifthumb.h"
+
+#include <cstring>
+
+
+namespace Liv {
+
+
+//! Max number of tiff directories looked at in any one file.
+#define EXIFTHUMB_MAX_IFDS     32
+
+//! Max number of entries read from any one tiff directory.
+#define EXIFTHUMB_MAX_ENTRIES  1000
+
+
+//----------------------------- EmbeddedPreview --------------------------------------
+
+/*! \class EmbeddedPreview
+ * \brief Find jpeg previews embedded in camera files, without decoding anything.
+ *
+ * Looks in the exif of jpegs for the IFD1 thumbnail, and in tiff based raws (cr2, nef,
+ * arw, dng, orf, rw2, pef, ...) through IFD0, IFD1, and SubIFDs for jpeg previews, which
+ * are often full size. Fuji raf files have their preview jpeg at a fixed header location.
+ *
+ * Find() picks the smallest baseline or progressive jpeg that is at least minsize in
+ * width or height. Lossless jpeg raw data is rejected by checking the SOF marker.
+ * Only headers are read, so this is a handful of small reads per file.
+ */
+
+EmbeddedPreview::EmbeddedPreview()
+{
+	f         = NULL;
+	filesize  = 0;
+	bigendian = 0;
+	minsize   = 0;
+	offset    = length = -1;
+	width     = height = 0;
+	orig_width = orig_height = 0;
+}
+
+unsigned int EmbeddedPreview::get16(const unsigned char *b)
+{
+	return bigendian ? (b[0]<<8) | b[1] : (b[1]<<8) | b[0];
+}
+
+unsigned int EmbeddedPreview::get32(const unsigned char *b)
+{
+	return bigendian ? ((unsigned int)b[0]<<24) | (b[1]<<16) | (b[2]<<8) | b[3]
+					 : ((unsigned int)b[3]<<24) | (b[2]<<16) | (b[1]<<8) | b[0];
+}
+
+//! Read n bytes at pos. Return 0 for success.
+int EmbeddedPreview::read_at(long pos, unsigned char *buffer, int n)
+{
+	if (pos < 0 || pos + n > filesize) return 1;
+	if (fseek(f, pos, SEEK_SET) != 0) return 1;
+	return fread(buffer, 1, n, f) == (size_t)n ? 0 : 1;
+}
+
+/*! Walk jpeg markers from the SOI at pos until the start of scan.
+ * Sets width and height from the SOF, and exif_pos and exif_len (if not NULL) to the tiff
+ * data of an Exif APP1 segment. Returns the SOF marker (0xc0 for baseline, etc), or 0.
+ */
+int EmbeddedPreview::scan_jpeg_markers(long pos, long end, int *width, int *height, long *exif_pos, long *exif_len)
+{
+	unsigned char b[10];
+	if (read_at(pos, b, 2) || b[0] != 0xff || b[1] != 0xd8) return 0;
+	pos += 2;
+
+	int sof = 0;
+	while (pos + 4 <= end) {
+		if (read_at(pos, b, 4) || b[0] != 0xff) break;
+		if (b[1] == 0xff) { pos++; continue; } //fill byte
+
+		int marker = b[1];
+		long len = (b[2]<<8) | b[3];
+		if (marker == 0xd9 || marker == 0xda || len < 2) break; //EOI or SOS
+
+		if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			if (!sof && read_at(pos+4, b, 5) == 0) {
+				sof = marker;
+				*height = (b[1]<<8) | b[2];
+				*width  = (b[3]<<8) | b[4];
+			}
+			if (!exif_pos) break;
+
+		} else if (marker == 0xe1 && exif_pos && *exif_pos < 0 && len > 16) {
+			if (read_at(pos+4, b, 6) == 0 && !memcmp(b, "Exif\0\0", 6)) {
+				*exif_pos = pos + 10;
+				*exif_len = len - 8;
+			}
+		}
+
+		pos += 2 + len;
+	}
+
+	return sof;
+}
+
+//! Consider the jpeg of len bytes at pos, and keep it if it is the best so far.
+void EmbeddedPreview::candidate(long pos, long len)
+{
+	if (pos <= 0 || len < 128 || pos + len > filesize) return;
+
+	int w = 0, h = 0;
+	int sof = scan_jpeg_markers(pos, pos + len, &w, &h, NULL, NULL);
+	if (sof < 0xc0 || sof > 0xc2) return; //only baseline, extended, and progressive huffman
+	if (w < minsize && h < minsize) return;
+
+	if (offset < 0 || (long)w * h < (long)width * height) {
+		offset = pos;
+		length = len;
+		width  = w;
+		height = h;
+	}
+}
+
+/*! Walk the tiff directories of tiff data at base, considering any jpegs they point to.
+ * Offsets in the tiff are relative to base.
+ */
+void EmbeddedPreview::scan_tiff(long base, long end)
+{
+	unsigned char b[12];
+	if (read_at(base, b, 8)) return;
+	if      (b[0] == 'I' && b[1] == 'I') bigendian = 0;
+	else if (b[0] == 'M' && b[1] == 'M') bigendian = 1;
+	else return;
+	 //42 for tiff, but some raws have their own, like orf and rw2, so don't check
+
+	long ifds[EXIFTHUMB_MAX_IFDS];
+	int nifds = 0, visited = 0;
+	ifds[nifds++] = get32(b+4);
+
+	unsigned char *entries = NULL;
+	while (nifds && visited < EXIFTHUMB_MAX_IFDS) {
+		long ifd = base + ifds[--nifds];
+		visited++;
+
+		if (ifd <= base || read_at(ifd, b, 2)) continue;
+		int n = get16(b);
+		if (n <= 0 || n > EXIFTHUMB_MAX_ENTRIES || ifd + 2 + n*12 + 4 > end) continue;
+
+		delete[] entries;
+		entries = new unsigned char[n*12 + 4];
+		if (read_at(ifd+2, entries, n*12 + 4)) continue;
+
+		long jpos = 0, jlen = 0, spos = 0, slen = 0;
+		int compression = 0;
+
+		for (int c=0; c<n; c++) {
+			unsigned char *e = entries + c*12;
+			unsigned int tag   = get16(e);
+			unsigned int type  = get16(e+2);
+			unsigned int count = get32(e+4);
+			unsigned int value = (type == 3 ? get16(e+8) : get32(e+8)); //SHORT or LONG
+
+			if      (tag == 0x0201) jpos = value;   //JPEGInterchangeFormat
+			else if (tag == 0x0202) jlen = value;   //JPEGInterchangeFormatLength
+			else if (tag == 0x0103) compression = value;
+			else if (tag == 0x0111 && count == 1) spos = value; //StripOffsets
+			else if (tag == 0x0117 && count == 1) slen = value; //StripByteCounts
+			else if (tag == 0x002e && type == 7) candidate(base + get32(e+8), count); //panasonic JpgFromRaw
+			else if (tag == 0xa002) orig_width  = value; //PixelXDimension
+			else if (tag == 0xa003) orig_height = value; //PixelYDimension
+			else if (tag == 0x8769 && nifds < EXIFTHUMB_MAX_IFDS) ifds[nifds++] = value; //Exif IFD
+			else if (tag == 0x014a) {
+				 //SubIFDs
+				if (count == 1) {
+					if (nifds < EXIFTHUMB_MAX_IFDS) ifds[nifds++] = value;
+				} else {
+					unsigned char sub[4];
+					for (unsigned int s=0; s<count && nifds < EXIFTHUMB_MAX_IFDS; s++) {
+						if (read_at(base + value + 4*s, sub, 4)) break;
+						ifds[nifds++] = get32(sub);
+					}
+				}
+			}
+		}
+
+		if (jpos && jlen) candidate(base + jpos, jlen);
+		if ((compression == 6 || compression == 7) && spos && slen) candidate(base + spos, slen);
+
+		long next = get32(entries + n*12);
+		if (next && nifds < EXIFTHUMB_MAX_IFDS) ifds[nifds++] = next;
+	}
+
+	delete[] entries;
+}
+
+/*! Look for an embedded jpeg at least minsize wide or high in file.
+ * Return 0 if found, with offset, length, width, and height set. Else return nonzero.
+ * orig_width and orig_height are set if the file says what they are.
+ */
+int EmbeddedPreview::Find(const char *file, int nminsize)
+{
+	offset = length = -1;
+	width = height = 0;
+	orig_width = orig_height = 0;
+	minsize = nminsize;
+
+	f = fopen(file, "rb");
+	if (!f) return 1;
+	if (fseek(f, 0, SEEK_END) == 0) filesize = ftell(f);
+
+	unsigned char b[16];
+	if (filesize > 16 && read_at(0, b, 16) == 0) {
+		if (b[0] == 0xff && b[1] == 0xd8) {
+			 //jpeg: exif thumbnail, and main SOF for original size
+			long exif_pos = -1, exif_len = 0;
+			int w = 0, h = 0;
+			if (scan_jpeg_markers(0, filesize, &w, &h, &exif_pos, &exif_len)) {
+				orig_width  = w;
+				orig_height = h;
+			}
+			if (exif_pos > 0) {
+				int ow = orig_width, oh = orig_height;
+				scan_tiff(exif_pos, exif_pos + exif_len);
+				if (ow > 0) { orig_width = ow; orig_height = oh; } //trust SOF over exif
+			}
+
+		} else if ((b[0] == 'I' && b[1] == 'I') || (b[0] == 'M' && b[1] == 'M')) {
+			scan_tiff(0, filesize);
+
+		} else if (!memcmp(b, "FUJIFILM", 8)) {
+			 //raf: big endian jpeg offset and length at 84
+			unsigned char r[8];
+			bigendian = 1;
+			if (read_at(84, r, 8) == 0) candidate(get32(r), get32(r+4));
+		}
+	}
+
+	fclose(f);
+	f = NULL;
+	return offset >= 0 ? 0 : 1;
+}
+
+/*! Return a new unsigned char[length] of the jpeg found with Find(), or NULL.
+ */
+unsigned char *EmbeddedPreview::Read(const char *file)
+{
+	if (offset < 0 || length <= 0) return NULL;
+
+	FILE *ff = fopen(file, "rb");
+	if (!ff) return NULL;
+
+	unsigned char *data = new unsigned char[length];
+	if (fseek(ff, offset, SEEK_SET) != 0 || fread(data, 1, length, ff) != (size_t)length) {
+		delete[] data;
+		data = NULL;
+	}
+	fclose(ff);
+	return data;
+}
+
+
+} //namespace Liv
+
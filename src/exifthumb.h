@@ -0,0 +1,42 @@
+#ifndef LIV_EXIFTHUMB_H
+#define LIV_EXIFTHUMB_H
+
+#include <cstdio>
+
+
+namespace Liv {
+
+
+//----------------------------- EmbeddedPreview --------------------------------------
+
+class EmbeddedPreview
+{
+  protected:
+	FILE *f;
+	long filesize;
+	int bigendian;
+	int minsize;
+
+	virtual unsigned int get16(const unsigned char *b);
+	virtual unsigned int get32(const unsigned char *b);
+	virtual int read_at(long pos, unsigned char *buffer, int n);
+	virtual int scan_jpeg_markers(long pos, long end, int *width, int *height, long *exif_pos, long *exif_len);
+	virtual void scan_tiff(long base, long end);
+	virtual void candidate(long pos, long len);
+
+  public:
+	long offset, length;    //of the best embedded jpeg, or -1
+	int width, height;      //of the best embedded jpeg
+	int orig_width, orig_height; //of the whole image if known, or 0
+
+	EmbeddedPreview();
+	virtual ~EmbeddedPreview() {}
+	virtual int Find(const char *file, int minsize);
+	virtual unsigned char *Read(const char *file);
+};
+
+
+} //namespace Liv
+
+#endif
+
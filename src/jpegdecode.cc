@@ -0,0 +1,122 @@
+#include "jpegdecode.h"
+
+#include <cstdio>
+#include <csetjmp>
+#include <jpeglib.h>
+
+
+namespace Liv {
+
+
+//----------------------------- jpeg decoding --------------------------------------
+
+struct LivJpegError
+{
+	struct jpeg_error_mgr pub;
+	jmp_buf jump;
+};
+
+static void liv_jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((LivJpegError*)cinfo->err)->jump, 1);
+}
+
+static void liv_jpeg_output_message(j_common_ptr cinfo)
+{
+	 //stay quiet about warnings in broken embedded thumbnails
+}
+
+/*! Return the biggest libjpeg scale denominator of 1, 2, 4, or 8 that still leaves
+ * the w x h image at least minsize in its biggest dimension. minsize <= 0 means 1.
+ */
+static int jpeg_scale_for(int w, int h, int minsize)
+{
+	if (minsize <= 0) return 1;
+	int big = (w > h ? w : h);
+	int denom = 8;
+	while (denom > 1 && (big + denom - 1) / denom < minsize) denom /= 2;
+	return denom;
+}
+
+/*! Do the decoding for decode_jpeg(), once cinfo has a source.
+ * On error, longjmps back to the caller's setjmp.
+ */
+static unsigned int *decode_jpeg_source(j_decompress_ptr cinfo, int minsize, unsigned char *volatile *row,
+										unsigned int *volatile *argb,
+										int *width_ret, int *height_ret, int *orig_w, int *orig_h)
+{
+	jpeg_read_header(cinfo, TRUE);
+	if (orig_w) *orig_w = cinfo->image_width;
+	if (orig_h) *orig_h = cinfo->image_height;
+
+	 //let the idct do the downscaling, far cheaper than decoding full size and scaling after
+	cinfo->scale_num   = 1;
+	cinfo->scale_denom = jpeg_scale_for(cinfo->image_width, cinfo->image_height, minsize);
+	if (cinfo->scale_denom > 1) {
+		 //result gets scaled again anyway, so favor speed
+		cinfo->dct_method = JDCT_IFAST;
+		cinfo->do_fancy_upsampling = FALSE;
+	}
+	cinfo->out_color_space = JCS_RGB;
+	jpeg_start_decompress(cinfo);
+
+	int w = cinfo->output_width;
+	int h = cinfo->output_height;
+	*argb = new unsigned int[(long)w * h];
+	*row  = new unsigned char[w * 3];
+
+	unsigned int *p = *argb;
+	JSAMPROW rows[1] = { *row };
+	while (cinfo->output_scanline < cinfo->output_height) {
+		jpeg_read_scanlines(cinfo, rows, 1);
+		const unsigned char *r = *row;
+		for (int x=0; x<w; x++, r+=3) *p++ = 0xff000000 | (r[0]<<16) | (r[1]<<8) | r[2];
+	}
+
+	jpeg_finish_decompress(cinfo);
+
+	if (width_ret)  *width_ret  = w;
+	if (height_ret) *height_ret = h;
+	return *argb;
+}
+
+/*! Decode a jpeg held in memory, such as one embedded in exif data.
+ * If minsize > 0, decode at 1/2, 1/4, or 1/8 scale when that still leaves the biggest
+ * dimension at least minsize.
+ *
+ * Returns a new unsigned int[] of width*height pixels of 0xffRRGGBB, as imlib uses,
+ * or NULL on error. orig_w and orig_h get the unscaled size if not NULL.
+ */
+unsigned int *decode_jpeg(const unsigned char *data, unsigned long length, int minsize,
+						  int *width_ret, int *height_ret, int *orig_w, int *orig_h)
+{
+	if (!data || length < 4) return NULL;
+
+	struct jpeg_decompress_struct cinfo;
+	LivJpegError jerr;
+	unsigned int *volatile argb = NULL;
+	unsigned char *volatile row = NULL;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit     = liv_jpeg_error_exit;
+	jerr.pub.output_message = liv_jpeg_output_message;
+
+	if (setjmp(jerr.jump)) {
+		jpeg_destroy_decompress(&cinfo);
+		delete[] argb;
+		delete[] row;
+		return NULL;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char*)data, length);
+	decode_jpeg_source(&cinfo, minsize, &row, &argb, width_ret, height_ret, orig_w, orig_h);
+	jpeg_destroy_decompress(&cinfo);
+
+	delete[] row;
+	return argb;
+}
+
+
+} //namespace Liv
+
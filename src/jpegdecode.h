@@ -0,0 +1,15 @@
+#ifndef LIV_JPEGDECODE_H
+#define LIV_JPEGDECODE_H
+
+
+namespace Liv {
+
+
+unsigned int *decode_jpeg(const unsigned char *data, unsigned long length, int minsize,
+						  int *width_ret, int *height_ret, int *orig_w=0, int *orig_h=0);
+
+
+} //namespace Liv
+
+#endif
+
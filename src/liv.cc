@@ -122,7 +122,7 @@ int main(int argc,char **argv)
 	options.HelpHeader(version());
 	options.UsageLine("liv  [options] [files]");
 	options.Add("real-size", '1', 0, "Initially show all images at 1:1 size");
-	options.Add("recursive", 'r', 0, "Grab images from subdirectories too (unimplemented)");
+	options.Add("recursive", 'r', 0, "Grab images from subdirectories too (only with --make-thumbs for now)");
 	options.Add("bg-color",  'b', 1, "Background color, 0..255 per channel. Or gray, white, black.", 0, "'r,g,b'" );
 	options.Add("checker",   'c', 1, "Use checker patter for background, alternate this color with bg-color" );
 	options.Add("in-window", 'w', 0, "Open in a window, rather than fullscreen");
@@ -133,25 +133,14 @@ int main(int argc,char **argv)
 	//options.Add("tuio",      'T', 0, "Set up a tuio listener on port 3333");
 	options.Add("memthumb",  'M', 0, "Do not generate ~/.thumbnails/*, use in memory previews instead");
 	options.Add("localthumb",'L', 0, "Do not generate ~/.thumbnails/*, use (filedir)/.thumbnails/*");
+	options.Add("preview-memory",'m', 1, "Megabytes of memory to use for loaded previews",              0, "256");
+	options.Add("make-thumbs",'G', 0, "Make thumbnails of files and directories without opening any window, then exit");
+	options.Add("cpu-limit", 'P', 1, "Percent of cpus to use for background work like making previews", 0, "100");
 	options.Add("verbose",   'V', 0, "Say what a click will do as the mouse moves around");
 	options.Add("version",   'v', 0, "Print out version of the program and exit");
 	options.Add("help",      'h', 0, "Print out this help and exit");
 
 	anXApp app;
-	app.SetMaxTimeout(1./30 *1000000);
-	app.init(argc,argv);
-
-	////--------------------mem test
-	//pid_t pid=getpid();
-	//char blah[100];
-	//sprintf(blah,"more /proc/%d/status",pid);
-	//system(blah);
-	//sprintf(blah,"more /proc/meminfo");
-	//system(blah);
-	//---------------------------------
-
-	IconManager *icons = IconManager::GetDefault();
-	icons->AddPath(ICON_DIRECTORY);
 
 	int c,index;
 	int inwindow=0;
@@ -162,6 +151,7 @@ int main(int argc,char **argv)
 	int verbose=0;
 	int usememorythumbs = LivFlags::LIV_Freedesktop_Thumbs;
 	int recursive=0;
+	int makethumbs=0;
 	int slidedelay=0; //default, in milliseconds
 	int bgr=0, bgg=0, bgb=0; //default background color
 	const char *collection=NULL;
@@ -187,6 +177,23 @@ int main(int argc,char **argv)
 			case 'V': verbose = 1; break;  //turn on verbosity
 			case 'M': usememorythumbs = LivFlags::LIV_Memory_Thumbs; break;  //use thumbs in memory, do not generate any
 			case 'L': usememorythumbs = LivFlags::LIV_Local_Thumbs;  break;  //generate thumbs in file's local directory
+			case 'G': makethumbs = 1; break;  //no window, just make thumbnails
+			case 'P': { //cap on background threads
+					long percent = strtol(o->arg(),NULL,10);
+					if (percent <= 0 || percent > 100) {
+						cerr <<"Error: Invalid value for cpu limit."<<endl;
+						exit(1);
+					}
+					TaskScheduler::cpu_limit = percent;
+				} break;
+			case 'm': { //memory budget for previews
+					long mb = strtol(o->arg(),NULL,10);
+					if (mb <= 0) {
+						cerr <<"Error: Invalid value for preview memory."<<endl;
+						exit(1);
+					}
+					preview_cache.Budget(mb * 1024L * 1024L);
+				} break;
 			case 'D': {
 					 //slide show delay in optional arg
 					if (o->arg()) slidedelay=(int) (1000*strtof(o->arg(),NULL));
@@ -237,6 +244,32 @@ int main(int argc,char **argv)
 
 	DBG cerr <<"v: "<<verbose<<" r:"<<recursive<<endl;
 
+	if (makethumbs) {
+		 //headless, so do this before anything touches X
+		const char **paths = new const char*[argc];
+		int n = 0;
+		for (o=options.remaining(); o; o=options.next()) paths[n++] = o->arg();
+		if (!n) paths[n++] = ".";
+
+		int status = make_thumbnails(n, paths, usememorythumbs, recursive);
+		delete[] paths;
+		return status;
+	}
+
+	app.init(argc,argv);
+
+	////--------------------mem test
+	//pid_t pid=getpid();
+	//char blah[100];
+	//sprintf(blah,"more /proc/%d/status",pid);
+	//system(blah);
+	//sprintf(blah,"more /proc/meminfo");
+	//system(blah);
+	//---------------------------------
+
+	IconManager *icons = IconManager::GetDefault();
+	icons->AddPath(ICON_DIRECTORY);
+
 	int hh,ww,xx,yy;
 	if (inwindow) {
 		hh=300;
@@ -1,8 +1,16 @@
 
 #include <dirent.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
 
 #include "livwindow.h"
+#include "pnginfo.h"
+#include "exifthumb.h"
+#include "jpegdecode.h"
+#include "downscale.h"
+#include "scheduler.h"
 
 #include <lax/language.h>
 #include <lax/laximlib.h>
@@ -18,6 +26,9 @@
 #include <lax/refptrstack.cc>
 
 #include <cstring>
+#include <cmath>
+#include <cctype>
+#include <strings.h>
 #include <iostream>
 
 
@@ -29,132 +40,1405 @@ using namespace LaxFiles;
 
 #define LIV_VERSION "0.1"
 
+//! Server memory for images kept in LivWindow::pixmap_cache, in megabytes.
+#define LIV_DEFAULT_PIXMAP_MEMORY  128
+
 
 namespace Liv {
 
 
 
-//see PositionTagBoxes(), how many lines down from top to place tag boxes
-#define SHOW_NUM_SINGLE_LINE  (4)
+//see PositionTagBoxes(), how many lines down from top to place tag boxes
+#define SHOW_NUM_SINGLE_LINE  (4)
+
+//least milliseconds between redraws for background work, see LivWindow::Refresh()
+#define LIV_FRAME_MS  (16)
+
+//milliseconds to wait before trying again when a worker is using imlib, see LivWindow::Refresh()
+#define LIV_IMLIB_RETRY_MS  (5)
+
+//milliseconds without zooming before redrawing at full quality, see LivWindow::Interacting()
+#define LIV_SETTLE_MS  (150)
+
+//seconds for a zoom animation to cover all but 1/e of what is left, see LivWindow::Animate()
+#define LIV_ZOOM_TAU  (.04)
+
+//how fast kinetic panning slows down, per second, and the pixels per second it stops at
+#define LIV_KINETIC_FRICTION  (4.)
+#define LIV_KINETIC_MIN       (20.)
+
+//milliseconds between Next or Previous that count as a held key, and how long to stop on an
+//image before actually loading it, see LivWindow::Navigate()
+#define LIV_KEY_REPEAT_MS    (100)
+#define LIV_SCRUB_SETTLE_MS  (200)
+
+
+//------------------------------global setup------------------------
+
+/*! Path of file to run to pipe in exif info. Default is look for exiv2.
+ */
+const char *exif_exec = "/usr/bin/exiv2";
+
+
+
+//----------------------thread info--------------------------------
+pthread_mutex_t tomakelist_mutex=PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t imlib_mutex     =PTHREAD_MUTEX_INITIALIZER;
+static int imlib_wanted = 0; //the ui thread found imlib_mutex busy, so workers should let it have it next
+
+//! Lock imlib_mutex from a worker, first giving the ui thread a little time to get it if it is waiting.
+static void lock_imlib_for_worker()
+{
+	for (int c=0; c<20 && __atomic_load_n(&imlib_wanted, __ATOMIC_ACQUIRE); c++) usleep(1000);
+	pthread_mutex_lock(&imlib_mutex);
+}
+
+
+//-------------------------------- preview creation threads ----------------------------------
+
+RefPtrStack<ImageFile> previews_to_make;         //for thumbnails off screen
+RefPtrStack<ImageFile> visible_previews_to_make; //for thumbnails on screen, made first
+pthread_mutex_t generate_mutex=PTHREAD_MUTEX_INITIALIZER;
+
+void generate_preview_thread();
+void prioritize_preview(ImageFile *fileobject);
+
+/*! \class PreviewStats
+ * \brief Running totals of background preview generation, see get_preview_stats().
+ */
+
+PreviewStats::PreviewStats()
+{
+	queued = made = failed = 0;
+	bytes = 0;
+}
+
+//! Protected by tomakelist_mutex.
+static PreviewStats preview_stats;
+
+//! Copy the current preview_stats to stats.
+void get_preview_stats(PreviewStats *stats)
+{
+	pthread_mutex_lock(&tomakelist_mutex);
+	*stats = preview_stats;
+	pthread_mutex_unlock(&tomakelist_mutex);
+}
+
+//! Whether there is a ui thread to hand things to, rather than running headless.
+static bool have_ui()
+{
+	return anXApp::app && anXApp::app->dpy;
+}
+
+
+//-------------------------------- ui wakeups ----------------------------------
+//
+// Background threads tell the ui about finished work with post_ui_wakeup(). Only the first
+// post since the ui last called take_ui_wakeup() actually bumps the event loop, so a burst
+// of finished previews costs one wakeup and one refresh, not one of each per preview.
+// Laxkit's event loop only selects on the X connection, so bump() is still the way in.
+
+//! Whether something was posted since the last take_ui_wakeup(). Only touched atomically.
+static int ui_wakeup = 0;
+
+//! Tell the ui thread, if there is one, that something needs its attention.
+static void post_ui_wakeup()
+{
+	if (__atomic_exchange_n(&ui_wakeup, 1, __ATOMIC_ACQ_REL) == 0 && have_ui()) anXApp::app->bump();
+}
+
+//! Return whether anything was posted with post_ui_wakeup(), and clear that. Called by the ui thread.
+static bool take_ui_wakeup()
+{
+	return __atomic_exchange_n(&ui_wakeup, 0, __ATOMIC_ACQ_REL) != 0;
+}
+
+
+//-------------------------------- ui thread ----------------------------------
+
+static pthread_t ui_thread;
+static bool ui_thread_set = false;
+
+//! ImageFiles whose last count went away off the ui thread, see delete_dead_files(). Protected by dead_mutex.
+static PtrStack<ImageFile> dead_files;
+static pthread_mutex_t dead_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! Make the calling thread the one that owns the ui side of ImageFiles. Called by LivWindow.
+static void set_ui_thread()
+{
+	ui_thread = pthread_self();
+	ui_thread_set = true;
+}
+
+//! Whether things only the ui thread may do can be done here. Always true when headless.
+static bool on_ui_thread()
+{
+	return !ui_thread_set || !have_ui() || pthread_equal(pthread_self(), ui_thread);
+}
+
+//! Delete the ImageFiles that ImageFile::dec_count() passed over. Called by the ui thread.
+static int delete_dead_files()
+{
+	int n = 0;
+	while (1) {
+		pthread_mutex_lock(&dead_mutex);
+		ImageFile *file = dead_files.pop();
+		pthread_mutex_unlock(&dead_mutex);
+		if (!file) break;
+
+		delete file;
+		n++;
+	}
+	return n;
+}
+
+/*! Called by preview threads when done with fileobject, to add to preview_stats.
+ */
+static void preview_finished(ImageFile *fileobject, bool made)
+{
+	pthread_mutex_lock(&tomakelist_mutex);
+	if (made) preview_stats.made++;
+	else preview_stats.failed++;
+	if (fileobject->Has(FILE_Has_stat)) preview_stats.bytes += fileobject->fileinfo.st_size;
+	pthread_mutex_unlock(&tomakelist_mutex);
+}
+
+
+//-------------------------------- thumbnail sizes ----------------------------------
+
+//! Max pixel width or height of each ThumbSize.
+int thumb_sizes[THUMB_MAX] = { 128, 256, 512, 1024 };
+
+//! Freedesktop thumbnail directory name for each ThumbSize.
+static const char *thumb_dirs[THUMB_MAX] = { "normal", "large", "x-large", "xx-large" };
+
+//! Return the smallest ThumbSize that is at least pixels big, or the biggest one.
+int thumb_level_for_size(double pixels)
+{
+	for (int c=0; c<THUMB_MAX; c++) {
+		if (thumb_sizes[c] >= pixels) return c;
+	}
+	return THUMB_MAX-1;
+}
+
+/*! Return a new char[] of the freedesktop thumbnail path of file, with "large" replaced
+ * by subdir, such as "x-large" or "fail/liv".
+ */
+static char *thumb_file_in_dir(const char *file, const char *subdir)
+{
+	char *large = freedesktop_thumbnail(file,'l');
+	if (!large) return NULL;
+	if (!strcmp(subdir, "large")) return large;
+
+	 //find last "/large/"
+	char *dir = NULL, *found = large;
+	while ((found = strstr(found, "/large/")) != NULL) { dir = found; found++; }
+	if (!dir) {
+		delete[] large;
+		return NULL;
+	}
+
+	const char *rest = dir + strlen("/large/");
+	char *levelfile = new char[strlen(large) + strlen(subdir) + 3];
+	*dir = '\0';
+	sprintf(levelfile, "%s/%s/%s", large, subdir, rest);
+
+	delete[] large;
+	return levelfile;
+}
+
+/*! Return a new char[] of the freedesktop thumbnail path of file for the given ThumbSize.
+ * This is the same hashed name as freedesktop_thumbnail(file,'l'), but in the directory for level.
+ */
+char *thumb_level_file(const char *file, int level)
+{
+	if (level < 0 || level >= THUMB_MAX) return NULL;
+	return thumb_file_in_dir(file, thumb_dirs[level]);
+}
+
+/*! Return a new char[] of the freedesktop failure file for file, which is
+ * ~/.thumbnails/fail/liv/(hash).png.
+ */
+char *thumb_fail_file(const char *file)
+{
+	return thumb_file_in_dir(file, "fail/liv");
+}
+
+/*! Make sure the last depth directories containing file exist, creating them with mode 0700
+ * if necessary. For instance, depth 2 for ~/.thumbnails/fail/liv/(hash).png makes fail and fail/liv.
+ */
+static void make_parent_dirs(char *file, int depth)
+{
+	char *slash = strrchr(file, '/');
+	if (!slash || depth <= 0) return;
+
+	*slash = '\0';
+	make_parent_dirs(file, depth-1);
+	mkdir(file, 0700);
+	*slash = '/';
+}
+
+/*! Remember that no preview could be made for fileobject, keyed by its path and mtime,
+ * so that later tries are skipped until the file changes. See ImageFile::PreviewFailed().
+ * The record goes where that file's previews go, so it is only on disk where they are:
+ *
+ * - LIV_Freedesktop_Thumbs: following the freedesktop spec, a 1x1 png with Thumb::URI and
+ *   Thumb::MTime in ~/.thumbnails/fail/liv/.
+ * - LIV_Local_Thumbs: a record without pixels in the directory's ThumbPack.
+ * - LIV_Memory_Thumbs: just fileobject->preview_fail_mtime, for this run only.
+ */
+void record_preview_failure(ImageFile *fileobject)
+{
+	fileobject->fillinfo(FILE_Has_stat);
+	if (!fileobject->Has(FILE_Has_stat)) return;
+
+	if (fileobject->thumb_location == LIV_Memory_Thumbs) {
+		__atomic_store_n(&fileobject->preview_fail_mtime, (long)fileobject->fileinfo.st_mtime, __ATOMIC_RELEASE);
+		return;
+	}
+
+	if (fileobject->thumb_location == LIV_Local_Thumbs) {
+		if (!fileobject->thumbpack) return;
+		const char *base = strrchr(fileobject->filename, '/');
+		fileobject->thumbpack->Append(base ? base+1 : fileobject->filename,
+				fileobject->fileinfo.st_size, fileobject->fileinfo.st_mtime, 0,0, 0,0, 0, NULL);
+		return;
+	}
+
+	if (fileobject->thumb_location != LIV_Freedesktop_Thumbs) return;
+
+	char *failfile = thumb_fail_file(fileobject->filename);
+	if (!failfile) return;
+
+	 //make sure fail/ and fail/liv/ exist
+	make_parent_dirs(failfile, 2);
+
+	PngInfo info;
+	info.SetOriginal(fileobject->filename, fileobject->fileinfo.st_mtime, fileobject->fileinfo.st_size);
+	unsigned int pixel = 0;
+	int status = info.Write(failfile, 1,1, &pixel, 1);
+
+	DBG cerr <<"Recording preview failure for "<<fileobject->filename<<" in "<<failfile<<": "<<(status ? "error" : "ok")<<endl;
+
+	delete[] failfile;
+}
+
+
+/*! Return a new image that is source resized to exactly nw x nh. Reductions go through
+ * downscale_argb(), which is both faster and smoother than imlib's own scaling. Anything
+ * else falls back to imlib_create_cropped_scaled_image().
+ * Should be called with imlib_mutex locked.
+ */
+Imlib_Image downscale_imlib(Imlib_Image source, int nw, int nh)
+{
+	if (!source || nw < 1 || nh < 1) return NULL;
+
+	imlib_context_set_image(source);
+	int w = imlib_image_get_width();
+	int h = imlib_image_get_height();
+	char has_alpha = imlib_image_has_alpha();
+
+	if (nw > w || nh > h) {
+		imlib_context_set_anti_alias(1);
+		return imlib_create_cropped_scaled_image(0,0, w,h, nw,nh);
+	}
+
+	DATA32 *src = imlib_image_get_data_for_reading_only();
+	Imlib_Image scaled = imlib_create_image(nw, nh);
+	if (!src || !scaled) return NULL;
+
+	imlib_context_set_image(scaled);
+	DATA32 *dst = imlib_image_get_data();
+	downscale_argb(src, w,h,w, dst, nw,nh,nw);
+	imlib_image_put_back_data(dst);
+	imlib_image_set_has_alpha(has_alpha);
+	return scaled;
+}
+
+/*! Set nw,nh to w,h scaled down to fit in a max x max square, keeping the aspect.
+ * Sizes already fitting are not changed.
+ */
+static void fit_size(int w, int h, int max, int *nw, int *nh)
+{
+	*nw = w;
+	*nh = h;
+	if (w <= max && h <= max) return;
+
+	if (w > h) { *nw = max; *nh = (int)((double)h * max / w + .5); }
+	else       { *nh = max; *nw = (int)((double)w * max / h + .5); }
+	if (*nw < 1) *nw = 1;
+	if (*nh < 1) *nh = 1;
+}
+
+/*! Return the already decoded image of fileobject that is cheapest to make a preview
+ * fitting in a size x size square from, or NULL if there is none.
+ *
+ * Candidates are the full image, if it has been loaded for viewing, and any loaded
+ * pyramid level at least size big. The smallest candidate wins.
+ * Must be called with imlib_mutex locked. The returned image has its count incremented,
+ * so it stays valid even if the ui drops it meanwhile.
+ */
+LaxImage *decoded_source_for(ImageFile *fileobject, int size)
+{
+	LaxImage *best = NULL, *img;
+	long bestarea = 0, area;
+
+	for (int c = 0; c <= THUMB_MAX; c++) {
+		img = (c < THUMB_MAX ? fileobject->thumbs[c].image : fileobject->image);
+		if (!img || !dynamic_cast<LaxImlibImage*>(img)) continue;
+		if (c < THUMB_MAX && img->w() < size && img->h() < size) continue;
+
+		area = (long)img->w() * img->h();
+		if (!best || area < bestarea) {
+			best = img;
+			bestarea = area;
+		}
+	}
+
+	if (best) best->inc_count();
+	return best;
+}
+
+//! In another thread, create a scaled image and save to the freedesktop thumbs for level.
+/*! Each must fit in a thumb_sizes[level] square. The default is the "large", 256x256.
+ *
+ * For LIV_Memory_Thumbs and LIV_Local_Thumbs, the preview is made at THUMB_Large size
+ * and installed with ImageFile::SetPreview() on the ui thread's next refresh. For
+ * LIV_Local_Thumbs, it is also appended to the directory's ThumbPack.
+ *
+ * If there is "/.thumbnails/" in the path, then do nothing, as it is already a thumbnail.
+ * If the preview file exists already, do nothing unless replace is true.
+ *
+ * lane is TASK_Visible_Thumbs for thumbnails on screen, which are made before any
+ * TASK_Offscreen_Thumbs ones. See prioritize_preview().
+ */
+void generate_preview(ImageFile *fileobject, int level = THUMB_Large, bool replace = false, int lane = TASK_Offscreen_Thumbs)
+{
+	const char *file = fileobject->filename;
+	const char *preview = NULL;
+	bool in_memory = (fileobject->thumb_location == LIV_Memory_Thumbs || fileobject->thumb_location == LIV_Local_Thumbs);
+
+	if (strstr(file,"/.thumbnails/")) {
+		DBG cerr <<"Trying to create a preview of a preview.. skipping! file="<<file<<endl;
+		return;
+	}
+
+	if (in_memory) {
+		 //in memory previews only come in one size
+		level = THUMB_Large;
+
+	} else {
+		preview = fileobject->ThumbFile(level);
+		if (!preview) return;
+
+		if (!replace && file_exists(preview,1,NULL) == S_IFREG) {
+			//something there already exists!
+			DBG cerr <<"skipping generate_preview(), already exists for: "<<preview<<endl;
+			return;
+		}
+	}
+
+	pthread_mutex_lock(&tomakelist_mutex);
+
+	if (fileobject->thumbs_to_make & (1<<level)) {
+		 //already queued
+		pthread_mutex_unlock(&tomakelist_mutex);
+		if (lane == TASK_Visible_Thumbs) prioritize_preview(fileobject);
+		return;
+	}
+
+	DBG cerr <<"Queueing to generate preview "<<(preview ? preview : "(in memory)")<<" for file "<<file<<"..."<<endl;
+
+	if (fileobject->thumbs_to_make == 0) {
+		if (lane == TASK_Visible_Thumbs) visible_previews_to_make.push(fileobject);
+		else previews_to_make.push(fileobject);
+		preview_stats.queued++;
+	} else if (lane == TASK_Visible_Thumbs) {
+		 //queued off screen for another level
+		int i = previews_to_make.findindex(fileobject);
+		if (i >= 0) {
+			visible_previews_to_make.push(fileobject);
+			previews_to_make.remove(i);
+		}
+	}
+	fileobject->thumbs_to_make |= (1<<level);
+	if (in_memory) fileobject->preview_state = PREVIEW_Loading;
+	else fileobject->thumbs[level].state = PREVIEW_Loading;
+
+	 //the io stage must not look at the states, so it gets which bigger previews exist from here
+	fileobject->thumbs_existing = 0;
+	if (!in_memory) {
+		for (int c=0; c<THUMB_MAX; c++) {
+			if ((fileobject->thumbs[c].state == PREVIEW_Exists_Not_Loaded || fileobject->thumbs[c].state == PREVIEW_Loaded)
+					&& fileobject->ThumbFile(c))
+				fileobject->thumbs_existing |= (1<<c);
+		}
+	}
+
+	pthread_mutex_unlock(&tomakelist_mutex);
+
+	generate_preview_thread();
+}
+
+/*! If previews of fileobject are waiting to be started as off screen ones, make them
+ * visible ones instead, which are started first. Call when fileobject is on screen.
+ */
+void prioritize_preview(ImageFile *fileobject)
+{
+	pthread_mutex_lock(&tomakelist_mutex);
+	if (fileobject->thumbs_to_make) {
+		int i = previews_to_make.findindex(fileobject);
+		if (i >= 0) {
+			visible_previews_to_make.push(fileobject);
+			previews_to_make.remove(i);
+		}
+	}
+	pthread_mutex_unlock(&tomakelist_mutex);
+}
+
+//-------------------------------- preview pipeline ----------------------------------
+//
+// Previews are made in three stages:
+//
+//   io:      io threads pop from visible_previews_to_make, then previews_to_make, pick the
+//            source, and read in what is worth reading
+//   decode:  a PreviewTask on the preview scheduler decodes the source and scales it down to
+//            each requested level
+//   write:   write threads take the PreviewTask from write_queue, save pngs or append to the
+//            ThumbPack, then hand it to the ui thread with TaskScheduler::Completed()
+//
+// Writing has threads of its own, so that a slow ~/.thumbnails or nfs does not hold
+// the decoding workers, except when write_queue is full.
+//
+// Worker threads decode into liv's own buffers, so imlib_mutex is only needed by them for
+// formats that only imlib can load. In-memory previews become imlib images in
+// PreviewTask::Finish(), which the ui thread calls when it next refreshes. Such an imlib load
+// can take a long time, so the ui thread never waits for imlib_mutex in Refresh(), it just
+// tries again a little later, see LivWindow::ImlibBusy().
+//
+// Decoding is done by whatever TaskScheduler was given to set_preview_scheduler(), in its
+// TASK_Visible_Thumbs or TASK_Offscreen_Thumbs lane. The io threads block when those lanes
+// are full, so readahead is bounded by the lane limits. The number of io and write threads is
+// adjusted by tune_preview_pipeline() from the time per job they take, compared to decoding.
+
+
+//! Files bigger than this are not read into memory by the io stage, only hinted to the kernel.
+#define PREVIEW_MAX_READAHEAD  (32*1024*1024)
+
+//! Max threads of the io stage.
+#define PREVIEW_MAX_IO_THREADS  8
+
+//! Max threads of the write stage, and how many decoded jobs may wait for it.
+#define PREVIEW_MAX_WRITE_THREADS  4
+#define PREVIEW_WRITE_QUEUE        16
+
+
+/*! \class PreviewJob
+ * \brief The making of the previews of one ImageFile, as it passes through the preview pipeline.
+ */
+class PreviewJob
+{
+  public:
+	ImageFile *fileobject;  //counted, taken over from previews_to_make
+	unsigned int levels;    //bits of ThumbSize to make
+	int lane;               //TASK_Visible_Thumbs or TASK_Offscreen_Thumbs
+	bool in_memory;         //for LIV_Memory_Thumbs or LIV_Local_Thumbs, just one level, see PreviewTask::Finish()
+	unsigned int existing;  //bits of ThumbSize with a preview file when queued, see ImageFile::thumbs_existing
+	char *source;           //file to make previews from, the original or a bigger existing preview
+	bool from_original;     //source is the original file, so failure means it is not previewable
+	LaxImage *decoded;      //already decoded image to use instead of source, see decoded_source_for()
+	const unsigned int *decoded_argb; //decoded's pixels, read without imlib
+	int decoded_w, decoded_h;
+	unsigned char *data;    //jpeg or png data read in by the io stage, or NULL
+	long datalen;
+	bool embedded;          //data is a preview embedded in the original, not the whole thing
+	int orig_w, orig_h;     //size of the original, or 0 if not known
+	unsigned int *pixels[THUMB_MAX]; //scaled argb for each of levels, or NULL on failure
+	int width[THUMB_MAX], height[THUMB_MAX];
+	int has_alpha;
+	bool written[THUMB_MAX]; //pixels[level] was saved to its file, see write_preview()
+	bool made;               //some preview came of the job
+
+	PreviewJob(ImageFile *file, unsigned int nlevels, int nlane);
+	~PreviewJob();
+	int Largest();
+};
+
+PreviewJob::PreviewJob(ImageFile *file, unsigned int nlevels, int nlane)
+{
+	fileobject = file;
+	in_memory = (file->thumb_location == LIV_Memory_Thumbs || file->thumb_location == LIV_Local_Thumbs);
+	levels = (in_memory ? (1<<THUMB_Large) : nlevels);
+	lane = nlane;
+	existing = 0;
+	source = NULL;
+	from_original = false;
+	decoded = NULL;
+	decoded_argb = NULL;
+	decoded_w = decoded_h = 0;
+	data = NULL;
+	datalen = 0;
+	embedded = false;
+	orig_w = orig_h = 0;
+	has_alpha = 0;
+	for (int c=0; c<THUMB_MAX; c++) {
+		pixels[c] = NULL;
+		width[c] = height[c] = 0;
+		written[c] = false;
+	}
+	made = false;
+}
+
+//! Note this does not release decoded, which needs imlib_mutex, see release_preview_job().
+PreviewJob::~PreviewJob()
+{
+	for (int c=0; c<THUMB_MAX; c++) delete[] pixels[c];
+	delete[] source;
+	delete[] data;
+	if (fileobject) fileobject->dec_count();
+}
+
+//! Return the biggest ThumbSize in levels.
+int PreviewJob::Largest()
+{
+	for (int level = THUMB_MAX-1; level > 0; level--)
+		if (levels & (1<<level)) return level;
+	return 0;
+}
+
+//! Delete job, letting go of its decoded image. imlib_mutex must NOT be locked.
+static void release_preview_job(PreviewJob *job)
+{
+	if (job->decoded) {
+		pthread_mutex_lock(&imlib_mutex);
+		job->decoded->dec_count();
+		job->decoded = NULL;
+		pthread_mutex_unlock(&imlib_mutex);
+	}
+	delete job;
+}
+
+
+/*! \class PreviewStage
+ * \brief Thread counts and timing of one stage of the preview pipeline. Protected by generate_mutex.
+ */
+class PreviewStage
+{
+  public:
+	const char *name;
+	void *(*func)(void *);
+	int running;  //threads currently in the stage
+	int target;   //threads the stage should have, see tune_preview_pipeline()
+	int max;
+	long jobs;    //jobs done so far
+	double wall;  //moving average of seconds per job
+	double cpu;   //moving average of cpu seconds per job, the rest of wall is waiting
+
+	PreviewStage(const char *nname, void *(*nfunc)(void *), int nmax);
+};
+
+PreviewStage::PreviewStage(const char *nname, void *(*nfunc)(void *), int nmax)
+{
+	name = nname;
+	func = nfunc;
+	running = 0;
+	target = 1;
+	max = nmax;
+	jobs = 0;
+	wall = cpu = 0;
+}
+
+
+static void *preview_io_stage(void *);
+static void *preview_write_stage(void *);
+
+static PreviewStage io_stage    ("io",     preview_io_stage,    PREVIEW_MAX_IO_THREADS);
+static PreviewStage decode_stage("decode", NULL,                1); //threads are the scheduler's, see set_preview_scheduler()
+static PreviewStage write_stage ("write",  preview_write_stage, PREVIEW_MAX_WRITE_THREADS);
+
+//! Where PreviewTasks go, see set_preview_scheduler(). Protected by generate_mutex.
+static TaskScheduler *preview_scheduler = NULL;
+
+//! Signalled when something is pushed onto previews_to_make. Used with tomakelist_mutex.
+static pthread_cond_t tomake_cond = PTHREAD_COND_INITIALIZER;
+
+
+static double clock_seconds(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.;
+}
+
+/*! Make sure the io and write stages of the preview pipeline have as many threads as their targets.
+ * Must be called with generate_mutex locked.
+ */
+static void start_preview_threads()
+{
+	PreviewStage *stages[2] = { &io_stage, &write_stage };
+	for (int c=0; c<2; c++) {
+		PreviewStage *stage = stages[c];
+		while (stage->running < stage->target) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, stage->func, NULL) != 0) break;
+			pthread_detach(thread);
+			stage->running++;
+			DBG cerr <<"Started preview "<<stage->name<<" thread, now "<<stage->running<<endl;
+		}
+	}
+}
+
+/*! Return how many threads stage needs to keep up with decoding, see tune_preview_pipeline().
+ * To not flap between two counts, stages grow as soon as needed, but shrink only when well under.
+ */
+static int preview_threads_needed(PreviewStage *stage)
+{
+	double need = decode_stage.target * stage->wall / decode_stage.wall;
+	int threads = (int)ceil(need);
+	if (threads < stage->target && (int)ceil(1.5 * need) >= stage->target) threads = stage->target;
+
+	if (threads < 1) threads = 1;
+	else if (threads > stage->max) threads = stage->max;
+	return threads;
+}
+
+/*! Resize the io and write stages so that they keep up with decoding. A stage taking t seconds
+ * per job with n threads gets through n/t jobs a second, so it needs
+ * decode threads * its time / decode time threads to match the decoding.
+ * For io and write that time is mostly waiting on the disk, which more threads overlap.
+ * Must be called with generate_mutex locked.
+ */
+static void tune_preview_pipeline()
+{
+	if (decode_stage.jobs < 4 || decode_stage.wall <= 0) return;
+
+	int io = preview_threads_needed(&io_stage);
+	int write = (write_stage.jobs ? preview_threads_needed(&write_stage) : write_stage.target);
+
+	if (io != io_stage.target || write != write_stage.target) {
+		DBG cerr <<"Preview pipeline: io "<<io_stage.wall*1000<<" ms/job ("<<io_stage.cpu*1000<<" cpu), decode "
+		DBG      <<decode_stage.wall*1000<<", write "<<write_stage.wall*1000<<" ("<<write_stage.cpu*1000<<" cpu)"
+		DBG      <<" -> io threads "<<io<<", write threads "<<write<<endl;
+		io_stage.target = io;
+		write_stage.target = write;
+		start_preview_threads();
+	}
+}
+
+/*! Add the timing of one job to stage. Return whether the calling thread should quit, because
+ * the stage has more threads than its target.
+ */
+static bool preview_stage_done(PreviewStage *stage, double wall_start, double cpu_start)
+{
+	double wall = clock_seconds(CLOCK_MONOTONIC) - wall_start;
+	double cpu  = clock_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+	pthread_mutex_lock(&generate_mutex);
+
+	if (stage->jobs == 0) {
+		stage->wall = wall;
+		stage->cpu  = cpu;
+	} else {
+		stage->wall = .9*stage->wall + .1*wall;
+		stage->cpu  = .9*stage->cpu  + .1*cpu;
+	}
+	stage->jobs++;
+	if (stage == &decode_stage && stage->jobs % 8 == 0) tune_preview_pipeline();
+
+	bool quit = (stage->func && stage->running > stage->target);
+	if (quit) stage->running--;
+
+	pthread_mutex_unlock(&generate_mutex);
+	return quit;
+}
+
+/*! Decode previews with scheduler's workers from now on. Its count is incremented.
+ * Pass NULL before shutting down the old one. Previews read in while there is no scheduler
+ * are dropped as failed.
+ */
+void set_preview_scheduler(TaskScheduler *scheduler)
+{
+	pthread_mutex_lock(&generate_mutex);
+	TaskScheduler *old = preview_scheduler;
+	preview_scheduler = scheduler;
+	if (scheduler) {
+		scheduler->inc_count();
+		int n = scheduler->NumThreads();
+		decode_stage.target = decode_stage.max = n;
+		scheduler->LaneLimit(TASK_Visible_Thumbs,   2*n + 2);
+		scheduler->LaneLimit(TASK_Offscreen_Thumbs, 2*n + 2);
+	}
+	pthread_mutex_unlock(&generate_mutex);
+
+	 //not under generate_mutex, as the last count joins workers that may want it
+	if (old) old->dec_count();
+}
+
+//! Wake up the preview pipeline for newly queued previews, starting its threads if necessary.
+void generate_preview_thread()
+{
+	pthread_mutex_lock(&generate_mutex);
+	start_preview_threads();
+	pthread_mutex_unlock(&generate_mutex);
+
+	pthread_mutex_lock(&tomakelist_mutex);
+	pthread_cond_signal(&tomake_cond);
+	pthread_mutex_unlock(&tomakelist_mutex);
+}
+
+/*! Read all of file into a new unsigned char[], putting its length in len_ret.
+ * Files bigger than max are not read, only hinted to the kernel as needed soon, and
+ * NULL is returned, as for errors.
+ */
+static unsigned char *read_file_data(const char *file, long max, long *len_ret)
+{
+	*len_ret = 0;
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size > max) {
+		posix_fadvise(fd, 0,0, POSIX_FADV_WILLNEED);
+		close(fd);
+		return NULL;
+	}
+
+	unsigned char *data = new unsigned char[st.st_size];
+	long n = 0;
+	ssize_t r;
+	while (n < st.st_size && (r = read(fd, data+n, st.st_size-n)) > 0) n += r;
+	close(fd);
+
+	*len_ret = n;
+	return data;
+}
+
+//! Whether data starts like something decode_jpeg() or decode_png() can do.
+static bool is_jpeg_or_png(const unsigned char *data, long len)
+{
+	return len > 8 && ((data[0] == 0xff && data[1] == 0xd8) || !memcmp(data, "\x89PNG", 4));
+}
+
+/*! The io part of a job: decide what to make the previews from, and read in what is worth
+ * reading now, rather than having the decode stage wait for it.
+ */
+static void read_preview_source(PreviewJob *job)
+{
+	ImageFile *fileobject = job->fileobject;
+	int size = thumb_sizes[job->Largest()];
+
+	 //pixels already decoded for viewing are cheaper than any file
+	pthread_mutex_lock(&imlib_mutex);
+	job->decoded = decoded_source_for(fileobject, size);
+	if (job->decoded) {
+		imlib_context_set_image(dynamic_cast<LaxImlibImage*>(job->decoded)->Image());
+		job->decoded_w = imlib_image_get_width();
+		job->decoded_h = imlib_image_get_height();
+		job->has_alpha = imlib_image_has_alpha();
+		job->decoded_argb = imlib_image_get_data_for_reading_only();
+	}
+	pthread_mutex_unlock(&imlib_mutex);
+	if (job->decoded) return;
+
+	 //then an existing bigger preview, as known when queued, see generate_preview().
+	 //thumbs[].file never changes once set, so it is safe to read here.
+	if (!job->in_memory) {
+		for (int c = job->Largest()+1; c < THUMB_MAX && !job->source; c++) {
+			if (job->existing & (1<<c)) job->source = newstr(fileobject->thumbs[c].file);
+		}
+	}
+
+	if (!job->source) {
+		job->source = newstr(fileobject->filename);
+		job->from_original = true;
+
+		 //an embedded jpeg is far less to read than a whole raw file
+		EmbeddedPreview embedded;
+		if (embedded.Find(job->source, size) == 0 && (job->data = embedded.Read(job->source)) != NULL) {
+			DBG cerr <<"Using embedded "<<embedded.width<<'x'<<embedded.height<<" preview of "<<job->source<<endl;
+			job->datalen  = embedded.length;
+			job->embedded = true;
+			if (embedded.orig_width > 0 && embedded.orig_height > 0) {
+				job->orig_w = embedded.orig_width;
+				job->orig_h = embedded.orig_height;
+			}
+			return;
+		}
+	}
+
+	 //read the whole file: jpegs and pngs are kept for decode_jpeg() and decode_png(),
+	 //anything else imlib will load itself, but from the page cache
+	long n = 0;
+	unsigned char *data = read_file_data(job->source, PREVIEW_MAX_READAHEAD, &n);
+	if (!data) return;
+
+	if (is_jpeg_or_png(data, n)) {
+		job->data = data;
+		job->datalen = n;
+	} else delete[] data;
+}
+
+/*! The decode part of a job: get source pixels, and scale them down to the biggest of
+ * job->levels, then each smaller level from the one above it.
+ *
+ * Jpegs, pngs, and already decoded images are all done in liv's own buffers, without imlib.
+ * Only other formats need imlib's loaders, which use imlib's global context, so just those
+ * loads lock imlib_mutex.
+ */
+static void decode_preview(PreviewJob *job)
+{
+	int size = thumb_sizes[job->Largest()];
+	const unsigned int *src = NULL;
+	int w = 0, h = 0;
+	unsigned int *decoded = NULL;
+	Imlib_Image loaded = NULL;
+
+	if (job->decoded_argb) {
+		src = job->decoded_argb;
+		w = job->decoded_w;
+		h = job->decoded_h;
+
+	} else if (job->data && job->data[0] == 0xff) {
+		bool want_orig = (job->from_original && !job->embedded);
+		src = decoded = decode_jpeg(job->data, job->datalen, size, &w, &h,
+									want_orig ? &job->orig_w : NULL, want_orig ? &job->orig_h : NULL);
+
+	} else if (job->data) {
+		src = decoded = decode_png(job->data, job->datalen, &w, &h, &job->has_alpha);
+		if (src && job->from_original) {
+			job->orig_w = w;
+			job->orig_h = h;
+		}
+	}
+
+	if (!src && job->source) {
+		 //full decode, by whatever imlib can load
+		lock_imlib_for_worker();
+		loaded = imlib_load_image_without_cache(job->source);
+		if (loaded) {
+			imlib_context_set_image(loaded);
+			w = imlib_image_get_width();
+			h = imlib_image_get_height();
+			job->has_alpha = imlib_image_has_alpha();
+			src = imlib_image_get_data_for_reading_only();
+			if (job->from_original) {
+				job->orig_w = w;
+				job->orig_h = h;
+			}
+		}
+		pthread_mutex_unlock(&imlib_mutex);
+	}
+
+	delete[] job->data;
+	job->data = NULL;
+
+	const unsigned int *from = src;
+	int fw = w, fh = h;
+	for (int level = THUMB_MAX-1; level >= 0 && from; level--) {
+		if (!(job->levels & (1<<level))) continue;
+
+		int nw, nh;
+		fit_size(fw,fh, thumb_sizes[level], &nw,&nh);
+		unsigned int *argb = new unsigned int[nw*nh];
+		if (nw == fw && nh == fh) memcpy(argb, from, nw*nh*sizeof(unsigned int));
+		else downscale_argb(from, fw,fh,fw, argb, nw,nh,nw);
+
+		job->pixels[level] = argb;
+		job->width [level] = nw;
+		job->height[level] = nh;
+		from = argb;
+		fw = nw;
+		fh = nh;
+	}
+
+	delete[] decoded;
+	if (loaded) {
+		pthread_mutex_lock(&imlib_mutex);
+		imlib_context_set_image(loaded);
+		imlib_free_image();
+		pthread_mutex_unlock(&imlib_mutex);
+	}
+}
+
+/*! The write part of a job: save the scaled pixels where they belong, and note in job
+ * what came of it. fileobject's preview states are left to apply_preview_states().
+ */
+static void write_preview(PreviewJob *job)
+{
+	ImageFile *fileobject = job->fileobject;
+	fileobject->fillinfo(FILE_Has_stat);
+
+	if (job->orig_w <= 0 && fileobject->Has(FILE_Has_image_info)) {
+		job->orig_w = fileobject->width;
+		job->orig_h = fileobject->height;
+	}
+
+	if (job->in_memory) {
+		int level = THUMB_Large;
+		unsigned int *argb = job->pixels[level];
+		int packed = 1;
+
+		if (argb && fileobject->thumbpack && fileobject->Has(FILE_Has_stat)) {
+			const char *base = strrchr(fileobject->filename, '/');
+			packed = fileobject->thumbpack->Append(base ? base+1 : fileobject->filename,
+					fileobject->fileinfo.st_size, fileobject->fileinfo.st_mtime, job->orig_w, job->orig_h,
+					job->width[level], job->height[level], job->has_alpha, argb);
+		}
+
+		 //with a ui, the pixels get installed as the preview in PreviewTask::Finish()
+		job->made = (have_ui() ? argb != NULL : packed == 0);
+
+	} else {
+		PngInfo info;
+		if (fileobject->Has(FILE_Has_stat))
+			info.SetOriginal(fileobject->filename, fileobject->fileinfo.st_mtime, fileobject->fileinfo.st_size);
+		if (job->orig_w > 0 && job->orig_h > 0) {
+			info.orig_width  = job->orig_w;
+			info.orig_height = job->orig_h;
+		}
+
+		for (int level = THUMB_MAX-1; level >= 0; level--) {
+			if (!(job->levels & (1<<level))) continue;
 
+			const char *preview = fileobject->thumbs[level].file;
+			int status = 1;
+			if (job->pixels[level] && preview) {
+				char *file = newstr(preview);
+				make_parent_dirs(file, 2);
+				delete[] file;
+				status = info.Write(preview, job->width[level], job->height[level], job->pixels[level], job->has_alpha);
+			}
 
-//------------------------------global setup------------------------
+			job->written[level] = (status == 0);
+			if (status == 0) job->made = true;
+		}
+	}
 
-/*! Path of file to run to pipe in exif info. Default is look for exiv2.
- */
-const char *exif_exec = "/usr/bin/exiv2";
+	 //only the original's fault if it could not be decoded
+	if (job->from_original && !job->pixels[job->Largest()]) record_preview_failure(fileobject);
 
+	 //only an in-memory preview for the ui still needs its pixels, in PreviewTask::Finish()
+	if (!job->in_memory || !have_ui()) {
+		for (int level = 0; level < THUMB_MAX; level++) {
+			delete[] job->pixels[level];
+			job->pixels[level] = NULL;
+		}
+	}
 
+	preview_finished(fileobject, job->made);
+}
 
-//----------------------thread info--------------------------------
-int numthreads=0; //current number of image generation threads
-int maxthreads=1; //max number of image generation threads
-pthread_mutex_t tomakelist_mutex=PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t imlib_mutex     =PTHREAD_MUTEX_INITIALIZER;
+/*! Set the preview states of job's fileobject from what write_preview() did. With a ui, this
+ * happens only in the ui thread, since that is where the states are looked at and changed.
+ * Without one, call with tomakelist_mutex locked.
+ */
+static void apply_preview_states(PreviewJob *job)
+{
+	ImageFile *fileobject = job->fileobject;
 
+	if (job->in_memory) {
+		 //with a ui, stays PREVIEW_Loading until PreviewTask::Finish() installs it
+		if (!have_ui()) fileobject->preview_state = (job->made ? PREVIEW_Exists_Not_Loaded : PREVIEW_Doesnt_Exist);
+		return;
+	}
 
-//-------------------------------- preview creation threads ----------------------------------
+	for (int level = THUMB_MAX-1; level >= 0; level--) {
+		if (!(job->levels & (1<<level))) continue;
 
-RefPtrStack<ImageFile> previews_to_make; 
-pthread_mutex_t generate_mutex=PTHREAD_MUTEX_INITIALIZER;
+		const char *preview = fileobject->thumbs[level].file;
+		fileobject->thumbs[level].state = (job->written[level] ? PREVIEW_Exists_Not_Loaded : PREVIEW_Doesnt_Exist);
 
-void generate_preview_thread();
-void *actually_generate_previews(void *);
+		 //main preview was waiting on this one, see ImageFile::StalePreview()
+		if (fileobject->preview_state == PREVIEW_Loading && fileobject->previewfile && preview
+				&& !strcmp(fileobject->previewfile, preview))
+			fileobject->preview_state = fileobject->thumbs[level].state;
+	}
+}
 
 
-//! In another thread, create a scaled image and save to the "large" part of freedesktop thumbs.
-/*! Each must fit in a 256x256 square.
+/*! \class PreviewTask
+ * \brief Decoding of one PreviewJob on the preview scheduler, once the io stage has read it in.
  *
- * If there is "/.thumbnails/normal" or "/.thumbnails/large" in the path, then do nothing,
- * as it is already a thumbnail.
+ * Run() passes the task on to the write stage, which hands it back to the scheduler
+ * with TaskScheduler::Completed() when there is a ui to Finish() it.
  */
-void generate_preview(ImageFile *fileobject)
+class PreviewTask : public Task
 {
-	const char *file = fileobject->filename;
-	const char *preview = fileobject->previewfile;
+  public:
+	PreviewJob *job;
 
-	if (file_exists(preview,1,NULL) == S_IFREG) {
-		//something there already exists!
-		DBG cerr <<"skipping generate_preview(), already exists for: "<<preview<<endl;
-		return;
-	}
+	PreviewTask(PreviewJob *njob) { job = njob; }
+	virtual ~PreviewTask();
+	virtual const char *whattype() { return "PreviewTask"; }
+	virtual void Run();
+	virtual void Finish();
+};
 
-	if (strstr(file,"/.thumbnails/normal") || strstr(file,"/.thumbnails/large")) {
-		DBG cerr <<"Trying to create a preview of a preview.. skipping! file="<<file<<endl;
-		return;
-	}
 
-	DBG cerr <<"Queueing to generate preview "<<preview<<" for file "<<file<<"..."<<endl;
+/*! \class PreviewQueue
+ * \brief Fixed size queue of PreviewTask, between the decode and write stages of the preview pipeline.
+ */
+class PreviewQueue
+{
+  protected:
+	PreviewTask **tasks;
+	int max, n, first;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_empty, not_full;
 
-	pthread_mutex_lock(&tomakelist_mutex);
+  public:
+	PreviewQueue(int nmax);
+	~PreviewQueue();
+	void Push(PreviewTask *task);
+	PreviewTask *Pop();
+};
 
-	previews_to_make.push(fileobject);
+PreviewQueue::PreviewQueue(int nmax)
+{
+	max = (nmax > 0 ? nmax : 1);
+	tasks = new PreviewTask*[max];
+	n = first = 0;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&not_empty, NULL);
+	pthread_cond_init(&not_full, NULL);
+}
 
-	pthread_mutex_unlock(&tomakelist_mutex);
+PreviewQueue::~PreviewQueue()
+{
+	delete[] tasks;
+	pthread_mutex_destroy(&mutex);
+	pthread_cond_destroy(&not_empty);
+	pthread_cond_destroy(&not_full);
+}
 
-	generate_preview_thread();
+//! Add task to the end, waiting for room if the queue is full.
+void PreviewQueue::Push(PreviewTask *task)
+{
+	pthread_mutex_lock(&mutex);
+	while (n == max) pthread_cond_wait(&not_full, &mutex);
+	tasks[(first + n) % max] = task;
+	n++;
+	pthread_cond_signal(&not_empty);
+	pthread_mutex_unlock(&mutex);
 }
 
-//! Create and wait for maxthreads number of preview creation threads.
-void generate_preview_thread()
+//! Remove and return the first task, waiting for one if the queue is empty.
+PreviewTask *PreviewQueue::Pop()
 {
-	//if (pthreads_mutex_trylock(&generate_mutex)==EBUSY) return; //already generating
-	if (previews_to_make.n == 0) return;
-	if (numthreads >= maxthreads) return;
+	pthread_mutex_lock(&mutex);
+	while (n == 0) pthread_cond_wait(&not_empty, &mutex);
+	PreviewTask *task = tasks[first];
+	first = (first + 1) % max;
+	n--;
+	pthread_cond_signal(&not_full);
+	pthread_mutex_unlock(&mutex);
+	return task;
+}
 
-	pthread_mutex_lock(&generate_mutex);
-	pthread_t gen_thread;
-	if (pthread_create(&gen_thread,NULL,actually_generate_previews,NULL)==0)
-		numthreads++;
+//! Decoded previews waiting for the write stage. Each holds a count of its task.
+static PreviewQueue write_queue(PREVIEW_WRITE_QUEUE);
 
-	DBG cerr <<"Thread "<<gen_thread<<" created and running in background. numthreads="<<numthreads<<endl;
 
-	pthread_mutex_unlock(&generate_mutex);
+//! Only has a job left if never finished, which is not with imlib_mutex locked.
+PreviewTask::~PreviewTask()
+{
+	if (job) release_preview_job(job);
+}
+
+void PreviewTask::Run()
+{
+	double wall = clock_seconds(CLOCK_MONOTONIC), cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+	decode_preview(job);
+	preview_stage_done(&decode_stage, wall, cpu);
+
+	 //blocks while the write stage is behind, which holds back decoding too
+	inc_count();
+	write_queue.Push(this);
 }
 
-//! Thread function to create previews until no more in previews_to_make.
-/*! Decrements numthreads on completion.
+/*! Update the file's preview states, install an in-memory preview, and let go of the decoded
+ * image the job borrowed. The pipeline only ever hands over plain pixels, so this is where they
+ * become imlib images.
+ * Called from the ui thread with imlib_mutex locked, see LivWindow::Refresh().
  */
-void *actually_generate_previews(void *)
+void PreviewTask::Finish()
 {
-	while (previews_to_make.n) {
-		 //make the preview next in the list
+	ImageFile *fileobject = job->fileobject;
+	unsigned int *argb = job->pixels[THUMB_Large];
 
-		pthread_mutex_lock(&tomakelist_mutex);
+	apply_preview_states(job);
 
-		if (previews_to_make.n==0) { //guard against n race condition
-			pthread_mutex_unlock(&tomakelist_mutex);
-			break;
-		}
+	if (job->in_memory) {
+		Imlib_Image img = NULL;
+		if (argb) img = imlib_create_image_using_copied_data(job->width[THUMB_Large], job->height[THUMB_Large], (DATA32*)argb);
+		if (img) {
+			imlib_context_set_image(img);
+			imlib_image_set_has_alpha(job->has_alpha);
+			LaxImage *limg = new LaxImlibImage(NULL, img);
+			fileobject->SetPreview(limg);
+			limg->dec_count();
+		} else fileobject->preview_state = PREVIEW_Doesnt_Exist;
+	}
 
-		ImageFile *fileobject;
-		const char *file,*preview;
+	if (job->decoded) {
+		job->decoded->dec_count();
+		job->decoded = NULL;
+	}
 
-		fileobject = previews_to_make.pop();
-		preview = fileobject->previewfile;
-		file = fileobject->filename;
+	delete job;
+	job = NULL;
+}
 
+//! Thread function of the io stage of the preview pipeline.
+static void *preview_io_stage(void *)
+{
+	while (1) {
+		pthread_mutex_lock(&tomakelist_mutex);
+		while (visible_previews_to_make.n == 0 && previews_to_make.n == 0)
+			pthread_cond_wait(&tomake_cond, &tomakelist_mutex);
+
+		int lane = TASK_Visible_Thumbs;
+		ImageFile *fileobject = visible_previews_to_make.pop();
+		if (!fileobject) {
+			fileobject = previews_to_make.pop();
+			lane = TASK_Offscreen_Thumbs;
+		}
+		PreviewJob *job = new PreviewJob(fileobject, fileobject->thumbs_to_make, lane);
+		job->existing = fileobject->thumbs_existing;
+		fileobject->thumbs_to_make = 0;
 		pthread_mutex_unlock(&tomakelist_mutex);
 
+		DBG cerr <<"...Reading for preview in thread "<<pthread_self()<<" for "<<fileobject->filename<<endl;
 
-		DBG cerr <<"...Generating preview in thread "<<pthread_self()<<" for "<<file<<endl;
+		double wall = clock_seconds(CLOCK_MONOTONIC), cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+		read_preview_source(job);
+		bool quit = preview_stage_done(&io_stage, wall, cpu);
 
-		pthread_mutex_lock(&imlib_mutex);
-		generate_preview_image(file,preview,"png",256,256,1);
-		pthread_mutex_unlock(&imlib_mutex);
-		fileobject->dec_count();
+		pthread_mutex_lock(&generate_mutex);
+		TaskScheduler *scheduler = preview_scheduler;
+		if (scheduler) scheduler->inc_count();
+		pthread_mutex_unlock(&generate_mutex);
+
+		 //blocks while the lane is full
+		PreviewTask *task = new PreviewTask(job);
+		if (!scheduler || scheduler->Submit(task, lane, true) != 0) {
+			DBG cerr <<"No preview scheduler, dropping preview of "<<fileobject->filename<<endl;
+			preview_finished(fileobject, false);
+		}
+		task->dec_count();
+		if (scheduler) scheduler->dec_count();
 
-		anXApp::app->bump();
+		if (quit) break;
 	}
 
-	pthread_mutex_lock(&generate_mutex);
-	numthreads--;
-	pthread_mutex_unlock(&generate_mutex);
+	return NULL;
+}
+
+//! Thread function of the write stage of the preview pipeline.
+static void *preview_write_stage(void *)
+{
+	while (1) {
+		PreviewTask *task = write_queue.Pop();
+		PreviewJob *job = task->job;
+
+		double wall = clock_seconds(CLOCK_MONOTONIC), cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+		write_preview(job);
+		bool quit = preview_stage_done(&write_stage, wall, cpu);
+
+		pthread_mutex_lock(&generate_mutex);
+		TaskScheduler *scheduler = preview_scheduler;
+		if (scheduler) scheduler->inc_count();
+		pthread_mutex_unlock(&generate_mutex);
+
+		 //with a ui, Finish() installs in-memory previews, else we are done with the job here
+		if (!have_ui() || !scheduler || scheduler->Completed(task) != 0) {
+			if (!have_ui()) {
+				 //headless, generate_preview() may be looking at the states from the main thread
+				pthread_mutex_lock(&tomakelist_mutex);
+				apply_preview_states(job);
+				pthread_mutex_unlock(&tomakelist_mutex);
+			}
+			release_preview_job(job);
+			task->job = NULL;
+		}
+		task->dec_count();
+		if (scheduler) scheduler->dec_count();
+
+		if (quit) break;
+	}
 
 	return NULL;
 }
 
 
+//-------------------------------- headless thumbnail generation ----------------------------------
+
+/*! Whether file starts like an image that imlib or liv's own decoders can make a preview of.
+ * This goes by magic bytes, or by extension for the few formats that have none. Camera raws are
+ * mostly tiff inside, and the rest are listed, as their embedded jpegs make fine previews.
+ */
+static bool looks_like_image(const char *file)
+{
+	unsigned char b[16];
+	memset(b, 0, sizeof(b));
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) return false;
+	ssize_t n = read(fd, b, sizeof(b));
+	close(fd);
+	if (n < 4) return false;
+
+	if (is_jpeg_or_png(b, n)) return true;
+	if (!memcmp(b, "GIF8", 4) || !memcmp(b, "8BPS", 4) || !memcmp(b, "farbfeld", 8)) return true;
+	if (!memcmp(b, "II*\0", 4) || !memcmp(b, "MM\0*", 4)) return true; //tiff, dng, nef, cr2, arw...
+	if (!memcmp(b, "IIRO", 4) || !memcmp(b, "IIRS", 4) || !memcmp(b, "IIU\0", 4)) return true; //orf, rw2
+	if (!memcmp(b, "FUJIFILM", 8)) return true; //raf
+	if (b[0] == 'B' && b[1] == 'M') return true;
+	if (!memcmp(b, "RIFF", 4) && !memcmp(b+8, "WEBP", 4)) return true;
+	if (!memcmp(b, "\0\0\1\0", 4) || !memcmp(b, "/* XPM", 6)) return true;
+	if (b[0] == 'P' && b[1] >= '1' && b[1] <= '7' && isspace(b[2])) return true; //pnm
+	if ((b[0] == 0xff && b[1] == 0x0a) || !memcmp(b+4, "JXL ", 4)) return true;
+
+	 //heif, avif and cr3, but not the videos that share the container
+	if (!memcmp(b+4, "ftyp", 4)) {
+		const char *brands[] = { "heic", "heix", "heim", "heis", "mif1", "msf1", "avif", "avis", "crx ", NULL };
+		for (int c=0; brands[c]; c++) if (!memcmp(b+8, brands[c], 4)) return true;
+		return false;
+	}
+
+	const char *ext = strrchr(file, '.');
+	return ext && (!strcasecmp(ext, ".tga") || !strcasecmp(ext, ".svg"));
+}
+
+//! Progress of make_thumbnails(), which only runs once, in the main thread.
+static long thumbs_seen = 0;          //files looked at
+static double thumbs_start = 0;       //CLOCK_MONOTONIC seconds
+static double thumbs_lastprint = 0;
+
+/*! Print one line of progress for make_thumbnails().
+ */
+static void make_thumbnails_progress(bool final)
+{
+	PreviewStats stats;
+	get_preview_stats(&stats);
+
+	thumbs_lastprint = clock_seconds(CLOCK_MONOTONIC);
+	double elapsed = thumbs_lastprint - thumbs_start;
+	if (elapsed <= 0) elapsed = 1e-6;
+
+	long done = stats.made + stats.failed;
+	fprintf(stderr, "\r%ld files, %ld queued, %ld made, %ld skipped, %ld failed, %.1f files/s, %.1f MB/s%s",
+			thumbs_seen, stats.queued - done, stats.made, thumbs_seen - stats.queued, stats.failed,
+			done / elapsed, stats.bytes / elapsed / 1024 / 1024,
+			final ? "\n" : "   ");
+	fflush(stderr);
+}
+
+//! Print progress if it has not been for half a second, for calling as often as convenient.
+static void make_thumbnails_tick()
+{
+	if (clock_seconds(CLOCK_MONOTONIC) - thumbs_lastprint > .5) make_thumbnails_progress(false);
+}
+
+/*! Queue previews for path, as the gui would when showing it. If path is a directory,
+ * do that for each file in it, and for subdirectories too if recurse.
+ * Hidden files and directories are skipped when listing, which includes .thumbnails.
+ * Waits while more than maxqueued previews are not done yet.
+ * Files looked at are counted in thumbs_seen.
+ */
+static void make_thumbnails_for(const char *path, int thumb_location, bool recurse, bool listed, long maxqueued)
+{
+	int type = file_exists(path, 1, NULL);
+
+	if (type == S_IFDIR) {
+		if (listed && !recurse) return;
+
+		DIR *dir = opendir(path);
+		if (!dir) {
+			cerr << _("Could not open directory ") << path << endl;
+			return;
+		}
+
+		char *str = NULL;
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL) {
+			if (entry->d_name[0] == '.') continue;
+
+			makestr(str, path);
+			if (str[strlen(str)-1] != '/') appendstr(str, "/");
+			appendstr(str, entry->d_name);
+			make_thumbnails_for(str, thumb_location, recurse, true, maxqueued);
+		}
+		delete[] str;
+		closedir(dir);
+		return;
+	}
+
+	if (type != S_IFREG) return;
+
+	thumbs_seen++;
+	make_thumbnails_tick();
+
+	 //counted as skipped, rather than failing to be previewed
+	if (!looks_like_image(path)) return;
+
+	 //don't let the queue grow without bound on huge trees
+	PreviewStats stats;
+	get_preview_stats(&stats);
+	while (stats.queued - stats.made - stats.failed > maxqueued) {
+		generate_preview_thread();
+		usleep(20000);
+		make_thumbnails_tick();
+		get_preview_stats(&stats);
+	}
+
+	ImageFile *img = new ImageFile(path, thumb_location, false); //queues if no preview is found
+	img->QueuePreview(); //queues if one is found, but is stale
+	img->dec_count();
+}
+
+/*! Make, without any window, the previews that the gui would look up for the files in paths,
+ * using as many cpus as TaskScheduler::cpu_limit allows. Files that already have a current preview, or that are
+ * known not to be previewable, or that do not look like images at all, are counted as skipped. Progress goes to stderr.
+ *
+ * thumb_location should be LIV_Freedesktop_Thumbs or LIV_Local_Thumbs, as memory thumbs
+ * are not kept anywhere. Return 0 for success, or 1 if any previews could not be made.
+ */
+int make_thumbnails(int numpaths, const char **paths, int thumb_location, bool recurse)
+{
+	if (thumb_location != LIV_Freedesktop_Thumbs && thumb_location != LIV_Local_Thumbs) {
+		cerr << _("Previews are only kept for freedesktop or local thumbnails!") << endl;
+		return 1;
+	}
+
+	TaskScheduler *scheduler = new TaskScheduler(TaskScheduler::ThreadsForCpuLimit());
+	set_preview_scheduler(scheduler);
+
+	thumbs_seen = 0;
+	thumbs_start = thumbs_lastprint = clock_seconds(CLOCK_MONOTONIC);
+
+	for (int c=0; c<numpaths; c++)
+		make_thumbnails_for(paths[c], thumb_location, recurse, false, 64 * scheduler->NumThreads());
+
+	 //wait for the preview pipeline to finish
+	PreviewStats stats;
+	get_preview_stats(&stats);
+	while (stats.queued > stats.made + stats.failed) {
+		usleep(100000);
+		make_thumbnails_tick();
+		get_preview_stats(&stats);
+	}
+
+	set_preview_scheduler(NULL);
+	scheduler->Shutdown();
+	scheduler->dec_count();
+
+	make_thumbnails_progress(true);
+	return stats.failed ? 1 : 0;
+}
 
 
 //------------------------------ ActionBox ----------------------------------
@@ -233,6 +1517,236 @@ LivDumpContext::~LivDumpContext()
 
 
 
+//----------------------------- class ThumbList -------------------
+
+/*! \class ThumbList
+ * \brief Flat storage for the kids of an ImageSet.
+ *
+ * Kids are stored as parallel arrays indexed by position: one array each for
+ * x, y, width, height, the ImageFile, and the ImageSet. Plain images do not get
+ * their own ImageSet node. Only kids that are actual sets have non-NULL set[i].
+ * This way layout, culling, and hit testing of big collections are linear scans
+ * over contiguous doubles, rather than chasing a heap node per image.
+ *
+ * Both image[i] and set[i] are reference counted.
+ */
+
+ThumbList::ThumbList()
+{
+	n = max = 0;
+	image  = NULL;
+	set    = NULL;
+	x = y  = NULL;
+	width  = NULL;
+	height = NULL;
+}
+
+ThumbList::~ThumbList()
+{
+	flush();
+
+	delete[] image;
+	delete[] set;
+	delete[] x;
+	delete[] y;
+	delete[] width;
+	delete[] height;
+}
+
+//! Return a new array of size newmax, with the first n elements of a copied over. Deletes a.
+template <class T>
+static T *resize_array(T *a, int n, int newmax)
+{
+	T *na = new T[newmax];
+	if (a && n) memcpy(na, a, n*sizeof(T));
+	delete[] a;
+	return na;
+}
+
+//! Make sure there is room for at least newmax kids.
+void ThumbList::grow(int newmax)
+{
+	if (newmax <= max) return;
+	if (newmax < 2*max) newmax = 2*max;
+	if (newmax < 16) newmax = 16;
+
+	image  = resize_array(image,  n, newmax);
+	set    = resize_array(set,    n, newmax);
+	x      = resize_array(x,      n, newmax);
+	y      = resize_array(y,      n, newmax);
+	width  = resize_array(width,  n, newmax);
+	height = resize_array(height, n, newmax);
+
+	max = newmax;
+}
+
+/*! Add a kid at position where, or at the end if where<0. Either img or nset can be NULL.
+ * Initial dimensions are taken from nset if given, otherwise from img's preview dimensions.
+ *
+ * Returns the index of the new kid.
+ */
+int ThumbList::push(ImageFile *img, ImageSet *nset, int where)
+{
+	if (where < 0 || where > n) where = n;
+	grow(n+1);
+
+	int after = n-where;
+	if (after) {
+		memmove(image +where+1, image +where, after*sizeof(ImageFile*));
+		memmove(set   +where+1, set   +where, after*sizeof(ImageSet*));
+		memmove(x     +where+1, x     +where, after*sizeof(double));
+		memmove(y     +where+1, y     +where, after*sizeof(double));
+		memmove(width +where+1, width +where, after*sizeof(double));
+		memmove(height+where+1, height+where, after*sizeof(double));
+	}
+
+	image[where] = img;
+	set  [where] = nset;
+	if (img)  img ->inc_count();
+	if (nset) nset->inc_count();
+
+	if (nset) {
+		x     [where] = nset->x;
+		y     [where] = nset->y;
+		width [where] = nset->width;
+		height[where] = nset->height;
+	} else {
+		x     [where] = 0;
+		y     [where] = 0;
+		width [where] = (img ? img->pwidth  : 0);
+		height[where] = (img ? img->pheight : 0);
+	}
+
+	n++;
+	return where;
+}
+
+/*! Remove kid at index. Return 0 for success, or nonzero for bad index.
+ */
+int ThumbList::remove(int index)
+{
+	if (index < 0 || index >= n) return 1;
+
+	if (image[index]) image[index]->dec_count();
+	if (set  [index]) set  [index]->dec_count();
+
+	int after = n-index-1;
+	if (after) {
+		memmove(image +index, image +index+1, after*sizeof(ImageFile*));
+		memmove(set   +index, set   +index+1, after*sizeof(ImageSet*));
+		memmove(x     +index, x     +index+1, after*sizeof(double));
+		memmove(y     +index, y     +index+1, after*sizeof(double));
+		memmove(width +index, width +index+1, after*sizeof(double));
+		memmove(height+index, height+index+1, after*sizeof(double));
+	}
+
+	n--;
+	return 0;
+}
+
+//! Remove all kids. Keeps allocated space.
+void ThumbList::flush()
+{
+	for (int c=0; c<n; c++) {
+		if (image[c]) image[c]->dec_count();
+		if (set  [c]) set  [c]->dec_count();
+	}
+	n = 0;
+}
+
+//! Swap kids i1 and i2, including their bounds.
+void ThumbList::swap(int i1, int i2)
+{
+	if (i1 == i2 || i1 < 0 || i2 < 0 || i1 >= n || i2 >= n) return;
+
+	ImageFile *ti = image[i1]; image[i1] = image[i2]; image[i2] = ti;
+	ImageSet  *ts = set[i1];   set[i1]   = set[i2];   set[i2]   = ts;
+	double t;
+	t = x     [i1]; x     [i1] = x     [i2]; x     [i2] = t;
+	t = y     [i1]; y     [i1] = y     [i2]; y     [i2] = t;
+	t = width [i1]; width [i1] = width [i2]; width [i2] = t;
+	t = height[i1]; height[i1] = height[i2]; height[i2] = t;
+}
+
+/*! Rearrange so that new kid i is old kid order[i]. order must be a permutation of 0..n-1.
+ * Return 0 for success.
+ */
+int ThumbList::reorder(const int *order)
+{
+	if (n <= 1) return 0;
+
+	ImageFile **nimage = new ImageFile*[max];
+	ImageSet  **nset   = new ImageSet*[max];
+	double *nx      = new double[max];
+	double *ny      = new double[max];
+	double *nwidth  = new double[max];
+	double *nheight = new double[max];
+
+	for (int c=0; c<n; c++) {
+		nimage [c] = image [order[c]];
+		nset   [c] = set   [order[c]];
+		nx     [c] = x     [order[c]];
+		ny     [c] = y     [order[c]];
+		nwidth [c] = width [order[c]];
+		nheight[c] = height[order[c]];
+	}
+
+	delete[] image;  image  = nimage;
+	delete[] set;    set    = nset;
+	delete[] x;      x      = nx;
+	delete[] y;      y      = ny;
+	delete[] width;  width  = nwidth;
+	delete[] height; height = nheight;
+
+	return 0;
+}
+
+//! Return the first index of img, or -1 if not found.
+int ThumbList::findindex(ImageFile *img)
+{
+	if (!img) return -1;
+	for (int c=0; c<n; c++) {
+		if (image[c] == img) return c;
+	}
+	return -1;
+}
+
+//! Return the index of nset, or -1 if not found.
+int ThumbList::findindex(ImageSet *nset)
+{
+	if (!nset) return -1;
+	for (int c=0; c<n; c++) {
+		if (set[c] == nset) return c;
+	}
+	return -1;
+}
+
+/*! Return the index of the first kid whose bounds contain (px,py), or -1.
+ * Kids with no width are skipped.
+ */
+int ThumbList::pointindex(double px, double py)
+{
+	for (int c=0; c<n; c++) {
+		if (width[c] <= 0) continue;
+		if (px >= x[c] && px < x[c]+width[c] && py >= y[c] && py < y[c]+height[c]) return c;
+	}
+	return -1;
+}
+
+/*! Return the LivSetType of the kid at index.
+ * Kids without their own set are SET_Is_Directory for directories, or else SET_Is_File.
+ */
+int ThumbList::kidtype(int index)
+{
+	if (index < 0 || index >= n) return SET_Is_Unknown;
+	if (set[index]) return set[index]->type;
+	if (!image[index]) return SET_Is_Unknown;
+	if (image[index]->filetype == FILE_Is_Directory) return SET_Is_Directory;
+	return SET_Is_File;
+}
+
+
+
 //----------------------------- class ImageSet -------------------
 
 /*! \class ImageSet
@@ -246,9 +1760,22 @@ int ImageSet::dec_count()
 {
 	return anObject::dec_count();
 }
+/*! Thread safe. If the last count goes away in some other thread than the ui thread, the
+ * actual delete is left to the ui thread, as that touches preview_cache and imlib images.
+ */
 int ImageFile::dec_count()
 {
-	return anObject::dec_count();
+	int count = __atomic_sub_fetch(&_count, 1, __ATOMIC_ACQ_REL);
+	if (count > 0) return count;
+
+	if (on_ui_thread()) delete this;
+	else {
+		pthread_mutex_lock(&dead_mutex);
+		dead_files.push(this, 0);
+		pthread_mutex_unlock(&dead_mutex);
+		post_ui_wakeup();
+	}
+	return 0;
 }
 
 
@@ -296,6 +1823,37 @@ ImageSet::~ImageSet()
 	if (preview) preview->dec_count();
 }
 
+//! Output tags, title, description, and meta of image, if any.
+static void dump_out_image_info(FILE *f,int indent,ImageFile *image)
+{
+	if (!image) return;
+
+	char spc[indent+1]; memset(spc,' ',indent); spc[indent]='\0';
+
+	 //tags
+	if (image->NumberOfTags()) {
+		fprintf(f,"%stags ",spc);
+		char *tags = image->GetAllTags();
+		if (tags) fprintf(f,"%s\n",tags);
+		delete[] tags;
+	}
+
+	if (image->title) {
+		fprintf(f,"%stitle ",spc);
+		dump_out_value(f,indent+2,image->title);
+	}
+
+	if (image->description) {
+		fprintf(f,"%sdescription ",spc);
+		dump_out_value(f,indent+2,image->description);
+	}
+
+	if (image->meta) {
+		fprintf(f,"%smeta",spc);
+		image->meta->dump_out(f,indent+2);
+	}
+}
+
 void ImageSet::dump_out(FILE *f,int indent,int what,LaxFiles::DumpContext *savecontext)
 {
 	//LaxFiles::Attribute att;
@@ -312,46 +1870,32 @@ void ImageSet::dump_out(FILE *f,int indent,int what,LaxFiles::DumpContext *savec
 		else if (type == SET_Is_Set)       fprintf(f, "%stype set\n",spc);
 	}
 
-	if (image) {
-		 //tags
-		if (image->NumberOfTags()) {
-			fprintf(f,"%stags ",spc);
-			char *tags = image->GetAllTags();
-			if (tags) fprintf(f,"%s\n",tags);
-			delete[] tags;
-		}
-
-		if (image->title) {
-			fprintf(f,"%stitle ",spc);
-			dump_out_value(f,indent+2,image->title);
-		}
-
-		if (image->description) {
-			fprintf(f,"%sdescription ",spc);
-			dump_out_value(f,indent+2,image->description);
-		}
-
-		if (image->meta) {
-			fprintf(f,"%smeta",spc);
-			image->meta->dump_out(f,indent+2);
-		}
-	}
+	dump_out_image_info(f,indent,image);
 
 	if (kids.n) {
+		ImageFile *kimage;
+		int ktype;
+
 		for (int c=0; c<kids.n; c++) {
-			if (kids.e[c]->type == SET_Is_File) {
-				fprintf(f,"%sfile %s\n",spc, kids.e[c]->image->filename);
+			kimage = kids.image[c];
+			ktype  = kids.kidtype(c);
+
+			if (ktype == SET_Is_File) {
+				fprintf(f,"%sfile %s\n",spc, kimage->filename);
 
-			} else if (kids.e[c]->type == SET_Is_Directory) {
-				fprintf(f,"%sdirectory %s\n",spc, kids.e[c]->image->filename);
+			} else if (ktype == SET_Is_Directory) {
+				fprintf(f,"%sdirectory %s\n",spc, kimage->filename);
 
-			} else if (kids.e[c]->type == SET_Is_Set && kids.e[c]->image) {
-				fprintf(f,"%sset %s\n",spc, kids.e[c]->image->name ? kids.e[c]->image->name : "\"Untitled\"");
+			} else if (ktype == SET_Is_Set && kimage) {
+				fprintf(f,"%sset %s\n",spc, kimage->name ? kimage->name : "\"Untitled\"");
 
 			} else fprintf(f, "%skid\n",spc);
 
-			kids.e[c]->dump_flags &= ~1;
-			kids.e[c]->dump_out(f, indent+2, 0, savecontext);
+			if (kids.set[c]) {
+				kids.set[c]->dump_flags &= ~1;
+				kids.set[c]->dump_out(f, indent+2, 0, savecontext);
+
+			} else dump_out_image_info(f, indent+2, kimage);
 		}
 	}
 }
@@ -443,7 +1987,6 @@ void ImageSet::dump_in_atts(LaxFiles::Attribute *att,int flag,LaxFiles::DumpCont
 
 		Add(ii);
 
-		//ImageSet *tt = kids.e[kids.n-1];
 		//numadded++;
 
 	//} else if (itype == SET_Is_Set) {
@@ -461,17 +2004,18 @@ int ImageSet::Gap(int newgap)
 int ImageSet::Add(ImageSet *thumb, int where)
 {
 	if (FindIndex(thumb)>=0) return 1;
-	return kids.push(thumb, LISTS_DELETE_Refcount, where);
+	return kids.push(thumb->image, thumb, where);
 }
 
+/*! Remove kid at index. Return 0 for success, or nonzero for bad index.
+ */
 int ImageSet::Remove(int index)
 {
-	// ***
-	return 1;
+	return kids.remove(index);
 }
 
 
-/*! Add a child ImageSet that points to the given ImageFile.
+/*! Add a kid that points to the given ImageFile. No extra ImageSet is created for it.
  * return >= 0 for index of newly added, -1 for some kind of error, -2 for already there.
  */
 int ImageSet::Add(ImageFile *img, int where)
@@ -480,10 +2024,7 @@ int ImageSet::Add(ImageFile *img, int where)
 	int i = FindIndex(img);
 	if (i>=0) return -2;
 
-	ImageSet *thumb=new ImageSet(img,0,0);
-	i = kids.push(thumb, LISTS_DELETE_Refcount, where);
-	thumb->dec_count();
-	return i;
+	return kids.push(img, NULL, where);
 }
 
 //! Set the image ref for *this.
@@ -534,7 +2075,6 @@ void ImageSet::Layout(int how)
 	int previewsize = 256;
 	flatpoint curpos;
 	ImageFile *img;
-	Imlib_Image ii;
 	//double scale=norm(flatpoint(thumb_matrix[0],thumb_matrix[1]));
 	double iw=0, ih=0; //width and height of actual image
 	int w=0, h=0;     //width and height of image's thumbnail
@@ -547,33 +2087,38 @@ void ImageSet::Layout(int how)
 	for (int c=0; c<kids.n; c++) {
 		n++;
 
-		img = kids.e[c]->image;
+		img = kids.image[c];
 		if (img) {
 			iw=img->width;
 			ih=img->height;
 
 			w=img->pwidth;
 			h=img->pheight;
+		} else if (kids.set[c]) {
+			iw = w = kids.set[c]->width;
+			ih = h = kids.set[c]->height;
 		} else {
-			iw = w = kids.e[c]->width;
-			ih = h = kids.e[c]->height;
+			iw = w = kids.width[c];
+			ih = h = kids.height[c];
 		}
 
 		if (img && (w<=0 || h<=0)) { // need to find preview dimensions
 			int previewfound=0;
 			if (img->previewfile) {
-				ii = imlib_load_image(img->previewfile);
-				if (ii) {
+				 //read from png header, not by decoding the preview
+				img->fillinfo(FILE_Has_preview_info);
+				if (img->pwidth>0 && img->pheight>0) {
 					previewfound=1;
-					imlib_context_set_image(ii);
-					w=imlib_image_get_width();
-					h=imlib_image_get_height();
-					imlib_free_image();
+					w=img->pwidth;
+					h=img->pheight;
 				}
 			}
 
 			if (!previewfound) { //no preview image found, so figure dimensions in other ways
 				 //draw box with x in it for no preview
+				img->fillinfo(FILE_Has_image_info);
+				iw=img->width;
+				ih=img->height;
 				if (iw<=0 || ih<=0) { iw=ih=100; }
 				if (iw>ih) {
 					w=previewsize;
@@ -595,7 +2140,11 @@ void ImageSet::Layout(int how)
 		if (curpos.x+w<=thumbdisplaywidth || (curpos.x+w>thumbdisplaywidth && c==rowstartindex)) {
 			 //update thumb pos when in current row or at beginning and image is really wide
 			 //update thumb location info <- these are in screen space
-			kids.e[c]->Set(curpos.x,curpos.y, w,h);
+			kids.x[c]      = curpos.x;
+			kids.y[c]      = curpos.y;
+			kids.width[c]  = w;
+			kids.height[c] = h;
+			if (kids.set[c]) kids.set[c]->Set(curpos.x,curpos.y, w,h);
 		}
 
 		 //advance curpos to next row, or next in row
@@ -638,22 +2187,38 @@ void ImageSet::Layout(int how)
  */
 int ImageSet::FindIndex(ImageFile *image)
 {
-	if (!image) return -1;
-	for (int c=0; c<kids.n; c++) {
-		if (kids.e[c]->image == image) return c;
-	}
-	return -1;
+	return kids.findindex(image);
 }
 
+/*! Return the index of subset image in this->kids, or -1 if not found.
+ * Does not recurse.
+ */
 int ImageSet::FindIndex(ImageSet *image)
 {
-	if (!image) return -1;
-	for (int c=0; c<kids.n; c++) {
-		if (kids.e[c] == image) return c;
-	}
-	return -1;
+	return kids.findindex(image);
+}
+
+
+
+//----------------------------- class ThumbLevel -------------------
+
+/*! \class ThumbLevel
+ * \brief One size of preview for an ImageFile, see ImageFile::thumbs and ThumbSize.
+ */
+
+ThumbLevel::ThumbLevel()
+{
+	file  = NULL;
+	image = NULL;
+	state = PREVIEW_Unknown;
 }
 
+ThumbLevel::~ThumbLevel()
+{
+	preview_cache.Remove(&cachenode);
+	delete[] file;
+	if (image) image->dec_count();
+}
 
 
 //----------------------------- class ImageFile -------------------
@@ -671,11 +2236,21 @@ ImageFile::ImageFile()
 	mark=0;
 
 	transform_identity(matrix);
+	zoommode = LIVZOOM_Scale_To_Screen;
+	viewwidth = viewheight = 0;
 	width = height = 0;
 
 	state=FILE_Not_accessed; //see ImgLoadState
 	filetype=FILE_Is_Unknown;
 	preview_state = PREVIEW_Unknown;
+	thumb_location = LIV_None;
+	thumbs_to_make = 0;
+	thumbs_existing = 0;
+	thumbpack = NULL;
+	preview_fail_mtime = -1;
+	loading = 0;
+	pending_argb = NULL;
+	pending_w = pending_h = pending_alpha = 0;
 
 	filename=NULL;
 	preview=NULL;
@@ -684,6 +2259,8 @@ ImageFile::ImageFile()
 
 	name=NULL;
 	image=NULL;
+	fitted=NULL;
+	for (int c=0; c<LIV_MIP_MAX; c++) mips[c]=NULL;
 	meta=NULL;
 	title=NULL;
 	description=NULL;
@@ -697,10 +2274,20 @@ ImageFile::ImageFile(const char *fname, int thumb_location, bool reject_nonimage
 	mark = 0;
 
 	transform_identity(matrix);
+	zoommode = LIVZOOM_Scale_To_Screen;
+	viewwidth = viewheight = 0;
 
 	state = FILE_Not_accessed;
 	filetype = FILE_Is_Unknown;
 	preview_state = PREVIEW_Unknown;
+	this->thumb_location = LIV_None;
+	thumbs_to_make = 0;
+	thumbs_existing = 0;
+	thumbpack = NULL;
+	preview_fail_mtime = -1;
+	loading = 0;
+	pending_argb = NULL;
+	pending_w = pending_h = pending_alpha = 0;
 
 	filename = newstr(fname);
 
@@ -710,6 +2297,8 @@ ImageFile::ImageFile(const char *fname, int thumb_location, bool reject_nonimage
 
 	name  = NULL;
 	image = NULL;
+	fitted = NULL;
+	for (int c=0; c<LIV_MIP_MAX; c++) mips[c] = NULL;
 	meta  = NULL;
 	title = NULL;
 	description = NULL;
@@ -730,21 +2319,38 @@ ImageFile::ImageFile(const char *nname, const char *nfilename, const char *ntitl
 	lastviewtime=0;
 
 	transform_identity(matrix);
+	zoommode = LIVZOOM_Scale_To_Screen;
+	viewwidth = viewheight = 0;
 
 	state    = FILE_Not_accessed;
 	filetype = FILE_Is_Unknown;
 	preview_state = PREVIEW_Unknown;
+	this->thumb_location = LIV_None;
+	thumbs_to_make = 0;
+	thumbs_existing = 0;
+	thumbpack = NULL;
+	preview_fail_mtime = -1;
+	loading = 0;
+	pending_argb = NULL;
+	pending_w = pending_h = pending_alpha = 0;
 
 	preview = NULL;
 	previewfile = NULL;
 	pwidth=pheight=0;
+	image  = NULL;
+	fitted = NULL;
+	for (int c=0; c<LIV_MIP_MAX; c++) mips[c] = NULL;
 
 	SetFile(nfilename, thumb_location, reject_nonimages);
 }
 
 ImageFile::~ImageFile()
 {
+	preview_cache.Remove(&cachenode);
+	delete[] pending_argb;
 	if (image) image->dec_count();
+	if (fitted) fitted->dec_count();
+	for (int c=0; c<LIV_MIP_MAX; c++) if (mips[c]) mips[c]->dec_count();
 	if (preview) preview->dec_count();
 
 	delete[] filename;
@@ -770,6 +2376,7 @@ int ImageFile::SetFile(const char *nfilename, int thumb_location, bool reject_no
 
 	makestr(filename, nfilename);
 	filetype = FILE_Is_Unknown;
+	this->thumb_location = thumb_location;
 
 	 //find a suitable existing large freedesktop thumbnail, if any
 	delete[] previewfile;
@@ -783,7 +2390,12 @@ int ImageFile::SetFile(const char *nfilename, int thumb_location, bool reject_no
 	} else {
 
 		//DBG cerr <<"for file "<<filename<<" trying thumb "<<previewfile<<endl;
-		if (file_exists(previewfile,1,NULL) != S_IFREG) {
+		if (thumb_location == LIV_Local_Thumbs && FindPackedPreview() == 0) {
+			 //found in the directory's thumbnail pack, no need to go looking for files
+			delete[] previewfile;
+			previewfile = NULL;
+
+		} else if (file_exists(previewfile,1,NULL) != S_IFREG) {
 			 //preview file does not seem to exist, try a standard freedesktop one
 			delete[] previewfile;
 			previewfile = freedesktop_thumbnail(filename,'n');
@@ -804,23 +2416,27 @@ int ImageFile::SetFile(const char *nfilename, int thumb_location, bool reject_no
 		if (!previewfile && thumb_location != LIV_None) {
 			 //create a thumbnail if existing one not found
 
-			if (thumb_location == LIV_Freedesktop_Thumbs) {
+			if (PreviewFailed()) {
+				 //this version of the file could not be previewed before, so don't try again
+				preview_state = PREVIEW_Doesnt_Exist;
+
+			} else if (thumb_location == LIV_Freedesktop_Thumbs) {
 				 //no preview file found, try the freedesktop 'l', and render in background
 				previewfile = freedesktop_thumbnail(filename,'l');
-				generate_preview(this); //background render of new preview file
-				state &= ~(FILE_Has_preview_loading|FILE_Has_preview);
-				state |= FILE_Has_preview_loading;
+				generate_preview(this, THUMB_Large); //background render of new preview file
+				SetState(FILE_Has_preview, false);
+				SetState(FILE_Has_preview_loading);
 				preview_state = PREVIEW_Exists_Not_Loaded;
 
 			} else if (thumb_location == LIV_Local_Thumbs) {
-				 //create a thumbnail in ./.thumbnails/ relative to file
-				//***
-				cerr <<" *** need to implement LIV_Local_Thumbs!"<<endl;
+				 //thumbnail is read from or added to the pack in ./.thumbnails/ relative to file,
+				 //by GetPreview() when first needed
+				if (!thumbpack) thumbpack = thumb_pack_for_file(filename);
 
 			} else if (thumb_location == LIV_Memory_Thumbs) {
-				 //create a thumbnail in memory
-				//***
-				cerr <<" *** need to implement LIV_Memory_Thumbs!"<<endl;
+				 //thumbnail is made in memory by GetPreview() when first needed, and
+				 //kept only while it fits in preview_cache's budget
+				preview_state = PREVIEW_Unknown;
 			}
 		}
 
@@ -829,15 +2445,129 @@ int ImageFile::SetFile(const char *nfilename, int thumb_location, bool reject_no
 		DBG if (previewfile) cerr <<" -> Using preview filename "<<previewfile<<endl;
 		DBG else cerr <<" -> no preview found!"<<endl;
 
-		fillinfo(FILE_Has_stat|FILE_Has_preview);
+		fillinfo(FILE_Has_stat|FILE_Has_preview_info);
 	} //if not dir
 
 	return 0;
 }
 
+//! For ImageFile::BeginLoad() and EndLoad(), shared by all files, as loads are few.
+static pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  load_cond  = PTHREAD_COND_INITIALIZER;
+
+/*! Turn on or off bits of ImgLoadState. Safe from any thread. Set anything that the bits
+ * say is there before turning them on, so that other threads see it when they see the bits.
+ */
+void ImageFile::SetState(int bits, bool on)
+{
+	if (on) __atomic_or_fetch(&state, bits, __ATOMIC_ACQ_REL);
+	else __atomic_and_fetch(&state, ~bits, __ATOMIC_ACQ_REL);
+}
+
+/*! Claim the finding of one bit of ImgLoadState (the stat, the image, the exif, or the preview),
+ * so that whatever thread asks first does the work, and nobody does it twice at once.
+ *
+ * Returns true if the caller should do the loading, then call EndLoad(). Returns false
+ * if the bit is already there, or if another thread is loading it and wait is false.
+ * If wait is true, first wait for any other thread's load to end, which usually means the
+ * bit is there when this returns false.
+ */
+bool ImageFile::BeginLoad(int bit, bool wait)
+{
+	pthread_mutex_lock(&load_mutex);
+	while (loading & bit) {
+		if (!wait) {
+			pthread_mutex_unlock(&load_mutex);
+			return false;
+		}
+		pthread_cond_wait(&load_cond, &load_mutex);
+	}
+
+	bool claimed = !Has(bit);
+	if (claimed) loading |= bit;
+	pthread_mutex_unlock(&load_mutex);
+	return claimed;
+}
+
+//! End a load claimed with BeginLoad(), turning bit on or off depending on success.
+void ImageFile::EndLoad(int bit, bool success)
+{
+	pthread_mutex_lock(&load_mutex);
+	SetState(bit, success);
+	loading &= ~bit;
+	pthread_cond_broadcast(&load_cond);
+	pthread_mutex_unlock(&load_mutex);
+}
+
+//! Whether some thread has claimed bit with BeginLoad() and not ended it yet.
+bool ImageFile::IsLoading(int bit)
+{
+	pthread_mutex_lock(&load_mutex);
+	bool is = (loading & bit);
+	pthread_mutex_unlock(&load_mutex);
+	return is;
+}
+
+/*! Take over argb, a w x h image decoded in a worker, for fillinfo() to make into image
+ * in the ui thread. Must be called with FILE_Has_image claimed by BeginLoad().
+ */
+void ImageFile::SetPendingImage(unsigned int *argb, int w, int h, int has_alpha)
+{
+	delete[] pending_argb;
+	pending_argb  = argb;
+	pending_w     = w;
+	pending_h     = h;
+	pending_alpha = has_alpha;
+}
+
+/*! Return the output of exif_exec for file in a new char[], or NULL if it could not be run.
+ * Does not touch any ImageFile, so it is safe to call from any thread, see ExifTask.
+ */
+static char *read_exif(const char *file)
+{
+	size_t c;
+	char *exif = new char[strlen(exif_exec)+strlen(file)+1024], *data;
+	int at=0;
+	sprintf(exif,"%s %s",exif_exec,file);
+	FILE *f = popen(exif,"r");
+	if (!f) {
+		delete[] exif;
+		return NULL;
+	}
+
+	delete[] exif;
+	exif = new char[1024];
+	data = exif;
+	while (1) {
+		c = fread(data,1,1024,f);
+		if (c<1024) {
+			data[c]='\0';
+			break;
+		}
+		 //expand exif
+		char *temp = exif;
+		at += 1024;
+		exif = new char[at+1024];
+		memcpy(exif,temp,at);
+		delete[] temp;
+		data = exif+at;
+	}
+	pclose(f);
+
+	DBG cout <<" ~~~ scanned in exif:"<<endl<<exif;
+	return exif;
+}
+
 /*! which&FILE_Has_stat  means do stat,
- *  which&FILE_Has_image means load image data
+ *  which&FILE_Has_image means load image data, or make it from what a worker decoded, see SetPendingImage()
  *  which&FILE_Has_exif  means load exif (via exif_exec) info
+ *  which&FILE_Has_preview means load preview image data
+ *  which&FILE_Has_preview_info means find preview dimensions (and the original's dimensions
+ *     when the preview knows them) from the preview's png header, without decoding it
+ *  which&FILE_Has_image_info means find width and height of the original, preferably without decoding it
+ *
+ *  The stat, image, preview and exif are each found by only one thread at a time, see BeginLoad().
+ *  Only the stat may be asked for from threads other than the ui thread.
  *
  *  Return 0 for success, nonzero for error.
  */
@@ -846,10 +2576,9 @@ int ImageFile::fillinfo(int which)
 	DBG cerr <<"getting info for "<<filename<<": "<<which<<endl;
 
 	 //grab file system stat info
-	if ((which&FILE_Has_stat) && !(state&FILE_Has_stat)) {
+	if ((which&FILE_Has_stat) && !Has(FILE_Has_stat) && BeginLoad(FILE_Has_stat)) {
 		int c = stat(filename, &fileinfo);
-		if (c==0) state |= FILE_Has_stat;
-		else state &= ~FILE_Has_stat;
+		EndLoad(FILE_Has_stat, c==0);
 
 		//struct stat {
 		//dev_t     st_dev;     /* ID of device containing file */
@@ -869,69 +2598,93 @@ int ImageFile::fillinfo(int which)
 	}
 
 	 //read in actual image
-	if ((which & FILE_Has_image) && !(state & FILE_Has_image) && !image) {
-		image = load_image(filename);
+	if ((which & FILE_Has_image) && !image && BeginLoad(FILE_Has_image)) {
+		if (pending_argb) {
+			 //already decoded by an ImageDecodeTask
+			Imlib_Image img = imlib_create_image_using_copied_data(pending_w, pending_h, (DATA32*)pending_argb);
+			if (img) {
+				imlib_context_set_image(img);
+				imlib_image_set_has_alpha(pending_alpha);
+				image = new LaxImlibImage(filename, img);
+			}
+			SetPendingImage(NULL, 0,0,0);
+		}
+		if (!image) image = load_image(filename);
+
 		if (!image) {
 			 //could not load to image
 			if (filetype==FILE_Is_Unknown || filetype==FILE_Is_Image) filetype = FILE_Is_Unknown;
-			state &= ~FILE_Has_image;
 		} else {
 			 //image successfully loaded
 			filetype = FILE_Is_Image;
-			state |= FILE_Has_image;
 			width  = image->w();
 			height = image->h();
+			SetState(FILE_Has_image_info);
 		}
+		EndLoad(FILE_Has_image, image != NULL);
 	}
 
-	if ((which & FILE_Has_preview) && !(state & FILE_Has_preview) && !preview) {
-		preview = load_image(previewfile);
-		if (!preview) {
-			 //could not load to image
-			state &= ~FILE_Has_preview;
-		} else {
+	if ((which & FILE_Has_preview) && !preview && previewfile && BeginLoad(FILE_Has_preview)) {
+		LaxImage *img = load_image(previewfile);
+		if (img) {
 			 //image successfully loaded
-			state |= FILE_Has_preview;
-			preview_state = PREVIEW_Loaded;
-			pwidth  = preview->w();
-			pheight = preview->h();
+			SetPreview(img);
+			img->dec_count();
 		}
+		EndLoad(FILE_Has_preview, img != NULL);
 	}
 
+	 //preview dimensions from png header, plus Thumb::Image::Width/Height if present
+	if ((which & FILE_Has_preview_info) && !Has(FILE_Has_preview_info) && previewfile) {
+		PngInfo info;
+		if (info.Read(previewfile) == 0) {
+			 //check Thumb::MTime and Thumb::URI while we are here, unless already regenerating
+			fillinfo(FILE_Has_stat);
+			if (preview_state != PREVIEW_Loading && Has(FILE_Has_stat)
+					&& info.IsStaleFor(filename, fileinfo.st_mtime)) {
+				DBG cerr <<"Stale preview "<<previewfile<<" for "<<filename<<endl;
+				StalePreview();
 
-	 //scan image file for exif information
-	 //currently via shell call
-	if (!isblank(exif_exec) && (which & FILE_Has_exif) && !(state & FILE_Has_exif) && !meta) {
-		state |= FILE_Has_exif;
-		size_t c;
-		char *exif = new char[1024], *data;
-		int at=0;
-		sprintf(exif,"%s %s",exif_exec,filename);
-		FILE *f = popen(exif,"r");
-		exif[0] = '\0';
-		data = exif;
-
-		if (f) {
-			while (1) {
-				c = fread(data,1,1024,f);
-				if (c<1024) {
-					data[c]='\0';
-					break;
+			} else {
+				pwidth  = info.width;
+				pheight = info.height;
+				SetState(FILE_Has_preview_info);
+
+				if (!Has(FILE_Has_image_info) && info.orig_width > 0 && info.orig_height > 0) {
+					width  = info.orig_width;
+					height = info.orig_height;
+					SetState(FILE_Has_image_info);
 				}
-				 //expand exif
-				char *temp = exif;
-				at += 1024;
-				exif = new char[at+1024];
-				memcpy(exif,temp,at);
-				delete[] temp;
-				data = exif+at;
 			}
-			fclose(f);
-			if (!meta) meta = new Attribute;
-			meta->push("exif",exif);
 		}
+	}
+
+	 //dimensions of the original, without loading it if possible
+	if ((which & FILE_Has_image_info) && !Has(FILE_Has_image_info)) {
+		if (previewfile) fillinfo(FILE_Has_preview_info);
+
+		if (!Has(FILE_Has_image_info)) {
+			 //maybe the original is a png, so read its header directly
+			PngInfo info;
+			if (info.Read(filename) == 0) {
+				width  = info.width;
+				height = info.height;
+				SetState(FILE_Has_image_info);
+			}
+		}
+	}
 
-		DBG cout <<" ~~~ scanned in exif:"<<endl<<exif;
+
+	 //scan image file for exif information
+	 //currently via shell call
+	if (!isblank(exif_exec) && (which & FILE_Has_exif) && !meta && BeginLoad(FILE_Has_exif)) {
+		char *exif = read_exif(filename);
+		if (exif) {
+			meta = new Attribute;
+			meta->push("exif",exif);
+			delete[] exif;
+		}
+		EndLoad(FILE_Has_exif, true); //don't keep trying when there is none
 	}
 
 	return 0;
@@ -941,20 +2694,478 @@ int ImageFile::fillinfo(int which)
  */
 LaxImage *ImageFile::GetPreview()
 {
-	if (preview) return preview;
+	if (preview) {
+		preview_cache.Touch(&cachenode);
+		return preview;
+	}
+
+	if (!previewfile && (thumb_location == LIV_Memory_Thumbs || thumb_location == LIV_Local_Thumbs)) {
+		if (thumb_location == LIV_Local_Thumbs && preview_state == PREVIEW_Exists_Not_Loaded) LoadPackedPreview();
+		if (preview_state == PREVIEW_Unknown) generate_preview(this, THUMB_Large, false, TASK_Visible_Thumbs);
+		else if (!preview) prioritize_preview(this);
+		return preview;
+	}
+
+	if (preview_state == PREVIEW_Loading || (state & FILE_Has_preview_loading)) prioritize_preview(this);
+	if (preview_state == PREVIEW_Loading) return NULL;
 	fillinfo(FILE_Has_preview);
 	return preview;
 }
 
+/*! Make sure there is a current preview of this file where the gui will look for it,
+ * queueing one for generation if not, without loading any image. This is what GetPreview()
+ * eventually does, for when there is no gui, see make_thumbnails().
+ */
+void ImageFile::QueuePreview()
+{
+	if (filetype == FILE_Is_Directory) return;
+
+	if (thumb_location == LIV_Local_Thumbs) {
+		if (!previewfile && preview_state == PREVIEW_Unknown) generate_preview(this, THUMB_Large);
+
+	} else if (thumb_location == LIV_Freedesktop_Thumbs) {
+		 //regenerates when stale, unless SetFile() just queued a new one
+		if (previewfile && preview_state == PREVIEW_Exists_Not_Loaded && !Has(FILE_Has_preview_loading))
+			fillinfo(FILE_Has_preview_info);
+	}
+}
+
+/*! Return whether making a preview of this file failed before, in this or an earlier run,
+ * and the file has not changed since. See record_preview_failure().
+ */
+bool ImageFile::PreviewFailed()
+{
+	fillinfo(FILE_Has_stat);
+	if (!Has(FILE_Has_stat)) return false;
+
+	if (thumb_location == LIV_Memory_Thumbs)
+		return __atomic_load_n(&preview_fail_mtime, __ATOMIC_ACQUIRE) == (long)fileinfo.st_mtime;
+
+	if (thumb_location == LIV_Local_Thumbs) {
+		if (!thumbpack) thumbpack = thumb_pack_for_file(filename);
+		if (!thumbpack) return false;
+		const char *base = strrchr(filename, '/');
+		return thumbpack->Lookup(base ? base+1 : filename, fileinfo.st_size, fileinfo.st_mtime, NULL) == 3;
+	}
+
+	if (thumb_location != LIV_Freedesktop_Thumbs) return false;
+
+	char *failfile = thumb_fail_file(filename);
+	if (!failfile) return false;
+
+	PngInfo info;
+	bool failed = (info.Read(failfile) == 0 && info.orig_mtime >= 0 && !info.IsStaleFor(filename, fileinfo.st_mtime));
+	delete[] failfile;
+	return failed;
+}
+
+/*! Called when previewfile is found to be out of date with the original.
+ * Forget it, and arrange for a new one according to thumb_location. Freedesktop previews
+ * are regenerated in place, and GetPreview() returns NULL until that is done.
+ */
+void ImageFile::StalePreview()
+{
+	ReleasePreview(-1);
+	delete[] previewfile;
+	previewfile = NULL;
+	SetState(FILE_Has_preview | FILE_Has_preview_info, false);
+	preview_state = PREVIEW_Unknown;
+
+	if (thumb_location == LIV_Freedesktop_Thumbs) {
+		previewfile = freedesktop_thumbnail(filename,'l');
+		preview_state = PREVIEW_Loading;
+		generate_preview(this, THUMB_Large, true);
+		if (thumbs[THUMB_Large].state != PREVIEW_Loading) preview_state = PREVIEW_Doesnt_Exist; //was not queued
+
+	} else if (thumb_location == LIV_Local_Thumbs) {
+		if (!thumbpack) thumbpack = thumb_pack_for_file(filename);
+
+	} else if (thumb_location == LIV_None) {
+		preview_state = PREVIEW_Doesnt_Exist;
+	}
+}
+
+/*! Look for a current thumbnail in the ThumbPack for this file's directory.
+ * If found, take preview and original dimensions from the pack index, copy the index info
+ * to entry_ret if not NULL, and return 0.
+ * The pixels themselves are not touched until LoadPackedPreview().
+ */
+int ImageFile::FindPackedPreview(ThumbPackEntry *entry_ret)
+{
+	if (!thumbpack) thumbpack = thumb_pack_for_file(filename);
+	if (!thumbpack) return 1;
+
+	fillinfo(FILE_Has_stat);
+	if (!Has(FILE_Has_stat)) return 1;
+
+	const char *base = strrchr(filename, '/');
+	base = (base ? base+1 : filename);
+
+	ThumbPackEntry entry;
+	if (thumbpack->Lookup(base, fileinfo.st_size, fileinfo.st_mtime, &entry) != 0) return 1;
+
+	pwidth  = entry.width;
+	pheight = entry.height;
+	SetState(FILE_Has_preview_info);
+	if (entry.orig_width > 0 && entry.orig_height > 0 && !Has(FILE_Has_image_info)) {
+		width  = entry.orig_width;
+		height = entry.orig_height;
+		SetState(FILE_Has_image_info);
+	}
+
+	preview_state = PREVIEW_Exists_Not_Loaded;
+	if (entry_ret) *entry_ret = entry;
+	return 0;
+}
+
+/*! Make preview from our entry in thumbpack, inflated straight into a new image's buffer.
+ * If that fails, preview_state becomes PREVIEW_Unknown, so that it will be regenerated.
+ * Should be called with imlib_mutex locked. Returns 0 for success.
+ */
+int ImageFile::LoadPackedPreview()
+{
+	if (preview) return 0;
+
+	ThumbPackEntry entry;
+	if (FindPackedPreview(&entry) != 0) {
+		preview_state = PREVIEW_Unknown;
+		return 1;
+	}
+
+	Imlib_Image img = imlib_create_image(entry.width, entry.height);
+	if (img) {
+		imlib_context_set_image(img);
+		DATA32 *data = imlib_image_get_data();
+		int status = thumbpack->Decode(&entry, (unsigned int*)data);
+		imlib_image_put_back_data(data);
+		if (status != 0) {
+			imlib_free_image();
+			img = NULL;
+		}
+	}
+	if (!img) {
+		preview_state = PREVIEW_Unknown;
+		return 1;
+	}
+
+	imlib_image_set_has_alpha(entry.has_alpha);
+
+	LaxImage *limg = new LaxImlibImage(NULL, img);
+	SetPreview(limg);
+	limg->dec_count();
+	return 0;
+}
+
+/*! Install img as the preview, incrementing its count, and register it with preview_cache.
+ * Returns 0 for success, or 1 if img is NULL.
+ */
+int ImageFile::SetPreview(LaxImage *img)
+{
+	if (!img) return 1;
+
+	if (img != preview) {
+		img->inc_count();
+		if (preview) preview->dec_count();
+		preview = img;
+	}
+
+	SetState(FILE_Has_preview | FILE_Has_preview_info);
+	preview_state = PREVIEW_Loaded;
+	pwidth  = preview->w();
+	pheight = preview->h();
+
+	cachenode.owner = this;
+	cachenode.level = -1;
+	preview_cache.Add(&cachenode, (long)pwidth * pheight * 4);
+	return 0;
+}
+
+/*! Called from preview_cache when over budget. Drop the image for ThumbSize level,
+ * or the main preview if level < 0. It will be reloaded or regenerated when next needed.
+ * Dimensions are kept, so layout is not affected.
+ */
+void ImageFile::ReleasePreview(int level)
+{
+	if (level < 0) {
+		preview_cache.Remove(&cachenode);
+		if (!preview) return;
+
+		preview->dec_count();
+		preview = NULL;
+		SetState(FILE_Has_preview, false);
+		if (!previewfile && thumb_location == LIV_Memory_Thumbs) preview_state = PREVIEW_Unknown;
+		else preview_state = PREVIEW_Exists_Not_Loaded;
+		return;
+	}
+
+	if (level >= THUMB_MAX) return;
+
+	preview_cache.Remove(&thumbs[level].cachenode);
+	if (!thumbs[level].image) return;
+
+	thumbs[level].image->dec_count();
+	thumbs[level].image = NULL;
+	thumbs[level].state = PREVIEW_Exists_Not_Loaded;
+}
+
+/*! Return the freedesktop thumbnail path for the given ThumbSize, or NULL.
+ */
+const char *ImageFile::ThumbFile(int level)
+{
+	if (level < 0 || level >= THUMB_MAX) return NULL;
+	if (!thumbs[level].file) thumbs[level].file = thumb_level_file(filename, level);
+	return thumbs[level].file;
+}
+
+/*! Return the preview for ThumbSize level, loading it if it exists already.
+ * If it does not exist, it is queued for generation, and NULL is returned until it is ready.
+ * Callers should fall back to GetPreview() in that case.
+ *
+ * Only freedesktop thumbnails have sizes other than the one GetPreview() returns.
+ */
+LaxImage *ImageFile::GetThumb(int level)
+{
+	if (thumb_location != LIV_Freedesktop_Thumbs || level < 0 || level >= THUMB_MAX) return GetPreview();
+
+	ThumbLevel *thumb = &thumbs[level];
+	if (thumb->image) {
+		preview_cache.Touch(&thumb->cachenode);
+		return thumb->image;
+	}
+
+	if (!ThumbFile(level)) return GetPreview();
+	if (!previewfile && preview_state == PREVIEW_Doesnt_Exist) return NULL; //no preview can be made
+	if (previewfile && !strcmp(previewfile, thumb->file)) return GetPreview();
+
+	if (thumb->state == PREVIEW_Unknown) {
+		 //reading the header tells us both whether it exists and whether it is current
+		PngInfo info;
+		int exists = (info.Read(thumb->file) == 0);
+		fillinfo(FILE_Has_stat);
+		if (exists && (!Has(FILE_Has_stat) || !info.IsStaleFor(filename, fileinfo.st_mtime)))
+			thumb->state = PREVIEW_Exists_Not_Loaded;
+		else {
+			generate_preview(this, level, exists, TASK_Visible_Thumbs);
+			if (thumb->state == PREVIEW_Unknown) thumb->state = PREVIEW_Doesnt_Exist; //was not queued
+		}
+	} else if (thumb->state == PREVIEW_Loading) prioritize_preview(this);
+
+	if (thumb->state == PREVIEW_Exists_Not_Loaded) {
+		thumb->image = load_image(thumb->file);
+		thumb->state = (thumb->image ? PREVIEW_Loaded : PREVIEW_Doesnt_Exist);
+
+		if (thumb->image) {
+			thumb->cachenode.owner = this;
+			thumb->cachenode.level = level;
+			preview_cache.Add(&thumb->cachenode, (long)thumb->image->w() * thumb->image->h() * 4);
+		}
+	}
+
+	return thumb->image;
+}
+
 /*! Return a fully loaded in image, or NULL if can't do that at the moment.
  */
 LaxImage *ImageFile::GetImage()
 {
 	if (image) return image;
+	if (IsLoading(FILE_Has_image)) return NULL; //a worker is on it, don't hold up drawing
 	fillinfo(FILE_Has_image);
 	return image;
 }
 
+/*! Return the smallest of image halved over and over that is still at least scale times
+ * the size of image, for drawing quickly at about that scale. Halvings are made as needed
+ * and kept. fx and fy get how many times smaller it is than image. This is image itself when
+ * scale is more than half, and NULL if there is no image.
+ * Must be called with imlib_mutex locked.
+ */
+LaxImage *ImageFile::GetMipImage(double scale, double *fx, double *fy)
+{
+	*fx = *fy = 1;
+	LaxImage *full = GetImage();
+	if (!full) return NULL;
+
+	LaxImage *img = full;
+	for (int c=0; c<LIV_MIP_MAX; c++) {
+		if (scale > 1./(2<<c)) break;
+
+		if (!mips[c]) {
+			LaxImlibImage *bigger = dynamic_cast<LaxImlibImage*>(img);
+			if (!bigger || img->w() < 2 || img->h() < 2) break;
+			Imlib_Image half = downscale_imlib(bigger->Image(), img->w()/2, img->h()/2);
+			if (!half) break;
+			mips[c] = new LaxImlibImage(NULL, half);
+		}
+		img = mips[c];
+	}
+
+	*fx = (double)full->w() / img->w();
+	*fy = (double)full->h() / img->h();
+	return img;
+}
+
+/*! Return a copy of the full image downscaled to exactly w x h, for drawing at fit to screen
+ * sizes, so the displayer does not have to resample the whole image every refresh.
+ * The copy is kept until a different size is asked for. Returns NULL if the image cannot
+ * be loaded, or if w x h is not actually smaller than the image.
+ * Must be called with imlib_mutex locked.
+ */
+LaxImage *ImageFile::GetFittedImage(int w, int h)
+{
+	if (fitted && (int)fitted->w() == w && (int)fitted->h() == h) return fitted;
+
+	LaxImlibImage *full = dynamic_cast<LaxImlibImage*>(GetImage());
+	if (!full || w < 1 || h < 1 || w > (int)full->w() || h > (int)full->h()
+			|| (w == (int)full->w() && h == (int)full->h()))
+		return NULL;
+
+	Imlib_Image scaled = downscale_imlib(full->Image(), w, h);
+	if (!scaled) return NULL;
+
+	if (fitted) fitted->dec_count();
+	fitted = new LaxImlibImage(NULL, scaled);
+	return fitted;
+}
+
+/*! Let go of the copies made by GetFittedImage() and GetMipImage(), for when the image
+ * is no longer the one on screen. Must be called with imlib_mutex locked.
+ */
+void ImageFile::ReleaseScaled()
+{
+	if (fitted) {
+		fitted->dec_count();
+		fitted = NULL;
+	}
+	for (int c=0; c<LIV_MIP_MAX; c++) {
+		if (mips[c]) {
+			mips[c]->dec_count();
+			mips[c] = NULL;
+		}
+	}
+}
+
+//------------------------------------------- background tasks ---------------------------------------------------
+
+
+//! Files bigger than this are left for imlib to load when shown, rather than prefetched.
+#define PREFETCH_MAX_FILE  (64*1024*1024)
+
+
+//! For TaskScheduler::wake, so that finished tasks get their Finish() on the next refresh.
+static void wake_ui()
+{
+	post_ui_wakeup();
+}
+
+
+/*! \class ExifTask
+ * \brief Read exif info of an ImageFile with exif_exec, without holding up the ui.
+ */
+class ExifTask : public Task
+{
+  public:
+	ImageFile *fileobject; //counted
+	char *exif;
+
+	ExifTask(ImageFile *file);
+	virtual ~ExifTask();
+	virtual const char *whattype() { return "ExifTask"; }
+	virtual void Run();
+	virtual void Finish();
+};
+
+ExifTask::ExifTask(ImageFile *file)
+{
+	fileobject = file;
+	fileobject->inc_count();
+	exif = NULL;
+}
+
+ExifTask::~ExifTask()
+{
+	delete[] exif;
+	fileobject->dec_count();
+}
+
+void ExifTask::Run()
+{
+	if (!fileobject->BeginLoad(FILE_Has_exif, false)) return;
+	exif = read_exif(fileobject->filename);
+	fileobject->EndLoad(FILE_Has_exif, true);
+	wants_finish = (exif != NULL);
+}
+
+//! Install exif as fileobject->meta, unless something else already did.
+void ExifTask::Finish()
+{
+	if (fileobject->meta) return;
+	fileobject->meta = new Attribute;
+	fileobject->meta->push("exif",exif);
+}
+
+
+/*! \class ImageDecodeTask
+ * \brief Decode a whole image before it is shown, see LivWindow::Prefetch().
+ *
+ * Only jpegs and pngs are decoded here, in liv's own buffers. Anything else is left for
+ * ImageFile::fillinfo() to load when shown, but at least the file will be in the page cache.
+ *
+ * The task holds the FILE_Has_image claim of the file while it works, and hands the pixels over
+ * with ImageFile::SetPendingImage(), so the ui thread turns them into an imlib image without
+ * decoding again.
+ */
+class ImageDecodeTask : public Task
+{
+  public:
+	ImageFile *fileobject; //counted
+	unsigned int *argb;
+	int width, height, has_alpha;
+
+	ImageDecodeTask(ImageFile *file, CancelToken *ntoken);
+	virtual ~ImageDecodeTask();
+	virtual const char *whattype() { return "ImageDecodeTask"; }
+	virtual void Run();
+};
+
+ImageDecodeTask::ImageDecodeTask(ImageFile *file, CancelToken *ntoken)
+  : Task(ntoken)
+{
+	fileobject = file;
+	fileobject->inc_count();
+	argb = NULL;
+	width = height = has_alpha = 0;
+}
+
+ImageDecodeTask::~ImageDecodeTask()
+{
+	delete[] argb;
+	fileobject->dec_count();
+}
+
+void ImageDecodeTask::Run()
+{
+	 //nothing to do if it is loaded or being loaded
+	if (!fileobject->BeginLoad(FILE_Has_image, false)) return;
+
+	long len = 0;
+	unsigned char *data = read_file_data(fileobject->filename, PREFETCH_MAX_FILE, &len);
+	if (data) {
+		if (!Cancelled() && is_jpeg_or_png(data, len)) {
+			if (data[0] == 0xff) argb = decode_jpeg(data, len, 0, &width, &height);
+			else argb = decode_png(data, len, &width, &height, &has_alpha);
+		}
+		delete[] data;
+	}
+
+	if (argb && !Cancelled()) {
+		fileobject->SetPendingImage(argb, width, height, has_alpha);
+		argb = NULL;
+	}
+	fileobject->EndLoad(FILE_Has_image, false); //image itself is made in ImageFile::fillinfo()
+}
+
+
 //------------------------------------------- LivWindow ---------------------------------------------------
 
 
@@ -1036,6 +3247,27 @@ LivWindow::LivWindow(anXWindow *parnt,const char *nname,const char *ntitle,unsig
 	 //viewing state:
 	livflags        = 0;// LIV_Autoremove
 	slideshow_timer = 0;
+	redraw_timer    = 0;
+	imlib_retry_timer = 0;
+	last_drawn      = 0;
+	needtooverlay   = 0;
+	base_layer      = 0;
+	base_w = base_h = 0;
+	base_gc         = NULL;
+	scroll_x = scroll_y = 0;
+	pixmap_cache    = new PixmapCache(LIV_DEFAULT_PIXMAP_MEMORY * 1024L * 1024L);
+	fast_render     = 0;
+	quality_timer   = 0;
+	last_interaction = 0;
+	frame_timer     = 0;
+	last_frame      = 0;
+	frame_cost      = 0;
+	drag_time       = 0;
+	zoom_remaining  = 0;
+	last_nav        = 0;
+	scrubbing       = 0;
+	scrub_timer     = 0;
+	scaled_image    = NULL;
 	showoverlay     = 0;
 	showmarkedpanel = 1;
 	imagesonly      = 1; //images, text files, other files, directories
@@ -1064,10 +3296,29 @@ LivWindow::LivWindow(anXWindow *parnt,const char *nname,const char *ntitle,unsig
 	 // LivFlags::LIV_Local_Thumbs,
 	 // LivFlags::LIV_Freedesktop_Thumbs,
 	thumb_location = memorythumbs;
+
+	 //background work, whose results only this thread may install
+	set_ui_thread();
+	scheduler = new TaskScheduler(TaskScheduler::ThreadsForCpuLimit());
+	scheduler->wake = wake_ui;
+	set_preview_scheduler(scheduler);
+	prefetch_token = NULL;
+	prefetching[0] = prefetching[1] = NULL;
 }
 
 LivWindow::~LivWindow()
 {
+	 //stop background work before anything it might use goes away
+	CancelPrefetch();
+	set_preview_scheduler(NULL);
+	scheduler->Shutdown();
+	scheduler->dec_count();
+
+	ReleaseBaseLayer();
+	pthread_mutex_lock(&imlib_mutex);
+	delete pixmap_cache;
+	if (scaled_image) scaled_image->dec_count();
+	pthread_mutex_unlock(&imlib_mutex);
 	if (collectionfile) delete[] collectionfile;
 	if (hover_text) delete[] hover_text;
 	if (sc) sc->dec_count();
@@ -1102,21 +3353,61 @@ void LivWindow::InitializePlacements()
 	//filesystem->height=defaultheight;
 	//filesystem->Id(_("File System"));
 
-	top.Gap(defaultwidth*.1);
-	top.Add(selection);
-	top.Add(collection);
-	//top.Add(filesystem);
-	top.Layout(1);//layout full in one row
-}
+	top.Gap(defaultwidth*.1);
+	top.Add(selection);
+	top.Add(collection);
+	//top.Add(filesystem);
+	top.Layout(1);//layout full in one row
+}
+
+int LivWindow::init()
+{
+	PositionMiscBoxes();
+	return 0;
+}
+
+int LivWindow::Idle(int tid)
+{
+	if (tid && tid == redraw_timer) {
+		 //background work was held back to not redraw too often, see Refresh()
+		redraw_timer = 0;
+		needtodraw = 1;
+		return 1;
+	}
+
+	if (tid && tid == imlib_retry_timer) {
+		 //just to get another Refresh(), whatever it wanted to draw is still marked
+		imlib_retry_timer = 0;
+		return 1;
+	}
+
+	if (tid && tid == frame_timer) {
+		if (Animate()) return 0;
+		frame_timer = 0;
+		return 1;
+	}
+
+	if (tid && tid == quality_timer) {
+		if (clock_seconds(CLOCK_MONOTONIC) - last_interaction < LIV_SETTLE_MS/1000.) return 0;
+
+		 //zooming stopped, so redraw properly, see Interacting()
+		quality_timer = 0;
+		fast_render = 0;
+		needtodraw = 1;
+		return 1;
+	}
+
+	if (tid && tid == scrub_timer) {
+		if (scrubbing && clock_seconds(CLOCK_MONOTONIC) - last_nav < LIV_SCRUB_SETTLE_MS/1000.) return 0;
 
-int LivWindow::init()
-{
-	PositionMiscBoxes();
-	return 0;
-}
+		 //key was let go of, so load what it stopped on, see ScrubTo()
+		scrub_timer = 0;
+		scrubbing = 0;
+		if (current_image_index >= 0) SelectImage(current_image_index);
+		needtodraw = 1;
+		return 1;
+	}
 
-int LivWindow::Idle(int tid)
-{
 	if (tid != slideshow_timer) return 0;
 
 	SelectImage(current_image_index+1);
@@ -1166,12 +3457,13 @@ Viewmode LivWindow::Mode(Viewmode newmode)
 	Viewmode oldmode = viewmode;
 	viewmode = newmode;
 	menuactions.flush();
+	StopAnimating();
 	needtodraw=1;
 
 	if (oldmode == VIEW_Thumbs && newmode == VIEW_Normal && curzone != collection) {
 		curzone = collection;
-		current_image_index = curzone->FindIndex(current->image);
-		current = (current_image_index >= 0 ? curzone->kids.e[current_image_index] : NULL);
+		current_image_index = curzone->FindIndex(current);
+		current = (current_image_index >= 0 ? curzone->kids.image[current_image_index] : NULL);
 	}
 
 	return oldmode;
@@ -1208,18 +3500,99 @@ void LivWindow::Refresh()
 		firsttime=0;
 	}
 
-	if (!needtodraw) return;
-	needtodraw=0;
+	 //previews, prefetched images, and such, done since the last refresh,
+	 //unless a worker is busy loading something with imlib
+	take_ui_wakeup();
+	bool work_done = false;
+	if (pthread_mutex_trylock(&imlib_mutex) == 0) {
+		__atomic_store_n(&imlib_wanted, 0, __ATOMIC_RELEASE);
+		work_done = (scheduler->FinishCompleted() > 0);
+		delete_dead_files();
+		pthread_mutex_unlock(&imlib_mutex);
+	} else ImlibBusy();
+
+	 //draw for those at most once a frame, later from Idle() if we just drew
+	if (work_done && !needtodraw) {
+		if (clock_seconds(CLOCK_MONOTONIC) - last_drawn >= LIV_FRAME_MS/1000.) needtodraw = 1;
+		else if (!redraw_timer) redraw_timer = app->addtimer(this, LIV_FRAME_MS, LIV_FRAME_MS, LIV_FRAME_MS);
+	}
+
+	if (!needtodraw && !needtooverlay && !scroll_x && !scroll_y) return;
+
+	 //never hold up the event loop for a worker's imlib load, draw a moment later instead
+	if (pthread_mutex_trylock(&imlib_mutex) != 0) {
+		ImlibBusy();
+		return;
+	}
+	__atomic_store_n(&imlib_wanted, 0, __ATOMIC_RELEASE);
+
+	 //scaled copies are only worth keeping for the image on screen
+	if (scaled_image != current) {
+		if (scaled_image) {
+			 //the pixmap cache would otherwise keep them until trimmed
+			if (scaled_image->fitted) pixmap_cache->Forget(scaled_image->fitted);
+			for (int c=0; c<LIV_MIP_MAX; c++)
+				if (scaled_image->mips[c]) pixmap_cache->Forget(scaled_image->mips[c]);
+			scaled_image->ReleaseScaled();
+			scaled_image->dec_count();
+		}
+		scaled_image = current;
+		if (scaled_image) scaled_image->inc_count();
+	}
 
+	bool redraw_base = (needtodraw != 0);
+	int dx = scroll_x, dy = scroll_y;
+	needtodraw = needtooverlay = 0;
+	scroll_x = scroll_y = 0;
+	last_drawn = clock_seconds(CLOCK_MONOTONIC);
 
-	//clear window
 	dp->BlendMode(LAXOP_Over);
-	dp->ClearWindow();
 
-	pthread_mutex_lock(&imlib_mutex);
-	if (viewmode==VIEW_Help) RefreshHelp();
-	if (viewmode==VIEW_Normal || viewmode == VIEW_Slideshow) RefreshNormal();
-	if (viewmode==VIEW_Thumbs) RefreshThumbs();
+	 //the image or thumbnails, only redrawn where they changed
+	if (!redraw_base && (dx || dy)) redraw_base = !ScrollBaseLayer(dx,dy);
+	if (redraw_base || !RestoreBaseLayer()) {
+		damage.minx = 0;  damage.maxx = win_w;
+		damage.miny = 0;  damage.maxy = win_h;
+		preview_cache.NewFrame();
+		dp->ClearWindow();
+		if (viewmode==VIEW_Help) RefreshHelp();
+		if (viewmode==VIEW_Normal || viewmode == VIEW_Slideshow) RefreshNormal();
+		if (viewmode==VIEW_Thumbs) RefreshThumbs();
+		SaveBaseLayer();
+	}
+
+	RefreshOverlays();
+
+	pthread_mutex_unlock(&imlib_mutex);
+
+	 //no imlib in the swap, so preview threads need not wait for it
+	SwapBuffers();
+
+	 //what a frame costs us, to know when to draw animations more cheaply, see Animate()
+	frame_cost = .8*frame_cost + .2*(clock_seconds(CLOCK_MONOTONIC) - last_drawn);
+}
+
+/*! A worker has imlib_mutex, so make sure Refresh() gets called again soon for whatever
+ * it could not do now. Workers hold off on their next imlib loads for a moment, so that one
+ * after another cannot keep the ui out.
+ */
+void LivWindow::ImlibBusy()
+{
+	__atomic_store_n(&imlib_wanted, 1, __ATOMIC_RELEASE);
+	if (!imlib_retry_timer)
+		imlib_retry_timer = app->addtimer(this, LIV_IMLIB_RETRY_MS, LIV_IMLIB_RETRY_MS, LIV_IMLIB_RETRY_MS);
+}
+
+/*! Draw everything that goes on top of the base layer: text, tag boxes, the selection panel,
+ * hover text and action boxes. These are redrawn every Refresh(), and are all that is redrawn
+ * when only needtooverlay was set. Called with imlib_mutex locked.
+ */
+void LivWindow::RefreshOverlays()
+{
+	Displayer *dp=GetDisplayer();
+
+	if (viewmode==VIEW_Normal || viewmode == VIEW_Slideshow) RefreshNormalOverlays();
+	if (viewmode==VIEW_Thumbs) RefreshThumbsOverlays();
 
 	if (show_debug) {
 		const char *str = "?";
@@ -1232,10 +3605,259 @@ void LivWindow::Refresh()
 		dp->textout(win_w,2*th, "debugging:",-1, LAX_RIGHT|LAX_TOP);
 		dp->textout(win_w,3*th, str,-1, LAX_RIGHT|LAX_TOP);
 		dp->textout(win_w,4*th, curzone==selection ? "selected" : "collection",-1, LAX_RIGHT|LAX_TOP);
+		char scratch[100];
+		sprintf(scratch, "previews: %d, %ld / %ld MB", preview_cache.count, preview_cache.used>>20, preview_cache.budget>>20);
+		dp->textout(win_w,5*th, scratch,-1, LAX_RIGHT|LAX_TOP);
+		sprintf(scratch, "pixmaps: %d, %ld MB", pixmap_cache->count, pixmap_cache->used>>20);
+		dp->textout(win_w,6*th, scratch,-1, LAX_RIGHT|LAX_TOP);
 	}
-	SwapBuffers();
-	pthread_mutex_unlock(&imlib_mutex);
 
+	 //drop least recently drawn previews if we have too many
+	preview_cache.Trim();
+}
+
+/*! Copy what is drawn so far to base_layer, so that later refreshes where only the overlays
+ * change can start from that instead of drawing the image or thumbnails all over again.
+ */
+void LivWindow::SaveBaseLayer()
+{
+	Display *dpy = app->dpy;
+	if (!dpy || !xlib_window || win_w <= 0 || win_h <= 0) return;
+
+	if (base_layer && (base_w != win_w || base_h != win_h)) {
+		XFreePixmap(dpy, base_layer);
+		base_layer = 0;
+	}
+	if (!base_layer) {
+		XWindowAttributes atts;
+		if (!XGetWindowAttributes(dpy, xlib_window, &atts)) return;
+		base_layer = XCreatePixmap(dpy, xlib_window, win_w, win_h, atts.depth);
+		base_w = win_w;
+		base_h = win_h;
+	}
+	if (!base_gc) base_gc = XCreateGC(dpy, xlib_window, 0, NULL);
+
+	XCopyArea(dpy, xlibDrawable(), base_layer, base_gc, 0,0, win_w,win_h, 0,0);
+}
+
+/*! Put base_layer back where drawing happens, instead of redrawing it.
+ * Returns false if there is no base layer of the current window size.
+ */
+bool LivWindow::RestoreBaseLayer()
+{
+	if (!base_layer || base_w != win_w || base_h != win_h) return false;
+
+	XCopyArea(app->dpy, base_layer, xlibDrawable(), base_gc, 0,0, win_w,win_h, 0,0);
+	return true;
+}
+
+/*! Move base_layer by dx,dy pixels, then draw just the strips that are newly exposed,
+ * so panning costs about the exposed area rather than the whole window.
+ * Returns false if that can't be done, and everything needs to be redrawn.
+ */
+bool LivWindow::ScrollBaseLayer(int dx, int dy)
+{
+	if (!base_layer || base_w != win_w || base_h != win_h) return false;
+	if (abs(dx) >= win_w || abs(dy) >= win_h) return false;
+	if (viewmode != VIEW_Normal && viewmode != VIEW_Slideshow && viewmode != VIEW_Thumbs) return false;
+
+	 //shift what is still in view, the server takes care of the overlap
+	XCopyArea(app->dpy, base_layer, base_layer, base_gc,
+			  dx < 0 ? -dx : 0, dy < 0 ? -dy : 0, win_w - abs(dx), win_h - abs(dy),
+			  dx > 0 ?  dx : 0, dy > 0 ?  dy : 0);
+	RestoreBaseLayer();
+
+	 //columns uncovered on the left or right, then rows on the top or bottom not already done
+	int sx = (dx > 0 ? 0 : win_w + dx), sw = abs(dx);
+	int sy = (dy > 0 ? 0 : win_h + dy), sh = abs(dy);
+	if (sw) RefreshBase(sx,0, sw,win_h);
+	if (sh) RefreshBase(dx > 0 ? dx : 0, sy, win_w - sw, sh);
+
+	return true;
+}
+
+/*! Redraw the base layer in just the given screen rectangle, and update base_layer there.
+ * Called with imlib_mutex locked.
+ */
+void LivWindow::RefreshBase(int x, int y, int w, int h)
+{
+	if (w <= 0 || h <= 0) return;
+	Displayer *dp=GetDisplayer();
+
+	damage.minx = x;  damage.maxx = x+w;
+	damage.miny = y;  damage.maxy = y+h;
+
+	flatpoint p[4];
+	p[0] = flatpoint(x,  y);
+	p[1] = flatpoint(x+w,y);
+	p[2] = flatpoint(x+w,y+h);
+	p[3] = flatpoint(x,  y+h);
+	dp->PushClip(1);
+	dp->Clip(p,4, 0);
+
+	dp->NewFG(win_colors->bg);
+	dp->drawrectangle(x,y, w,h, 1);
+	if (viewmode==VIEW_Normal || viewmode == VIEW_Slideshow) RefreshNormal();
+	if (viewmode==VIEW_Thumbs) RefreshThumbs();
+
+	dp->PopClip();
+
+	XCopyArea(app->dpy, xlibDrawable(), base_layer, base_gc, x,y, w,h, x,y);
+}
+
+/*! Move the view by dx,dy screen pixels, by changing m, which is either current->matrix or
+ * thumb_matrix. This only marks what is already drawn to be shifted, see ScrollBaseLayer(),
+ * unless a full redraw is needed anyway.
+ */
+void LivWindow::Pan(double *m, int dx, int dy)
+{
+	m[4] += dx;
+	m[5] += dy;
+
+	if (viewmode == VIEW_Normal) {
+		 //images still fitting to the screen get their matrix redone on refresh
+		if (current->zoommode != LIVZOOM_As_Is || !current->Has(FILE_Has_matrix)) {
+			current->zoommode = LIVZOOM_As_Is;
+			needtodraw = 1;
+			return;
+		}
+
+		 //current->matrix is inside the screen rotation
+		flatpoint v = transform_vector(screen_matrix, flatpoint(dx,dy));
+		dx = int(floor(v.x + .5));
+		dy = int(floor(v.y + .5));
+	}
+
+	scroll_x += dx;
+	scroll_y += dy;
+}
+
+/*! If img drawn with matrix m is just scaled and moved, copy it from pixmap_cache to the part of
+ * damage it covers, uploading it there first if need be. Returns false if img needs to be
+ * drawn the usual way instead. Called with imlib_mutex locked.
+ */
+bool LivWindow::DrawCachedImage(LaxImage *img, double *m)
+{
+	if (screen_rotation != 0 || m[1] != 0 || m[2] != 0 || m[0] <= 0 || m[3] <= 0) return false;
+
+	int w = int(img->w() * m[0] + .5);
+	int h = int(img->h() * m[3] + .5);
+	Pixmap pixmap = pixmap_cache->Get(app->dpy, xlib_window, img, w,h, !fast_render); //no uploads mid zoom
+	if (!pixmap) return false;
+
+	 //only the part in damage, as XCopyArea knows nothing of the displayer's clip
+	int x = int(floor(m[4] + .5)), y = int(floor(m[5] + .5));
+	int x1 = (x > damage.minx ? x : int(damage.minx));
+	int y1 = (y > damage.miny ? y : int(damage.miny));
+	int x2 = (x+w < damage.maxx ? x+w : int(damage.maxx));
+	int y2 = (y+h < damage.maxy ? y+h : int(damage.maxy));
+	if (x2 <= x1 || y2 <= y1) return true;
+
+	if (!base_gc) base_gc = XCreateGC(app->dpy, xlib_window, 0, NULL);
+	XCopyArea(app->dpy, pixmap, xlibDrawable(), base_gc, x1-x,y1-y, x2-x1,y2-y1, x1,y1);
+	return true;
+}
+
+/*! Note that the view is being zoomed right now, so that refreshes draw with GetMipImage()
+ * rather than at full quality, until nothing has happened for LIV_SETTLE_MS. See Idle().
+ */
+void LivWindow::Interacting()
+{
+	fast_render = 1;
+	last_interaction = clock_seconds(CLOCK_MONOTONIC);
+	if (!quality_timer) quality_timer = app->addtimer(this, LIV_SETTLE_MS, LIV_SETTLE_MS/2, -1);
+}
+
+/*! Make Idle() call Animate() once a frame, until it returns false.
+ */
+void LivWindow::StartAnimating()
+{
+	if (frame_timer) return;
+	last_frame = clock_seconds(CLOCK_MONOTONIC);
+	frame_timer = app->addtimer(this, LIV_FRAME_MS, LIV_FRAME_MS, -1);
+}
+
+//! Stop kinetic panning and zoom animation where they are. The frame timer stops by itself.
+void LivWindow::StopAnimating()
+{
+	kinetic_v = kinetic_rest = flatpoint();
+	zoom_remaining = 0;
+}
+
+/*! Advance kinetic panning and zoom animations to now. Called once a frame from Idle()
+ * while anything is moving, so nothing is scheduled when nothing animates.
+ * Returns whether anything is still moving.
+ */
+bool LivWindow::Animate()
+{
+	double now = clock_seconds(CLOCK_MONOTONIC);
+	double dt = now - last_frame;
+	last_frame = now;
+	if (dt > .1) dt = .1; //don't jump after a stall
+
+	bool moving = false;
+
+	if (zoom_remaining) {
+		 //cover a fixed fraction of what is left per unit time, so it eases in to the target
+		double step = zoom_remaining * (1 - exp(-dt / LIV_ZOOM_TAU));
+		if (fabs(zoom_remaining - step) < .002) step = zoom_remaining;
+		zoom_remaining -= step;
+
+		if (viewmode == VIEW_Thumbs) ZoomThumbs(zoom_center, exp(step));
+		else Zoom(zoom_center, exp(step));
+		if (zoom_remaining) moving = true;
+	}
+
+	if (kinetic_v.x || kinetic_v.y) {
+		kinetic_rest += kinetic_v * dt;
+		int dx = int(kinetic_rest.x), dy = int(kinetic_rest.y);
+		kinetic_rest -= flatpoint(dx,dy);
+		if (dx || dy) Pan(thumb_matrix, dx,dy);
+
+		kinetic_v *= exp(-dt * LIV_KINETIC_FRICTION);
+		if (kinetic_v*kinetic_v < LIV_KINETIC_MIN*LIV_KINETIC_MIN) kinetic_v = kinetic_rest = flatpoint();
+		else moving = true;
+	}
+
+	 //drop quality before dropping frames
+	if (moving && frame_cost > .75 * LIV_FRAME_MS/1000.) Interacting();
+
+	return moving;
+}
+
+/*! Zoom by s around screen point center, over the next few frames rather than all at once.
+ * Zooms asked for before the last one is done add up.
+ */
+void LivWindow::AnimateZoom(flatpoint center, double s)
+{
+	if (s <= 0) return;
+	zoom_center = center;
+	zoom_remaining += log(s);
+	StartAnimating();
+}
+
+//! Scale thumb_matrix by s, keeping screen point center where it is.
+void LivWindow::ZoomThumbs(flatpoint center, double s)
+{
+	flatpoint op=transform_point_inverse(thumb_matrix,center);
+	for (int c=0; c<6; c++) thumb_matrix[c]*=s;
+	flatpoint np=transform_point(thumb_matrix,op);
+	np=center-np;
+	thumb_matrix[4]+=np.x;
+	thumb_matrix[5]+=np.y;
+	Interacting();
+	needtodraw=1;
+}
+
+void LivWindow::ReleaseBaseLayer()
+{
+	if (app && app->dpy) {
+		if (base_layer) XFreePixmap(app->dpy, base_layer);
+		if (base_gc) XFreeGC(app->dpy, base_gc);
+	}
+	base_layer = 0;
+	base_gc = NULL;
+	base_w = base_h = 0;
 }
 
 /*! Screen refresh for VIEW_Help mode.
@@ -1315,27 +3937,53 @@ void LivWindow::RefreshThumbs()
 		dp->PushAndNewTransform(thumb_matrix);
 		dp->NewFG(coloravg(win_colors->fg,win_colors->bg));
 
-		ImageSet *img;
-		LaxImage *ii;
-		for (int c=0; c<curzone->kids.n; c++) {
-			img = curzone->kids.e[c];
-			if (viewmarked && curzone->kids.e[c]->image && (curzone->kids.e[c]->image->mark & viewmarked)==0) continue;
+		 //find the area being drawn in thumb space, to skip thumbs that are outside it
+		DoubleBBox view;
+		view.addtobounds(transform_point_inverse(thumb_matrix, flatpoint(damage.minx,damage.miny)));
+		view.addtobounds(transform_point_inverse(thumb_matrix, flatpoint(damage.maxx,damage.miny)));
+		view.addtobounds(transform_point_inverse(thumb_matrix, flatpoint(damage.maxx,damage.maxy)));
+		view.addtobounds(transform_point_inverse(thumb_matrix, flatpoint(damage.minx,damage.maxy)));
 
-			ii = img->image->GetPreview();
-			if (ii) dp->imageout(ii, img->x,img->y,img->width,img->height);
+		ThumbList &kids = curzone->kids;
+		ImageFile *img;
+		LaxImage *ii;
+		double x,y,w,h;
+		double scale = norm(flatpoint(thumb_matrix[0],thumb_matrix[1]));
+		for (int c=0; c<kids.n; c++) {
+			x = kids.x[c];
+			y = kids.y[c];
+			w = kids.width[c];
+			h = kids.height[c];
+			if (x > view.maxx || y > view.maxy || x+w < view.minx || y+h < view.miny) continue;
+
+			img = kids.image[c];
+			if (!img) continue;
+			if (viewmarked && (img->mark & viewmarked)==0) continue;
+
+			 //use the smallest preview that covers the on-screen size
+			ii = img->GetThumb(thumb_level_for_size(scale * (w>h ? w : h)));
+			if (!ii) ii = img->GetPreview();
+			if (ii) dp->imageout(ii, x,y,w,h);
 			else {
-				ii = img->image->GetImage();
-				if (ii) dp->imageout(ii, img->x,img->y,img->width,img->height);
+				ii = img->GetImage();
+				if (ii) dp->imageout(ii, x,y,w,h);
 				else {
-					dp->drawrectangle(img->x,img->y,img->width,img->height, 0);
-					dp->drawline(img->x,img->y, img->x+img->width,img->y+img->height);
-					dp->drawline(img->x+img->width,img->y, img->x,img->y+img->height);
+					dp->drawrectangle(x,y,w,h, 0);
+					dp->drawline(x,y, x+w,y+h);
+					dp->drawline(x+w,y, x,y+h);
 				}
 			}
 		}
 
 		dp->PopAxes();
 	}
+}
+
+/*! Hover text, action boxes and selection panel for VIEW_Thumbs, see RefreshOverlays().
+ */
+void LivWindow::RefreshThumbsOverlays()
+{
+	Displayer *dp=GetDisplayer();
 
 	 //hover a message near image that mouse is currently over
 	if (hover_image>=0 && hover_image<curzone->kids.n) {
@@ -1411,11 +4059,11 @@ void LivWindow::DrawThumbsRecurseUp(ImageSet *thumb, double *m)
 	ImageSet *zone=thumb->parent;
 
 	for (int c=0; c<zone->kids.n; c++) {
-		if (zone->kids.e[c]==thumb) continue;
+		if (zone->kids.set[c]==thumb) continue;
 
-		//if (*** zone->kids.e[c] out of bounds) continue;
+		//if (*** zone->kids out of bounds at c) continue;
 
-		//DrawThumbsRecurseDown(zone->kids.e[c], *** m);
+		//DrawThumbsRecurseDown(zone->kids.set[c], *** m);
 	}
 }
 
@@ -1437,19 +4085,18 @@ void LivWindow::DrawThumbsRecurseDown(ImageSet *thumb, double *m)
 	for (int c=0; c<curzone->kids.n; c++) {
 		// *** if too small, return;
 
+		ImageFile *img = curzone->kids.image[c];
+		if (!img) continue;
 		if (viewmarked) {
-			if (curzone->kids.e[c]->image && (curzone->kids.e[c]->image->mark & viewmarked)==0) continue;
+			if ((img->mark & viewmarked)==0) continue;
 		}
 		n++;
 
-		ImageSet  *imgt = curzone->kids.e[c];
-		ImageFile *img  = imgt->image;
-
 		e=1; //whether to draw image or an X
-		x=imgt->x;
-		y=imgt->y;
-		w=imgt->width -thumbgap;
-		h=imgt->height-thumbgap; //pixel width of preview image
+		x=curzone->kids.x[c];
+		y=curzone->kids.y[c];
+		w=curzone->kids.width[c] -thumbgap;
+		h=curzone->kids.height[c]-thumbgap; //pixel width of preview image
 
 		if (h<=0 || w<=0) {
 			iw=img->width;
@@ -1523,12 +4170,34 @@ void LivWindow::RefreshNormal()
 
 
 	//static DoubleBBox box;
-	if (current->image) {
-		if ((current->image->state & FILE_Has_matrix) == 0) {
-			setzoom(current);
+	if (current && scrubbing && !current->image) {
+		 //flipping past, so just fit the preview, see ScrubTo()
+		LaxImage *preview = current->GetPreview();
+		double w = win_w, h = win_h;
+		if (screen_rotation == 90 || screen_rotation == 270) { w = win_h; h = win_w; }
+
+		if (!preview || preview->w() <= 0 || preview->h() <= 0) {
+			dp->NewFG(win_colors->fg);
+			dp->LineWidthScreen(1);
+			int s = win_w*.2;
+			if (win_h < win_w) s = win_h*.2;
+			dp->drawrectangle(win_w/2-s,win_h/2-s, 2*s,2*s, 0);
+			dp->drawthing(win_w/2,win_h/2, s*.8,s*.8, 0, THING_X);
+
+		} else {
+			double s = w / preview->w();
+			if (preview->h()*s > h) s = h / preview->h();
+			double pw = preview->w()*s, ph = preview->h()*s;
+
+			dp->PushAndNewTransform(screen_matrix);
+			dp->imageout(preview, (w-pw)/2,(h-ph)/2, pw,ph);
+			dp->PopAxes();
 		}
 
-		LaxImage *img = current->image->GetImage();
+	} else if (current) {
+		ResolveZoom(current);
+
+		LaxImage *img = current->GetImage();
 
 		if (!img) {
 			dp->NewFG(win_colors->fg);
@@ -1540,18 +4209,49 @@ void LivWindow::RefreshNormal()
 
 		} else {
 
+			double m[6];
+			transform_copy(m, current->matrix);
+			double sx = sqrt(m[0]*m[0] + m[1]*m[1]);
+			double sy = sqrt(m[2]*m[2] + m[3]*m[3]);
+
+			if (fast_render) {
+				 //while zooming, let the displayer scale a smaller copy, the real thing comes when it settles
+				double fx, fy;
+				LaxImage *mip = current->GetMipImage(sx > sy ? sx : sy, &fx, &fy);
+				if (mip && mip != img) {
+					m[0] *= fx;  m[1] *= fx;
+					m[2] *= fy;  m[3] *= fy;
+					img = mip;
+				}
+
+			} else if (current->zoommode == LIVZOOM_Scale_To_Screen || current->zoommode == LIVZOOM_Shrink_To_Screen) {
+				 //when fitting a big image to the screen, draw a copy already downscaled to size
+				if (sx < 1 && sy < 1) {
+					int fw = int(img->w()*sx + .5), fh = int(img->h()*sy + .5);
+					LaxImage *oldfit = current->fitted;
+					if (oldfit && ((int)oldfit->w() != fw || (int)oldfit->h() != fh)) pixmap_cache->Forget(oldfit); //about to be replaced
+					LaxImage *fit = current->GetFittedImage(fw, fh);
+					if (fit) {
+						double fx = (double)img->w() / fit->w(), fy = (double)img->h() / fit->h();
+						m[0] *= fx;  m[1] *= fx;
+						m[2] *= fy;  m[3] *= fy;
+						img = fit;
+					}
+				}
+			}
+
 			dp->PushAndNewTransform(screen_matrix);
-			dp->PushAndNewTransform(current->image->matrix);
+			dp->PushAndNewTransform(m);
 
 			//int w,h;
-			//w=current->image->width;
-			//h=current->image->height;
+			//w=current->width;
+			//h=current->height;
 
 	//		//box.clear();
 	//		flatpoint ul,ur,ll;
-	//		ul=transform_point(current->image->matrix, 0,0);
-	//		ur=transform_point(current->image->matrix, w,0);
-	//		ll=transform_point(current->image->matrix, 0,h);
+	//		ul=transform_point(current->matrix, 0,0);
+	//		ur=transform_point(current->matrix, w,0);
+	//		ll=transform_point(current->matrix, 0,h);
 	//
 	//		if (screen_rotation != 0) {
 	//			ul=transform_point(screen_matrix,ul);
@@ -1562,13 +4262,22 @@ void LivWindow::RefreshNormal()
 	//		ur=ur-ul;
 	//		ll=ll-ul;
 
-			dp->imageout(img, 0,0);
+			if (!DrawCachedImage(img, m)) dp->imageout(img, 0,0);
 
 			dp->PopAxes();
 			dp->PopAxes();
 		}
 	}
+}
+
+/*! File info, tags, meta, selection panel and action boxes for VIEW_Normal and
+ * VIEW_Slideshow, see RefreshOverlays().
+ */
+void LivWindow::RefreshNormalOverlays()
+{
+	if (!current) return;
 
+	Displayer *dp=GetDisplayer();
 	int y=0;
 
 	if (showbasics) {
@@ -1578,7 +4287,7 @@ void LivWindow::RefreshNormal()
 		dp->NewFG(win_colors->fg);
 
 		if (showbasics&SHOW_Filename) {
-			sprintf(text,"%s",current->image->filename);
+			sprintf(text,"%s",current->filename);
 			if (!(showbasics&SHOW_Index) && curzone->kids.n>1) {
 				sprintf(text+strlen(text),"  (%d/%d)",1+current_image_index,curzone->kids.n);
 			}
@@ -1593,13 +4302,13 @@ void LivWindow::RefreshNormal()
 		}
 
 		if (showbasics&SHOW_Filesize) {
-			double s=current->image->fileinfo.st_size;
+			double s=current->fileinfo.st_size;
 			if (s<1024) {
-				sprintf(text,"%d bytes",(int)current->image->fileinfo.st_size);
+				sprintf(text,"%d bytes",(int)current->fileinfo.st_size);
 			} else if (s<1024*1024) {
-				sprintf(text,"%ld kb",current->image->fileinfo.st_size/1024);
+				sprintf(text,"%ld kb",current->fileinfo.st_size/1024);
 			} else {
-				sprintf(text,"%.1f Mb",current->image->fileinfo.st_size/1024./1024);
+				sprintf(text,"%.1f Mb",current->fileinfo.st_size/1024./1024);
 			}
 
 			dp->textout(0,y, text,-1, LAX_TOP|LAX_LEFT);
@@ -1607,7 +4316,7 @@ void LivWindow::RefreshNormal()
 		}
 
 		if (showbasics&SHOW_Dims) {
-			sprintf(text,"%d x %d", current->image->width,current->image->height);
+			sprintf(text,"%d x %d", current->width,current->height);
 			dp->textout(0,y, text,-1, LAX_TOP|LAX_LEFT);
 			y+=dp->textheight();
 		}
@@ -1632,12 +4341,12 @@ void LivWindow::RefreshNormal()
 		dp->BlendMode(LAXOP_Over);
 	}
 
-	if (current->image->meta && current->image->meta->attributes.n && showmeta) {
+	if (current->meta && current->meta->attributes.n && showmeta) {
 		int x=0;
 		double th=dp->textheight();
-		for (int c=0; c<current->image->meta->attributes.n; c++) {
-			x=dp->textout(0,y, current->image->meta->attributes.e[c]->name,-1,  LAX_LEFT|LAX_TOP);
-			dp->textout(x,y,   current->image->meta->attributes.e[c]->value,-1, LAX_LEFT|LAX_TOP);
+		for (int c=0; c<current->meta->attributes.n; c++) {
+			x=dp->textout(0,y, current->meta->attributes.e[c]->name,-1,  LAX_LEFT|LAX_TOP);
+			dp->textout(x,y,   current->meta->attributes.e[c]->value,-1, LAX_LEFT|LAX_TOP);
 			y+=th;
 		}
 	}
@@ -1697,14 +4406,14 @@ void LivWindow::ShowMarkedPanel()
 
 			} else if (b->action==LIVA_Show_Selected_Image && b->index>=0 && b->index<selection->kids.n) {
 				 //draw thumbnail
-				img = selection->kids.e[b->index]->image;
+				img = selection->kids.image[b->index];
 
-				if (img==current->image && viewmode==VIEW_Normal) {
+				if (img==current && viewmode==VIEW_Normal) {
 					int h=(b->maxy-b->miny)/2;
 					dp->drawthing(win_w-h/2,win_h-2.5*h,h/2,h/2, THING_Diamond, rgbcolor(0,255,0),rgbcolor(0,255,0),1);
 				}
 
-				if (img->preview && img->width>0 && img->height>0) {
+				if (img->previewfile && img->width>0 && img->height>0) {
 					preview = img->GetPreview();
 					if (preview) dp->imageout(preview, b->minx,b->miny, b->maxx-b->minx,b->maxy-b->miny);
 					//------
@@ -1910,9 +4619,9 @@ int LivWindow::Event(const EventData *data,const char *mes)
 		if (!current) return 0;
 		const StrEventData *s=dynamic_cast<const StrEventData*>(data);
 		if (!s || isblank(s->str)) return 1;
-		current->image->InsertTags(s->str,0);
+		current->InsertTags(s->str,0);
 		PositionTagBoxes();
-		needtodraw=1;
+		needtooverlay=1;
 		return 0;
 	}
 
@@ -2092,7 +4801,7 @@ int LivWindow::ToggleMenu()
 	if (menuactions.n) {
 		 //turn off
 		menuactions.flush();
-		needtodraw=1;
+		needtooverlay=1;
 		return 0;
 	}
 
@@ -2115,7 +4824,7 @@ int LivWindow::ToggleMenu()
 	menuactions.push(new ActionBox(_("Filename"),          LIVA_Sort_Filename,-1,        1,  x2-w,x2, y,y+2*th, 1,VIEW_Thumbs), 1);  y+=2*th;
 	menuactions.push(new ActionBox(_("Filename Caseless"), LIVA_Sort_FilenameCaseless,-1,1,  x2-w,x2, y,y+2*th, 1,VIEW_Thumbs), 1);  y+=2*th;
 
-	needtodraw=1;
+	needtooverlay=1;
 	return 0;
 }
 
@@ -2169,6 +4878,7 @@ int LivWindow::LBDown(int x,int y,unsigned int state,int count, const LaxMouse *
 	else if (device2==0) device2=d->id;
 	lbdown=flatpoint(x,y);
 	//lbdownaction=GetAction(x,y,state);
+	kinetic_v = kinetic_rest = flatpoint(); //catch a kinetic pan
 
 	hover_image=-1;
 	return 0;
@@ -2188,6 +4898,12 @@ int LivWindow::LBUp(int x,int y,unsigned int state, const LaxMouse *d)
 	else if (d->id==device1) { device1=device2; device2=0; }
 
 	if (viewmode==VIEW_Thumbs) {
+		 //keep panning if a drag was let go of while still moving
+		if (mousemoved && clock_seconds(CLOCK_MONOTONIC) - drag_time < .05
+				&& kinetic_v*kinetic_v > LIV_KINETIC_MIN*LIV_KINETIC_MIN)
+			StartAnimating();
+		else kinetic_v = flatpoint();
+
 		if (mousemoved) return 0; //was just dragging
 
 		int index=0;
@@ -2270,8 +4986,7 @@ int LivWindow::LBUp(int x,int y,unsigned int state, const LaxMouse *d)
 
 	if (action == LIVA_Show_Selected_Image && actionbox->index >= 0) {
 		index = actionbox->index;
-		int i = curzone->FindIndex(selection->kids.e[index]->image);
-		//int i = curzone->FindIndex(selection->kids.e[index]->image);
+		int i = curzone->FindIndex(selection->kids.image[index]);
 		if (i>=0) SelectImage(i);
 		needtodraw=1;
 		return 0;
@@ -2288,7 +5003,7 @@ int LivWindow::MBDown(int x,int y,unsigned int state,int count, const LaxMouse *
 	buttondown.down(d->id,MIDDLEBUTTON, x,y);
 
 	mx=x; my=y;
-	//if (current) mbdown=transform_point_inverse(current->image->matrix,flatpoint(x,y));
+	//if (current) mbdown=transform_point_inverse(current->matrix,flatpoint(x,y));
 	if (current) mbdown=flatpoint(x,y);
 
 	return 0;
@@ -2312,12 +5027,12 @@ int LivWindow::RBUp(int x,int y,unsigned int state, const LaxMouse *d)
 
 	if (!current) return 0;
 
-	flatpoint pi=transform_point_inverse(current->image->matrix,flatpoint(x,y));
+	flatpoint pi=transform_point_inverse(current->matrix,flatpoint(x,y));
 	PerformAction(LIVA_Scale_1_To_1);
 
-	flatpoint o=flatpoint(x,y)-transform_point(current->image->matrix,pi);
-	current->image->matrix[4]+=o.x;
-	current->image->matrix[5]+=o.y;
+	flatpoint o=flatpoint(x,y)-transform_point(current->matrix,pi);
+	current->matrix[4]+=o.x;
+	current->matrix[5]+=o.y;
 
 	return 0;
 }
@@ -2330,34 +5045,22 @@ int LivWindow::WheelUp(int x,int y,unsigned int state, int count, const LaxMouse
 
 		 //if current mouse over image is more than 2/3 screen size, zoom to normal
 		flatpoint p=transform_point_inverse(thumb_matrix, flatpoint(x,y));
-		for (int c=0; c<curzone->kids.n; c++) {
-			if (curzone->width<=0) continue;
-			if (p.x >= curzone->kids.e[c]->x
-					&& p.x <  curzone->kids.e[c]->x+curzone->kids.e[c]->width
-					&& p.y >= curzone->kids.e[c]->y
-					&& p.y <  curzone->kids.e[c]->y+curzone->kids.e[c]->height) {
-				double tw=norm(transform_vector(thumb_matrix, flatpoint(curzone->kids.e[c]->width,0)));
-				double th=norm(transform_vector(thumb_matrix, flatpoint(0,curzone->kids.e[c]->height)));
-				DBG cerr <<"mouse in "<<c<<",  w,h:"<<tw<<','<<th<<endl;
-				if (tw>win_w*2/3 || th>win_h*2/3) {
-					SelectImage(c);
-					lastviewjump=0;
-					Mode(VIEW_Normal);
-					needtodraw=1;
-					return 0;
-				}
-				break;
+		int c = (curzone->width > 0 ? curzone->kids.pointindex(p.x,p.y) : -1);
+		if (c >= 0) {
+			double tw=norm(transform_vector(thumb_matrix, flatpoint(curzone->kids.width[c],0)));
+			double th=norm(transform_vector(thumb_matrix, flatpoint(0,curzone->kids.height[c])));
+			DBG cerr <<"mouse in "<<c<<",  w,h:"<<tw<<','<<th<<endl;
+			if (tw>win_w*2/3 || th>win_h*2/3) {
+				SelectImage(c);
+				lastviewjump=0;
+				Mode(VIEW_Normal);
+				needtodraw=1;
+				return 0;
 			}
 		}
 
 		 //we are not selecting an image, so still in thumb view
-		flatpoint op=transform_point_inverse(thumb_matrix,flatpoint(x,y));
-		for (int c=0; c<6; c++) thumb_matrix[c]/=.85;
-		flatpoint np=transform_point(thumb_matrix,op);
-		np=flatpoint(x,y)-np;
-		thumb_matrix[4]+=np.x;
-		thumb_matrix[5]+=np.y;
-		needtodraw=1;
+		AnimateZoom(flatpoint(x,y), 1/.85);
 		return 0;
 	}
 
@@ -2366,12 +5069,12 @@ int LivWindow::WheelUp(int x,int y,unsigned int state, int count, const LaxMouse
 		ActionBox *box=GetAction(x,y,state);
 		int action=box?box->action:LIVA_None;
 		if (action==LIVA_Next || action==LIVA_Previous) {
-			SelectImage((current_image_index+curzone->kids.n-1)%curzone->kids.n);
+			Navigate((current_image_index+curzone->kids.n-1)%curzone->kids.n);
 			needtodraw=1;
 			return 0;
 		}
 	} else if ((state&LAX_STATE_MASK)==ControlMask) {
-		Zoom(flatpoint(x,y),1/.85);
+		AnimateZoom(flatpoint(x,y),1/.85);
 	}
 
 	return 0;
@@ -2384,13 +5087,13 @@ int LivWindow::WheelDown(int x,int y,unsigned int state, int count, const LaxMou
 		ActionBox *box=GetAction(x,y,state);
 		int action=box?box->action:LIVA_None;
 		if (action==LIVA_Next || action==LIVA_Previous) {
-			SelectImage((current_image_index+1)%curzone->kids.n);
+			Navigate((current_image_index+1)%curzone->kids.n);
 			needtodraw=1;
 			return 0;
 		}
 
 	} else if ((state&LAX_STATE_MASK)==ControlMask) {
-		Zoom(flatpoint(x,y),.85);
+		AnimateZoom(flatpoint(x,y),.85);
 	}
 
 	if (viewmode==VIEW_Normal && (state&LAX_STATE_MASK)==0) {
@@ -2401,15 +5104,15 @@ int LivWindow::WheelDown(int x,int y,unsigned int state, int count, const LaxMou
 			//*** set zoom also?
 
 			 //shift thumb view so same point in image is under mouse still
-			flatpoint p=transform_point_inverse(current->image->matrix,flatpoint(x,y));
+			flatpoint p=transform_point_inverse(current->matrix,flatpoint(x,y));
 			double xx=p.x/current->width; //xx,yy 0..1 corresponds to image bounds
 			double yy=p.y/current->height;
 
-			xx*=curzone->kids.e[current_image_index]->width; //now scaled to thumb w,h
-			yy*=curzone->kids.e[current_image_index]->height;
+			xx*=curzone->kids.width[current_image_index]; //now scaled to thumb w,h
+			yy*=curzone->kids.height[current_image_index];
 
-			xx+=curzone->kids.e[current_image_index]->x;
-			yy+=curzone->kids.e[current_image_index]->y;
+			xx+=curzone->kids.x[current_image_index];
+			yy+=curzone->kids.y[current_image_index];
 
 			flatpoint np=transform_point(thumb_matrix,flatpoint(xx,yy));
 			np.x=x-np.x;
@@ -2429,34 +5132,21 @@ int LivWindow::WheelDown(int x,int y,unsigned int state, int count, const LaxMou
 
 	if (viewmode==VIEW_Thumbs) {
 		 //zoom out
-		flatpoint op=transform_point_inverse(thumb_matrix,flatpoint(x,y));
-		for (int c=0; c<6; c++) thumb_matrix[c]*=.85;
-		flatpoint np=transform_point(thumb_matrix,op);
-		np=flatpoint(x,y)-np;
-		thumb_matrix[4]+=np.x;
-		thumb_matrix[5]+=np.y;
-		needtodraw=1;
+		AnimateZoom(flatpoint(x,y), .85);
 		return 0;
 	}
 
 	return 0;
 }
 
-//! For the thumb view, return the zone and index in the zone of the image at screen position x,y, or -1 if not over any image.
-ImageSet *LivWindow::findImageAtCoord(int x,int y, int *index_in_parent)
+//! For the thumb view, return the image and index in curzone of the image at screen position x,y, or -1 if not over any image.
+ImageFile *LivWindow::findImageAtCoord(int x,int y, int *index_in_parent)
 {
 	flatpoint p = transform_point_inverse(thumb_matrix, flatpoint(x,y));
 
-	for (int c=0; c<curzone->kids.n; c++) {
-		if (curzone->kids.e[c]->width<=0) continue;
-		if (p.x>=curzone->kids.e[c]->x
-			&& p.x <  curzone->kids.e[c]->x+curzone->kids.e[c]->width
-			&& p.y >= curzone->kids.e[c]->y
-			&& p.y <  curzone->kids.e[c]->y+curzone->kids.e[c]->height) {
-		  *index_in_parent = c;
-		  return curzone->kids.e[c];
-		}
-	}
+	int c = curzone->kids.pointindex(p.x,p.y);
+	*index_in_parent = c;
+	if (c >= 0) return curzone->kids.image[c];
 
 	// *** if adjacent areas on screen, try those
 	return NULL;
@@ -2492,14 +5182,15 @@ int LivWindow::MouseMove(int x,int y,unsigned int state, const LaxMouse *d)
 		DBG cerr << "hover_image: "<<hover_image<<endl;
 
 		if (old != hover_image && hover_image >= 0) {
-			makestr(hover_text,curzone->kids.e[hover_image]->image->filename);
+			ThumbList &kids = curzone->kids;
+			makestr(hover_text,kids.image[hover_image]->filename);
 			double w,h, xo=0,yo=0;
 			flatpoint p=transform_point(thumb_matrix,
-										flatpoint(curzone->kids.e[hover_image]->x+curzone->kids.e[hover_image]->width/2,
-										curzone->kids.e[hover_image]->y+curzone->kids.e[hover_image]->height));
+										flatpoint(kids.x[hover_image]+kids.width[hover_image]/2,
+										kids.y[hover_image]+kids.height[hover_image]));
 
-			DBG double tw=norm(transform_vector(thumb_matrix, flatpoint(curzone->kids.e[hover_image]->width,0)));
-			DBG double th=norm(transform_vector(thumb_matrix, flatpoint(0,curzone->kids.e[hover_image]->height)));
+			DBG double tw=norm(transform_vector(thumb_matrix, flatpoint(kids.width[hover_image],0)));
+			DBG double th=norm(transform_vector(thumb_matrix, flatpoint(0,kids.height[hover_image])));
 			DBG cerr <<"------- mouse in "<<hover_image<<",  w,h:"<<tw<<','<<th<<endl;
 
 			dp->textextent(hover_text,-1, &w,&h);
@@ -2518,13 +5209,12 @@ int LivWindow::MouseMove(int x,int y,unsigned int state, const LaxMouse *d)
 			hover_area.miny=yo;
 			hover_area.maxx=xo+w;
 			hover_area.maxy=yo+h;
-
-			needtodraw=1;
 		}
+		if (old != hover_image) needtooverlay=1;
 	}
 
 	if (!buttondown.any(0) || !current) {
-		if (oldaction!=currentactionbox) needtodraw=1;
+		if (oldaction!=currentactionbox) needtooverlay=1;
 		return 0;
 	}
 
@@ -2544,7 +5234,7 @@ int LivWindow::MouseMove(int x,int y,unsigned int state, const LaxMouse *d)
 
 	 //2 mouse movements
 	double *m;
-	if (viewmode==VIEW_Normal) m=current->image->matrix;
+	if (viewmode==VIEW_Normal) m=current->matrix;
 	else if (viewmode==VIEW_Thumbs) m=thumb_matrix;
 
 	if (buttondown.isdown(0,LEFTBUTTON)>1 && device1>0 && device2>0 && (d->id==device1 || d->id==device2)) {
@@ -2569,6 +5259,10 @@ int LivWindow::MouseMove(int x,int y,unsigned int state, const LaxMouse *d)
 
 		m[4]-=tp.x;
 		m[5]-=tp.y;
+		if (viewmode==VIEW_Normal) {
+			current->zoommode = LIVZOOM_As_Is;
+			Interacting();
+		}
 
 		needtodraw=1;
 		return 0;
@@ -2579,10 +5273,16 @@ int LivWindow::MouseMove(int x,int y,unsigned int state, const LaxMouse *d)
 		DBG cerr <<"----move LEFTBUTTON for "<<d->id<<endl;
 		int mx,my;
 		buttondown.getlast(d->id,LEFTBUTTON, &mx,&my);
-		m[4] += x-mx;
-		m[5] += y-my;
+		Pan(m, x-mx, y-my);
 
-		needtodraw=1;
+		if (viewmode==VIEW_Thumbs) {
+			 //smoothed velocity, for kinetic panning after letting go
+			double now = clock_seconds(CLOCK_MONOTONIC);
+			double dt = now - drag_time;
+			if (dt > 0 && dt < .1) kinetic_v = kinetic_v*.5 + flatpoint(x-mx, y-my)*(.5/dt);
+			else kinetic_v = flatpoint();
+			drag_time = now;
+		}
 		return 0;
 
 	 //single middle
@@ -2607,19 +5307,19 @@ int LivWindow::MouseMove(int x,int y,unsigned int state, const LaxMouse *d)
 int LivWindow::toobig()
 {
 	flatpoint p1,p2;
-	p1=transform_point(current->image->matrix,current->width,current->height);
-	p2=transform_point(current->image->matrix,0,0);
+	p1=transform_point(current->matrix,current->width,current->height);
+	p2=transform_point(current->matrix,0,0);
 	return (p1-p2)*(p1-p2)>9*(win_h*win_h+win_w*win_w);
 }
 
 //! Zoom current image with screen point center staying at the same place.
 void LivWindow::Zoom(flatpoint center,double s)
 {
-	if (!current || !(current->image->state&FILE_Has_image)) return;
-	flatpoint p=transform_point_inverse(current->image->matrix,center);
+	if (!current || !current->Has(FILE_Has_image)) return;
+	flatpoint p=transform_point_inverse(current->matrix,center);
 
-	flatpoint x(current->image->matrix[0],current->image->matrix[1]),
-			  y(current->image->matrix[2],current->image->matrix[3]);
+	flatpoint x(current->matrix[0],current->matrix[1]),
+			  y(current->matrix[2],current->matrix[3]);
 
 	 //**** screwy zoom bounds checking
 	if (s>1 && norm(x)>4 && toobig()) return;//***need limits for image scale size, rather than mag!!!
@@ -2627,15 +5327,17 @@ void LivWindow::Zoom(flatpoint center,double s)
 
 	x*=s;
 	y*=s;
-	current->image->matrix[0]=x.x;
-	current->image->matrix[1]=x.y;
-	current->image->matrix[2]=y.x;
-	current->image->matrix[3]=y.y;
+	current->matrix[0]=x.x;
+	current->matrix[1]=x.y;
+	current->matrix[2]=y.x;
+	current->matrix[3]=y.y;
 
-	flatpoint o=center-transform_point(current->image->matrix,p);
-	current->image->matrix[4]+=o.x;
-	current->image->matrix[5]+=o.y;
+	flatpoint o=center-transform_point(current->matrix,p);
+	current->matrix[4]+=o.x;
+	current->matrix[5]+=o.y;
+	current->zoommode = LIVZOOM_As_Is;
 
+	Interacting();
 	needtodraw=1;
 }
 
@@ -2724,12 +5426,12 @@ int LivWindow::PerformAction(int action)
 	if (action==LIVA_None) return 0;
 
 	if (action==LIVA_Next) {
-		SelectImage((current_image_index+1)%curzone->kids.n);
+		Navigate((current_image_index+1)%curzone->kids.n);
 		needtodraw=1;
 		return 0;
 
 	} else if (action==LIVA_Previous) {
-		SelectImage((current_image_index+curzone->kids.n-1)%curzone->kids.n);
+		Navigate((current_image_index+curzone->kids.n-1)%curzone->kids.n);
 		needtodraw=1;
 		return 0;
 
@@ -2769,20 +5471,21 @@ int LivWindow::PerformAction(int action)
 		 //scale 1:1 around center of screen
 		if (!current) return 0;
 
-		flatpoint p=transform_point_inverse(current->image->matrix,flatpoint(win_w/2,win_h/2));
+		flatpoint p=transform_point_inverse(current->matrix,flatpoint(win_w/2,win_h/2));
 
-		flatpoint x(current->image->matrix[0],current->image->matrix[1]),
-				  y(current->image->matrix[2],current->image->matrix[3]);
+		flatpoint x(current->matrix[0],current->matrix[1]),
+				  y(current->matrix[2],current->matrix[3]);
 		x/=norm(x);
 		y/=norm(y);
-		current->image->matrix[0]=x.x;
-		current->image->matrix[1]=x.y;
-		current->image->matrix[2]=y.x;
-		current->image->matrix[3]=y.y;
+		current->matrix[0]=x.x;
+		current->matrix[1]=x.y;
+		current->matrix[2]=y.x;
+		current->matrix[3]=y.y;
 
-		flatpoint o=flatpoint(win_w/2,win_h/2)-transform_point(current->image->matrix,p);
-		current->image->matrix[4]+=o.x;
-		current->image->matrix[5]+=o.y;
+		flatpoint o=flatpoint(win_w/2,win_h/2)-transform_point(current->matrix,p);
+		current->matrix[4]+=o.x;
+		current->matrix[5]+=o.y;
+		current->zoommode = LIVZOOM_One_To_One;
 
 		needtodraw=1;
 		return 0;
@@ -2790,7 +5493,10 @@ int LivWindow::PerformAction(int action)
 	} else if (action==LIVA_Fit_To_Screen || action==LIVA_Center) {
 		if (!current || !current->width) return 0;
 
-		if (action==LIVA_Fit_To_Screen) ScaleToFit(current->image);
+		if (action==LIVA_Fit_To_Screen) {
+			ScaleToFit(current);
+			current->zoommode = LIVZOOM_Scale_To_Screen;
+		}
 
 		double W,H;
 		if (screen_rotation==0 || screen_rotation==180) {
@@ -2801,12 +5507,14 @@ int LivWindow::PerformAction(int action)
 			H=win_w;
 		}
 
-		flatpoint pt = transform_point(current->image->matrix, current->image->width/2,current->image->height/2);
+		flatpoint pt = transform_point(current->matrix, current->width/2,current->height/2);
 		flatpoint o = flatpoint(W/2,H/2);
 		o -= pt;
-		current->image->matrix[4] += o.x;
-		current->image->matrix[5] += o.y;
-		current->image->state |= FILE_Has_matrix;
+		current->matrix[4] += o.x;
+		current->matrix[5] += o.y;
+		current->SetState(FILE_Has_matrix);
+		current->viewwidth  = W;
+		current->viewheight = H;
 
 		needtodraw=1;
 		return 0;
@@ -2833,7 +5541,7 @@ int LivWindow::PerformAction(int action)
 									     |LINEEDIT_DESTROY_ON_ENTER|LINEEDIT_GRAB_ON_MAP,
 									   x+15,y, 20*app->defaultlaxfont->textheight(),1.5*app->defaultlaxfont->textheight(), 5,
 									   NULL,object_id,"retag",
-									   current->image->GetTag(currentactionbox->index)));
+									   current->GetTag(currentactionbox->index)));
 		return 0;
 
 	} else if (action==LIVA_Select) { //toggle selection of current
@@ -2842,10 +5550,10 @@ int LivWindow::PerformAction(int action)
 
 		if (viewmode==VIEW_Normal) {
 			if (!current) return 0;
-			img = current->image;
+			img = current;
 		} else if (viewmode==VIEW_Thumbs) {
 			if (hover_image<0 || hover_image>=curzone->kids.n) return 0;
-			img = curzone->kids.e[hover_image]->image;
+			img = curzone->kids.image[hover_image];
 		} else return 0;
 
 		i = selection->FindIndex(img);
@@ -2853,10 +5561,10 @@ int LivWindow::PerformAction(int action)
 		if (i>=0) {
 			 //was already selected, so remove from selection
 			selection->kids.remove(i);
-			current->image->mark &= ~currentmark;
+			img->mark &= ~currentmark;
 		} else {
 			selection->Add(img);
-			current->image->mark |= currentmark;
+			img->mark |= currentmark;
 		}
 
 		PositionSelectionBoxes();
@@ -2883,19 +5591,19 @@ int LivWindow::PerformAction(int action)
 
 	} else if (action==LIVA_RotateImage || action==LIVA_RotateImageR) {
 		if (viewmode==VIEW_Normal) {
-			flatpoint o=transform_point(current->image->matrix,current->width/2,current->height/2);
-			flatpoint x(current->image->matrix[0],current->image->matrix[1]);
-			flatpoint y(current->image->matrix[2],current->image->matrix[3]);
+			flatpoint o=transform_point(current->matrix,current->width/2,current->height/2);
+			flatpoint x(current->matrix[0],current->matrix[1]);
+			flatpoint y(current->matrix[2],current->matrix[3]);
 			x=rotate(x,action==LIVA_RotateImage?90:-90,1);
 			y=rotate(y,action==LIVA_RotateImage?90:-90,1);
-			current->image->matrix[0]=x.x;
-			current->image->matrix[1]=x.y;
-			current->image->matrix[2]=y.x;
-			current->image->matrix[3]=y.y;
-
-			flatpoint o2=transform_point(current->image->matrix,current->width/2,current->height/2)-o;
-			current->image->matrix[4]-=o2.x;
-			current->image->matrix[5]-=o2.y;
+			current->matrix[0]=x.x;
+			current->matrix[1]=x.y;
+			current->matrix[2]=y.x;
+			current->matrix[3]=y.y;
+
+			flatpoint o2=transform_point(current->matrix,current->width/2,current->height/2)-o;
+			current->matrix[4]-=o2.x;
+			current->matrix[5]-=o2.y;
 			needtodraw=1;
 		}
 
@@ -2903,17 +5611,17 @@ int LivWindow::PerformAction(int action)
 
 	} else if (action==LIVA_ToggleMeta) {
 		if (!current) return 0;
-		if (!(current->image && current->image->meta)) showmeta=1; else showmeta=!showmeta;
+		if (!current->meta) showmeta=1; else showmeta=!showmeta;
 
-		if (!current->image->meta) current->image->fillinfo(FILE_Has_exif);
-		needtodraw=1;
+		if (!current->meta) current->fillinfo(FILE_Has_exif);
+		needtooverlay=1;
 		return 0;
 
 	} else if (action==LIVA_ToggleInfo) {
 		showbasics<<=1;
 		showbasics|=1;
 		if (showbasics>=SHOW_MAX) showbasics=0;
-		needtodraw=1;
+		needtooverlay=1;
 		return 0;
 
 	} else if (action==LIVA_ZoomIn) {
@@ -2986,8 +5694,8 @@ int LivWindow::PerformAction(int action)
 		files.flush();
 		collection->kids.flush();
 		for (int c=0; c<selection->kids.n; c++) {
-			files.push(selection->kids.e[c]->image);
-			collection->Add(selection->kids.e[c]);
+			files.push(selection->kids.image[c]);
+			collection->Add(selection->kids.image[c]);
 		}
 		selection->kids.flush();
 		SelectImage(0);
@@ -3046,7 +5754,7 @@ int LivWindow::PerformAction(int action)
 		 //toggle verbosity
 		verbose=!verbose;
 		DBG cerr <<"verbose: "<<verbose<<endl;
-		needtodraw=1;
+		needtooverlay=1;
 		return 0;
 
 	} else if (action==LIVA_Help) {
@@ -3112,7 +5820,7 @@ int LivWindow::CharInput(unsigned int ch, const char *buffer,int len,unsigned in
 	if (ch==LAX_Esc) {
 		if (menuactions.n) ToggleMenu();
 		currentactionbox=NULL;
-		needtodraw=1;
+		needtooverlay=1;
 		return 0;
 
 	} //end any mode keys
@@ -3188,23 +5896,71 @@ void LivWindow::ScaleToFit(ImageFile *img)
 	img->matrix[3]/=s;
 }
 
+/*! Make the current image's zoom valid for the current window.
+ * Other images are resolved lazily by ResolveZoom() when they are shown, so this
+ * does not depend on how many files are loaded.
+ */
 void LivWindow::SetZoom()
 {
-	if (!curzone) return;
-	for (int c=0; c<curzone->kids.n; c++) {
-		setzoom(curzone->kids.e[c]);
+	if (current && current->Has(FILE_Has_matrix)) ResolveZoom(current);
+}
+
+//! Make sure img->matrix is valid for the current window size and screen rotation.
+/*! Each image's matrix is stored along with the window size it was resolved against, and
+ * its zoom mode. Only when the image is actually shown and that size differs do we redo it.
+ * Images still in a fit to screen mode are refit. Images zoomed or panned by hand keep
+ * their scale, and are shifted to keep the same image point at the same relative spot.
+ */
+void LivWindow::ResolveZoom(ImageFile *img)
+{
+	if (!img) return;
+
+	double W,H;
+	if (screen_rotation==0 || screen_rotation==180) {
+		W=win_w;
+		H=win_h;
+	} else {
+		W=win_h;
+		H=win_w;
+	}
+
+	if (!img->Has(FILE_Has_matrix)) {
+		 //first time shown
+		img->zoommode = zoommode;
+		setzoom(img);
+		if (img->zoommode != LIVZOOM_Scale_To_Screen && img->zoommode != LIVZOOM_Shrink_To_Screen)
+			img->SetState(FILE_Has_matrix);
+		if (img->Has(FILE_Has_matrix)) {
+			img->viewwidth  = W;
+			img->viewheight = H;
+		}
+		return;
 	}
+
+	if (img->viewwidth == W && img->viewheight == H) return;
+
+	if (img->zoommode == LIVZOOM_Scale_To_Screen || img->zoommode == LIVZOOM_Shrink_To_Screen) {
+		setzoom(img);
+
+	} else {
+		img->matrix[4] += (W - img->viewwidth )/2;
+		img->matrix[5] += (H - img->viewheight)/2;
+	}
+
+	img->viewwidth  = W;
+	img->viewheight = H;
 }
 
-//! Set the zoom on this particular images if necessary. Loads the image.
-void LivWindow::setzoom(ImageSet *which)
+//! Set the zoom on this particular image according to which->zoommode, if necessary. Loads the image.
+void LivWindow::setzoom(ImageFile *which)
 {
-	if (zoommode==LIVZOOM_Scale_To_Screen || zoommode==LIVZOOM_Shrink_To_Screen) {
-		if (!which) which=curzone;
+	if (!which) which=current;
+	if (!which) return;
 
-		if (!which->image->image) which->image->fillinfo(FILE_Has_image);
-		if (which->image->filetype != FILE_Is_Image) return; //can't do it!
-		if (which->image->width == 0 || which->image->height == 0) return; //just in case
+	if (which->zoommode==LIVZOOM_Scale_To_Screen || which->zoommode==LIVZOOM_Shrink_To_Screen) {
+		if (!which->image) which->fillinfo(FILE_Has_image);
+		if (which->filetype != FILE_Is_Image) return; //can't do it!
+		if (which->width == 0 || which->height == 0) return; //just in case
 
 		 //zoom to fit in window always and center
 		double W,H;
@@ -3217,16 +5973,14 @@ void LivWindow::setzoom(ImageSet *which)
 		}
 
 		 //zoommode shrink to screen: fit in window if bigger, and center
-		if (!(zoommode == LIVZOOM_Shrink_To_Screen && which->image->width<W && which->image->height<H))
-			ScaleToFit(which->image);
+		if (!(which->zoommode == LIVZOOM_Shrink_To_Screen && which->width<W && which->height<H))
+			ScaleToFit(which);
 
-		flatpoint o = flatpoint(W/2,H/2) - transform_point(which->image->matrix,which->image->width/2,which->image->height/2);
-		which->image->matrix[4]+=o.x;
-		which->image->matrix[5]+=o.y;
+		flatpoint o = flatpoint(W/2,H/2) - transform_point(which->matrix,which->width/2,which->height/2);
+		which->matrix[4]+=o.x;
+		which->matrix[5]+=o.y;
 
-		current->image->state |= FILE_Has_matrix;
-
-		//if (which->kids.n) setzoom(which->kids.e[c]);
+		which->SetState(FILE_Has_matrix);
 	}
 }
 
@@ -3272,12 +6026,13 @@ int LivWindow::SelectImage(int i)
 //		imlib_free_image(current->image);
 //	}
 	while (1) {
-		current=curzone->kids.e[i];
-		if (!current->image->image) current->image->fillinfo(FILE_Has_image);
-		if (current->image->image || !(livflags & LIV_Autoremove)) break;
+		current=curzone->kids.image[i];
+		if (!current->image) WaitForPrefetch(current);
+		if (!current->image) current->fillinfo(FILE_Has_image);
+		if (current->image || !(livflags & LIV_Autoremove)) break;
 
 		 //Automatically remove any files that are not readable images
-		DBG cerr <<"removing "<<current->image->filename<<" from list"<<endl;
+		DBG cerr <<"removing "<<current->filename<<" from list"<<endl;
 		RemoveFile(i);
 
 		if (i==curzone->kids.n || direction<0) i--;
@@ -3292,20 +6047,128 @@ int LivWindow::SelectImage(int i)
 		}
 	}
 	current_image_index=i;
+	scrubbing=0;
 
 	 //change window name
-	char newname[10+strlen(current->image->filename)];
-	sprintf(newname,"%s (Liv)",current->image->filename);
+	char newname[10+strlen(current->filename)];
+	sprintf(newname,"%s (Liv)",current->filename);
 	WindowTitle(newname);
 
 	PositionSelectionBoxes();
 	PositionTagBoxes();
 
-	if (!(current->image->state&FILE_Has_exif)) current->image->fillinfo(FILE_Has_exif);
+	 //exif comes in the background, see ExifTask
+	if (!current->Has(FILE_Has_exif) && !current->meta && !isblank(exif_exec)) {
+		ExifTask *task = new ExifTask(current);
+		scheduler->Submit(task, TASK_Metadata, false);
+		task->dec_count();
+	}
+
+	Prefetch(i);
 
 	return 0;
 }
 
+/*! Go to image i for Next or Previous. If these come faster than LIV_KEY_REPEAT_MS apart,
+ * as from a held key, only flip through previews with ScrubTo(), otherwise SelectImage().
+ *
+ * last_nav is taken once SelectImage() returns, so that a slow decode does not count as
+ * time between keys. Repeats queued up meanwhile then arrive right away and start scrubbing.
+ */
+int LivWindow::Navigate(int i)
+{
+	double now = clock_seconds(CLOCK_MONOTONIC);
+	bool repeating = (now - last_nav < LIV_KEY_REPEAT_MS/1000.);
+
+	if (repeating || scrubbing) {
+		last_nav = now;
+		ScrubTo(i);
+		return 0;
+	}
+
+	int status = SelectImage(i);
+	last_nav = clock_seconds(CLOCK_MONOTONIC);
+	return status;
+}
+
+/*! Make image i current without loading it, so that RefreshNormal() shows just its preview.
+ * Decoding of anything passed is cancelled. Once Navigate() has not been called for
+ * LIV_SCRUB_SETTLE_MS, Idle() does a real SelectImage() on wherever this ended up.
+ */
+void LivWindow::ScrubTo(int i)
+{
+	if (curzone->kids.n==0) return;
+	if (i>=curzone->kids.n) i=0;
+	if (i<0) i=curzone->kids.n-1;
+
+	current=curzone->kids.image[i];
+	current_image_index=i;
+	scrubbing=1;
+	CancelPrefetch();
+
+	char newname[10+strlen(current->filename)];
+	sprintf(newname,"%s (Liv)",current->filename);
+	WindowTitle(newname);
+
+	PositionSelectionBoxes();
+	PositionTagBoxes();
+
+	if (!scrub_timer) scrub_timer = app->addtimer(this, LIV_SCRUB_SETTLE_MS, LIV_SCRUB_SETTLE_MS/2, -1);
+	needtodraw=1;
+}
+
+/*! Start decoding the images on either side of index i in curzone, in case they are
+ * shown next. Whatever was being prefetched for a previous i is cancelled.
+ */
+void LivWindow::Prefetch(int i)
+{
+	CancelPrefetch();
+	prefetch_token = new CancelToken;
+
+	int n = curzone->kids.n;
+	if (n < 2) return;
+
+	int which[2] = { (i+1) % n, (i+n-1) % n }; //next first
+	for (int c=0; c<2; c++) {
+		if (c == 1 && which[1] == which[0]) break;
+
+		ImageFile *img = curzone->kids.image[which[c]];
+		if (!img || img->image || img->filetype == FILE_Is_Directory) continue;
+
+		ImageDecodeTask *task = new ImageDecodeTask(img, prefetch_token);
+		if (scheduler->Submit(task, TASK_Prefetch, false) == 0) prefetching[c] = task;
+		else task->dec_count();
+	}
+}
+
+//! Abandon any decoding started by Prefetch() that has not finished yet.
+void LivWindow::CancelPrefetch()
+{
+	for (int c=0; c<2; c++) {
+		if (prefetching[c]) prefetching[c]->dec_count();
+		prefetching[c] = NULL;
+	}
+	if (prefetch_token) {
+		prefetch_token->Cancel();
+		prefetch_token->dec_count();
+		prefetch_token = NULL;
+	}
+}
+
+/*! If img is being prefetched, move that to the front of the line and wait for it,
+ * rather than loading img all over again.
+ */
+void LivWindow::WaitForPrefetch(ImageFile *img)
+{
+	for (int c=0; c<2; c++) {
+		if (!prefetching[c] || prefetching[c]->fileobject != img) continue;
+
+		scheduler->Promote(prefetching[c], TASK_Interactive);
+		scheduler->Wait(prefetching[c]);
+		return;
+	}
+}
+
 //void LivWindow::PositionMenuBoxes()
 //{
 //All:
@@ -3367,7 +6230,7 @@ void LivWindow::PositionSelectionBoxes()
 	}
 
 	 //select or deselect current button
-	if (current && selection->FindIndex(current->image)>=0) sprintf(str,_("Deselect"));
+	if (current && selection->FindIndex(current)>=0) sprintf(str,_("Deselect"));
 	else sprintf(str,_("Select"));
 	dp->textextent(str,-1,&w,&h);
 	selboxes.push(new ActionBox(str,
@@ -3394,7 +6257,7 @@ void LivWindow::PositionSelectionBoxes()
 	int ww,hh;
 	double s;
 	for (int c=0; c<selection->kids.n && x>0; c++) {
-		img=selection->kids.e[c]->image;
+		img=selection->kids.image[c];
 		sprintf(str,"img %d",c);
 
 		ww=img->width;
@@ -3428,11 +6291,11 @@ void LivWindow::PositionTagBoxes()
 	int w,maxw=0;
 	int colstart=0;
 
-	for (int c=0; c<current->image->NumberOfTags(); c++) {
+	for (int c=0; c<current->NumberOfTags(); c++) {
 		//ActionBox(const char *t, int a, int isabsdims, double x1, double x2, double y1, double y2);
-		w=textheight + dp->textextent(current->image->GetTag(c),-1,NULL,NULL);
+		w=textheight + dp->textextent(current->GetTag(c),-1,NULL,NULL);
 		if (w>maxw) maxw=w;
-		tagboxes.push(new ActionBox(current->image->GetTag(c),
+		tagboxes.push(new ActionBox(current->GetTag(c),
 									LIVA_EditTag,c,
 									1,
 									x,x+w,
@@ -3460,10 +6323,17 @@ void LivWindow::PositionTagBoxes()
 
 typedef int (*SortFunc)(const void *, const void *);
 
+//! Sort element, so the ThumbList can be reordered after sorting.
+struct ThumbSortItem
+{
+	ImageFile *image;
+	int index; //original index in the ThumbList
+};
+
 int dateCompare(const void *v1, const void *v2)
 {
-	ImageFile const *img1=(*static_cast<ImageSet*const*>(v1))->image;
-	ImageFile const *img2=(*static_cast<ImageSet*const*>(v2))->image;
+	ImageFile const *img1=static_cast<const ThumbSortItem*>(v1)->image;
+	ImageFile const *img2=static_cast<const ThumbSortItem*>(v2)->image;
 
 	if (img1->fileinfo.st_mtime==img2->fileinfo.st_mtime) return 0;
 	if (img1->fileinfo.st_mtime <img2->fileinfo.st_mtime) return -1;
@@ -3472,16 +6342,16 @@ int dateCompare(const void *v1, const void *v2)
 
 int nameCompare(const void *v1, const void *v2)
 {
-	ImageFile const *img1=(*static_cast<ImageSet*const*>(v1))->image;
-	ImageFile const *img2=(*static_cast<ImageSet*const*>(v2))->image;
+	ImageFile const *img1=static_cast<const ThumbSortItem*>(v1)->image;
+	ImageFile const *img2=static_cast<const ThumbSortItem*>(v2)->image;
 
 	return strcmp(img1->filename,img2->filename);
 }
 
 int sizeCompare(const void *v1, const void *v2)
 {
-	ImageFile const *img1=(*static_cast<ImageSet*const*>(v1))->image;
-	ImageFile const *img2=(*static_cast<ImageSet*const*>(v2))->image;
+	ImageFile const *img1=static_cast<const ThumbSortItem*>(v1)->image;
+	ImageFile const *img2=static_cast<const ThumbSortItem*>(v2)->image;
 
 	if (img1->fileinfo.st_size==img2->fileinfo.st_size) return 0;
 	if (img1->fileinfo.st_size <img2->fileinfo.st_size) return -1;
@@ -3490,8 +6360,8 @@ int sizeCompare(const void *v1, const void *v2)
 
 int pixelsCompare(const void *v1, const void *v2)
 {
-	ImageFile const *img1=(*static_cast<ImageSet*const*>(v1))->image;
-	ImageFile const *img2=(*static_cast<ImageSet*const*>(v2))->image;
+	ImageFile const *img1=static_cast<const ThumbSortItem*>(v1)->image;
+	ImageFile const *img2=static_cast<const ThumbSortItem*>(v2)->image;
 
 	int a1 = img1->width*img1->height;
 	int a2 = img2->width*img2->height;
@@ -3502,8 +6372,8 @@ int pixelsCompare(const void *v1, const void *v2)
 
 int widthCompare(const void *v1, const void *v2)
 {
-	ImageFile const *img1=(*static_cast<ImageSet*const*>(v1))->image;
-	ImageFile const *img2=(*static_cast<ImageSet*const*>(v2))->image;
+	ImageFile const *img1=static_cast<const ThumbSortItem*>(v1)->image;
+	ImageFile const *img2=static_cast<const ThumbSortItem*>(v2)->image;
 
 	if (img1->width==img2->width) return 0;
 	if (img1->width <img2->width) return -1;
@@ -3512,8 +6382,8 @@ int widthCompare(const void *v1, const void *v2)
 
 int heightCompare(const void *v1, const void *v2)
 {
-	ImageFile const *img1 = (*static_cast<ImageSet*const*>(v1))->image;
-	ImageFile const *img2 = (*static_cast<ImageSet*const*>(v2))->image;
+	ImageFile const *img1 = static_cast<const ThumbSortItem*>(v1)->image;
+	ImageFile const *img2 = static_cast<const ThumbSortItem*>(v2)->image;
 
 	if ((img1)->height==(img2)->height) return 0;
 	if ((img1)->height <(img2)->height) return -1;
@@ -3540,11 +6410,21 @@ int LivWindow::Sort(const char *sortby)
 	for (int c=0; c<n; c++) stripws(strs[c]);
 
 
-	char *local=NULL;
-	int nn=0;
-	ImageSet **array = curzone->kids.extractArrays(&local,&nn);
+	int nn = curzone->kids.n;
+	ThumbSortItem *array = new ThumbSortItem[nn];
+	for (int c=0; c<nn; c++) {
+		array[c].image = curzone->kids.image[c];
+		array[c].index = c;
+	}
 
 	SortFunc func=NULL;
+	if (!strcasecmp(strs[0],"pixels") || !strcasecmp(strs[0],"width") || !strcasecmp(strs[0],"height")) {
+		 //make sure dimensions are known, preferably from preview headers, not decoding
+		for (int c=0; c<nn; c++) {
+			if (array[c].image) array[c].image->fillinfo(FILE_Has_image_info);
+		}
+	}
+
 	if (!strcasecmp(strs[0],"date"))        func = dateCompare;
 	else if (!strcasecmp(strs[0],"size"))   func = sizeCompare;
 	else if (!strcasecmp(strs[0],"name"))   func = nameCompare;
@@ -3553,7 +6433,7 @@ int LivWindow::Sort(const char *sortby)
 	else if (!strcasecmp(strs[0],"height")) func = heightCompare;
 	else if (!strcasecmp(strs[0],"random")) {
 		int s; //place to swap
-		ImageSet *t;
+		ThumbSortItem t;
 		for (int c=nn-1; c>0; c--) {
 			s=((double)random()/RAND_MAX)*c;
 			t=array[c];
@@ -3563,9 +6443,14 @@ int LivWindow::Sort(const char *sortby)
 		func=NULL;
 	}
 
-	if (func) qsort(static_cast<void*>(array), nn, sizeof(ImageSet*), func);
+	if (func) qsort(static_cast<void*>(array), nn, sizeof(ThumbSortItem), func);
+
+	int *order = new int[nn];
+	for (int c=0; c<nn; c++) order[c] = array[c].index;
+	curzone->kids.reorder(order);
+	delete[] order;
+	delete[] array;
 
-	curzone->kids.insertArrays(array,local,nn);
 	MapThumbs();
 	needtodraw=1;
 
@@ -3578,20 +6463,11 @@ void LivWindow::ReverseOrder()
 {
 	if (!curzone->kids.n) return;
 
-	char *local=NULL;
-	int nn=0;
-	ImageSet **array=curzone->kids.extractArrays(&local,&nn);
-
-	int s;
-	ImageSet *t;
+	int nn=curzone->kids.n;
 	for (int c=0; c<nn/2; c++) {
-		s=nn-1-c;
-		t=array[c];
-		array[c]=array[s];
-		array[s]=t;
+		curzone->kids.swap(c, nn-1-c);
 	}
 
-	curzone->kids.insertArrays(array,local,nn);
 	MapThumbs();
 	needtodraw=1;
 }
@@ -3614,9 +6490,8 @@ int LivWindow::RemoveFile(int index)
 { // ***
 	if (index<0 || index>=curzone->kids.n) return 1;
 
-	ImageSet *img = curzone->kids.pop(index);
-	tagcloud.RemoveObject(img->image);
-	img->dec_count();
+	tagcloud.RemoveObject(curzone->kids.image[index]);
+	curzone->Remove(index);
 	MapThumbs();
 
 	return 0;
@@ -14,6 +14,11 @@
 
 #include <string>
 
+#include "previewcache.h"
+#include "thumbpack.h"
+#include "scheduler.h"
+#include "pixmapcache.h"
+
 namespace Liv {
 
 //------------------------------ ActionBox ------------------------------------------
@@ -88,6 +93,23 @@ enum PreviewState {
 	PREVIEW_Loaded
 };
 
+//see ImageFile::thumbs
+enum ThumbSize {
+	THUMB_Normal,   //128, freedesktop "normal"
+	THUMB_Large,    //256, freedesktop "large"
+	THUMB_XLarge,   //512, freedesktop "x-large"
+	THUMB_XXLarge,  //1024, freedesktop "xx-large"
+	THUMB_MAX
+};
+
+extern int thumb_sizes[THUMB_MAX];
+int thumb_level_for_size(double pixels);
+char *thumb_level_file(const char *file, int level);
+char *thumb_fail_file(const char *file);
+
+//number of halvings of an image kept for drawing while zooming, see ImageFile::GetMipImage()
+#define LIV_MIP_MAX  (6)
+
 //see ImageFile::fillinfo()
 enum ImgLoadState {
 	FILE_Not_accessed        = 0,
@@ -97,7 +119,8 @@ enum ImgLoadState {
 	FILE_Has_image_info      = (1<<3),
 	FILE_Has_preview         = (1<<4),
 	FILE_Has_preview_loading = (1<<5),
-	FILE_Has_matrix          = (1<<6)
+	FILE_Has_matrix          = (1<<6),
+	FILE_Has_preview_info    = (1<<7)
 };
 
 enum LivFlags {
@@ -112,6 +135,45 @@ enum LivFlags {
 };
 
 class ImageFile;
+class ImageSet;
+
+class ThumbLevel
+{
+  public:
+	char *file;
+	Laxkit::LaxImage *image;
+	PreviewState state;
+	PreviewCacheNode cachenode; //image's place in preview_cache
+
+	ThumbLevel();
+	virtual ~ThumbLevel();
+};
+
+class ThumbList
+{
+  protected:
+	int max;
+	void grow(int newmax);
+
+  public:
+	int n;
+	ImageFile **image;       //one per kid, may be NULL for sets without an image
+	ImageSet  **set;         //non-NULL only for kids that are actual sets
+	double *x, *y;           //offset of each kid in parent's kid space
+	double *width, *height;  //dimensions of each kid in parent's kid space
+
+	ThumbList();
+	virtual ~ThumbList();
+	virtual int push(ImageFile *img, ImageSet *nset, int where=-1);
+	virtual int remove(int index);
+	virtual void flush();
+	virtual void swap(int i1, int i2);
+	virtual int reorder(const int *order);
+	virtual int findindex(ImageFile *img);
+	virtual int findindex(ImageSet *nset);
+	virtual int pointindex(double px, double py);
+	virtual int kidtype(int index);
+};
 
 class ImageSet : public Laxkit::anObject
 {
@@ -122,7 +184,7 @@ class ImageSet : public Laxkit::anObject
 	ImageFile *image;
 
 	ImageSet *parent;
-	Laxkit::RefPtrStack<ImageSet> kids;
+	ThumbList kids; //images and subsets, with bounds in *this kid space
 
 	unsigned int dump_flags;
 
@@ -156,7 +218,7 @@ class ImageSet : public Laxkit::anObject
 
 //----------------------------- class ImageFile --------------------------------------
 
-class ImageFile : public Laxkit::anObject, public Laxkit::Tagged
+class ImageFile : public SharedObject, public Laxkit::Tagged
 {
  public:
 	int filetype; //see ImgFileType
@@ -174,17 +236,31 @@ class ImageFile : public Laxkit::anObject, public Laxkit::Tagged
 	LaxFiles::Attribute *meta;
 
 	double matrix[6];  //matrix for normal view
+	int zoommode;      //how matrix was set up, see ZoomMode
+	double viewwidth, viewheight; //the (rotated) window size that matrix was resolved against
 	int width, height; //actual pixel size of the image
 
 	char *filename;
 	Laxkit::LaxImage *image;
+	Laxkit::LaxImage *fitted; //image downscaled for fit to screen, see GetFittedImage()
+	Laxkit::LaxImage *mips[LIV_MIP_MAX]; //image halved c+1 times, for quick drawing while zooming
 	struct stat fileinfo;
-	int state;    //how much of the file's info has been found
+	int state;    //ImgLoadState bits of what has been found, only change with SetState()
+	int loading;  //ImgLoadState bits some thread is finding right now, see BeginLoad()
+	unsigned int *pending_argb; //image decoded by a worker, for fillinfo() to make into image
+	int pending_w, pending_h, pending_alpha;
 
 	char *previewfile;
 	Laxkit::LaxImage *preview;
 	int pwidth, pheight; //preview pixel size
 	PreviewState preview_state;
+	PreviewCacheNode cachenode; //preview's place in preview_cache
+	int thumb_location;  //see LivFlags
+	ThumbPack *thumbpack; //for LIV_Local_Thumbs, not owned, see thumb_pack_for_file()
+	long preview_fail_mtime; //for LIV_Memory_Thumbs, st_mtime when a preview could not be made, or -1
+	ThumbLevel thumbs[THUMB_MAX]; //other preview sizes, loaded or generated on demand, see ThumbSize
+	unsigned int thumbs_to_make;  //bits of ThumbSize queued for generation, protected by tomakelist_mutex
+	unsigned int thumbs_existing; //bits of ThumbSize with a preview file, as of queueing, protected by tomakelist_mutex
 	clock_t lastviewtime;
 
 	ImageFile();
@@ -194,10 +270,29 @@ class ImageFile : public Laxkit::anObject, public Laxkit::Tagged
 	virtual const char *whattype() { return "ImageFile"; }
 
 	virtual int fillinfo(int which);
+	virtual int State() { return __atomic_load_n(&state, __ATOMIC_ACQUIRE); }
+	virtual bool Has(int bits) { return (State() & bits) == bits; }
+	virtual void SetState(int bits, bool on = true);
+	virtual bool BeginLoad(int bit, bool wait = true);
+	virtual void EndLoad(int bit, bool success);
+	virtual bool IsLoading(int bit);
+	virtual void SetPendingImage(unsigned int *argb, int w, int h, int has_alpha);
 	virtual int SetFile(const char *nfilename, int thumb_location, bool reject_nonimages);
 
 	virtual Laxkit::LaxImage *GetPreview();
+	virtual Laxkit::LaxImage *GetThumb(int level);
+	virtual const char *ThumbFile(int level);
+	virtual int FindPackedPreview(ThumbPackEntry *entry_ret = NULL);
+	virtual int LoadPackedPreview();
+	virtual int SetPreview(Laxkit::LaxImage *img);
+	virtual void StalePreview();
+	virtual bool PreviewFailed();
+	virtual void ReleasePreview(int level);
+	virtual void QueuePreview();
 	virtual Laxkit::LaxImage *GetImage();
+	virtual Laxkit::LaxImage *GetFittedImage(int w, int h);
+	virtual Laxkit::LaxImage *GetMipImage(double scale, double *fx, double *fy);
+	virtual void ReleaseScaled();
 
 
 	virtual int dec_count();
@@ -205,6 +300,24 @@ class ImageFile : public Laxkit::anObject, public Laxkit::Tagged
 
 
 
+//------------------------------ PreviewStats ----------------------------------------
+
+class PreviewStats
+{
+  public:
+	long queued;  //files queued for background preview generation
+	long made;    //files that got at least one preview
+	long failed;  //files no preview could be made for
+	long bytes;   //total size of the made and failed files
+
+	PreviewStats();
+};
+
+void get_preview_stats(PreviewStats *stats);
+void set_preview_scheduler(TaskScheduler *scheduler);
+int make_thumbnails(int numpaths, const char **paths, int thumb_location, bool recurse);
+
+
 //------------------------------ LivWindow ----------------------------------------
 
 enum LivWindowActions {
@@ -292,12 +405,21 @@ enum LivShowBasics {
 	SHOW_All        =(0xffff)
 };
 
+class ImageDecodeTask;
+
 class LivWindow : public Laxkit::anXWindow
 {
   protected:
 	Laxkit::ShortcutHandler *sc;
 	void InitializePlacements();
 
+	TaskScheduler *scheduler;     //all background work: previews, prefetching, exif
+	CancelToken *prefetch_token;  //for the prefetching around current, see Prefetch()
+	ImageDecodeTask *prefetching[2];
+	virtual void Prefetch(int i);
+	virtual void CancelPrefetch();
+	virtual void WaitForPrefetch(ImageFile *img);
+
   public:
 	Laxkit::RefPtrStack<ImageFile> files; //total list of files, can be arranged in different sets
 
@@ -314,7 +436,7 @@ class LivWindow : public Laxkit::anXWindow
 	int currentmark; //usually 1, but maybe different marks (1 per bit)
 	int viewmarked; //in thumb view and image selection, use a subset of files with this mark mask
 
-	ImageSet *current;
+	ImageFile *current;
 	int current_image_index; //index in current set
 	char *collectionfile;
 	Laxkit::TagCloud tagcloud;
@@ -359,6 +481,31 @@ class LivWindow : public Laxkit::anXWindow
 	char *hover_text;
 
 	int slideshow_timer;
+	int redraw_timer;  //for background work that came in too soon after the last draw
+	int imlib_retry_timer; //to Refresh() again when a worker had imlib_mutex, see ImlibBusy()
+	double last_drawn; //CLOCK_MONOTONIC seconds of the last draw
+	int needtooverlay; //only the overlays changed, so redraw them over base_layer, see Refresh()
+	Pixmap base_layer; //the image or thumbnails as last drawn, without any overlays
+	int base_w, base_h;
+	GC base_gc;
+	int scroll_x, scroll_y;   //pixels base_layer should move by since last drawn, from panning
+	Laxkit::DoubleBBox damage; //screen area the base is being redrawn in
+	PixmapCache *pixmap_cache; //recently drawn images, already on the server
+	int fast_render;           //the view is being zoomed, so draw cheaply until it settles
+	int quality_timer;         //for redrawing at full quality once zooming stops
+	double last_interaction;   //CLOCK_MONOTONIC seconds of the last Interacting()
+	int frame_timer;           //only runs while something animates, see Animate()
+	double last_frame;         //CLOCK_MONOTONIC seconds of the last Animate()
+	double frame_cost;         //running average of seconds Refresh() takes to draw
+	flatpoint kinetic_v;       //thumb view pan velocity in pixels per second, after letting go
+	flatpoint kinetic_rest;    //fractions of a pixel not panned yet
+	double drag_time;          //CLOCK_MONOTONIC seconds of the last drag, for measuring kinetic_v
+	double zoom_remaining;     //log of the zoom still to animate, see AnimateZoom()
+	flatpoint zoom_center;
+	double last_nav;           //CLOCK_MONOTONIC seconds of the last Navigate()
+	int scrubbing;             //key repeat is flipping through images, so only show previews, see ScrubTo()
+	int scrub_timer;           //for loading the image that scrubbing stops on
+	ImageFile *scaled_image;   //counted, the only image that may keep fitted and mip copies, see Refresh()
 	int slidedelay;//in milliseconds
 
 	Laxkit::PtrStack<ActionBox> *actions;
@@ -374,6 +521,23 @@ class LivWindow : public Laxkit::anXWindow
 	virtual void RefreshHelp();
 	virtual void RefreshNormal();
 	virtual void RefreshThumbs();
+	virtual void RefreshOverlays();
+	virtual void RefreshNormalOverlays();
+	virtual void RefreshThumbsOverlays();
+	virtual void SaveBaseLayer();
+	virtual bool RestoreBaseLayer();
+	virtual void ReleaseBaseLayer();
+	virtual bool ScrollBaseLayer(int dx, int dy);
+	virtual void RefreshBase(int x, int y, int w, int h);
+	virtual void Pan(double *m, int dx, int dy);
+	virtual bool DrawCachedImage(Laxkit::LaxImage *img, double *m);
+	virtual void Interacting();
+	virtual void ImlibBusy();
+	virtual void StartAnimating();
+	virtual void StopAnimating();
+	virtual bool Animate();
+	virtual void AnimateZoom(flatpoint center, double s);
+	virtual void ZoomThumbs(flatpoint center, double s);
 
 	virtual void DrawThumbsRecurseUp  (ImageSet *thumb, double *m);
 	virtual void DrawThumbsRecurseDown(ImageSet *thumb, double *m);
@@ -407,14 +571,17 @@ class LivWindow : public Laxkit::anXWindow
 	virtual void RotateScreen(int howmuch);
 	virtual void InitActions();
 	virtual int toobig();
-	virtual void setzoom(ImageSet *which);
+	virtual void setzoom(ImageFile *which);
 	virtual void SetZoom();
+	virtual void ResolveZoom(ImageFile *img);
 	virtual void ScaleToFit(ImageFile *img);
 	virtual void Zoom(flatpoint center,double amount);
 	virtual ActionBox *GetAction(int x,int y,unsigned int state, int *boxindex=NULL);
 	virtual ActionBox *GetAction(Laxkit::PtrStack<ActionBox> *alist, int x,int y,unsigned int state, int *boxindex);
 	virtual int SelectImage(int i);
-	virtual ImageSet *findImageAtCoord(int x,int y, int *index_in_parent);
+	virtual int Navigate(int i);
+	virtual void ScrubTo(int i);
+	virtual ImageFile *findImageAtCoord(int x,int y, int *index_in_parent);
 	virtual void PositionMiscBoxes();
 	virtual void PositionTagBoxes();
 	virtual void PositionSelectionBoxes();
@@ -0,0 +1,359 @@
+#include "pixmapcache.h"
+#include "downscale.h"
+
+#include <lax/laximages-imlib.h>
+
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+
+
+#define DBG
+using namespace std;
+using namespace Laxkit;
+
+
+namespace Liv {
+
+
+//----------------------------- PixmapCacheNode --------------------------------------
+
+/*! \class PixmapCacheNode
+ * \brief One image at one size, in a server side pixmap. See PixmapCache.
+ */
+
+PixmapCacheNode::PixmapCacheNode()
+{
+	prev = next = NULL;
+	image  = NULL;
+	width  = height = 0;
+	pixmap = 0;
+	bytes  = 0;
+}
+
+
+//----------------------------- PixmapCache --------------------------------------
+
+/*! \class PixmapCache
+ * \brief Keep a few screen scaled images on the X server, so redrawing them is a server side copy.
+ *
+ * Without this, every Displayer::imageout() of a big image sends all of its scaled pixels to
+ * the server again, which is most of the cost of flipping back and forth between two images,
+ * or of any repaint of one that has not changed. Get() scales an image once, uploads it through
+ * one reused MIT-SHM segment when the server can attach it (plain XPutImage otherwise), and keeps the pixmap in a
+ * least recently used list, keyed by image and size, within budget bytes.
+ *
+ * Only opaque images on 24 or 32 bit TrueColor visuals are kept. Anything else gets 0 from
+ * Get(), and should be drawn the usual way.
+ *
+ * Only use from the ui thread, with imlib_mutex locked, as uploading reads imlib images.
+ */
+
+PixmapCache::PixmapCache(long nbudget)
+{
+	first = last = NULL;
+	dpy     = NULL;
+	visual  = NULL;
+	gc      = NULL;
+	depth   = 0;
+	usable  = -1;
+	use_shm = false;
+	shmsize = 0;
+	shm_pending = false;
+	memset(&shminfo, 0, sizeof(shminfo));
+	budget  = nbudget;
+	used    = 0;
+	count   = 0;
+}
+
+PixmapCache::~PixmapCache()
+{
+	Flush();
+	free_shm_segment();
+	if (gc) XFreeGC(dpy, gc);
+}
+
+ //for noticing a failed XShmAttach, see shm_segment()
+static int shm_attach_failed = 0;
+
+static int trap_shm_error(Display *, XErrorEvent *)
+{
+	shm_attach_failed = 1;
+	return 0;
+}
+
+/*! Make sure there is a shared memory segment attached to the server of at least bytes.
+ * It only ever grows, so most uploads reuse it as is. If attaching fails, as it does when the
+ * server cannot see our shared memory, shm is turned off and false returned.
+ */
+bool PixmapCache::shm_segment(long bytes)
+{
+	if (shmsize >= bytes) return true;
+
+	free_shm_segment();
+	long size = 4*1024*1024;
+	while (size < bytes) size *= 2;
+
+	shminfo.shmid = shmget(IPC_PRIVATE, (size_t)size, IPC_CREAT | 0600);
+	if (shminfo.shmid < 0) {
+		use_shm = false;
+		return false;
+	}
+	shminfo.shmaddr = (char*)shmat(shminfo.shmid, NULL, 0);
+	shminfo.readOnly = False;
+	if (shminfo.shmaddr == (char*)-1) {
+		shmctl(shminfo.shmid, IPC_RMID, NULL);
+		use_shm = false;
+		return false;
+	}
+
+	 //a failed attach is an async error, which the default handler would exit on,
+	 //such as for a local server in another ipc namespace
+	XSync(dpy, False);
+	shm_attach_failed = 0;
+	XErrorHandler old = XSetErrorHandler(trap_shm_error);
+	Status attached = XShmAttach(dpy, &shminfo);
+	XSync(dpy, False);
+	XSetErrorHandler(old);
+
+	shmctl(shminfo.shmid, IPC_RMID, NULL); //goes away once both sides detach
+	if (!attached || shm_attach_failed) {
+		DBG cerr << "PixmapCache: XShmAttach failed, using XPutImage"<<endl;
+		shmdt(shminfo.shmaddr);
+		use_shm = false;
+		return false;
+	}
+
+	shmsize = size;
+	return true;
+}
+
+//! Detach and free the shared memory segment, if any.
+void PixmapCache::free_shm_segment()
+{
+	if (!shmsize) return;
+
+	XShmDetach(dpy, &shminfo);
+	XSync(dpy, False);
+	shmdt(shminfo.shmaddr);
+	shmsize = 0;
+	shm_pending = false;
+}
+
+//! Check that win's visual is one we can fill directly, and whether MIT-SHM can be used.
+bool PixmapCache::init(Display *ndpy, Window win)
+{
+	usable = 0;
+	dpy = ndpy;
+
+	XWindowAttributes atts;
+	if (!XGetWindowAttributes(dpy, win, &atts)) return false;
+	if ((atts.depth != 24 && atts.depth != 32) || atts.visual->c_class != TrueColor
+			|| atts.visual->red_mask != 0xff0000 || atts.visual->green_mask != 0xff00 || atts.visual->blue_mask != 0xff) {
+		DBG cerr << "PixmapCache: unsupported visual, not caching"<<endl;
+		return false;
+	}
+	visual = atts.visual;
+	depth  = atts.depth;
+	gc     = XCreateGC(dpy, win, 0, NULL);
+
+	 //whether the server can actually see our segments is only known once shm_segment() tries
+	use_shm = XShmQueryExtension(dpy);
+
+	DBG cerr << "PixmapCache: "<<(use_shm ? "trying MIT-SHM" : "using XPutImage")<<endl;
+	usable = 1;
+	return true;
+}
+
+/*! Return a pixmap of image scaled to w x h, making it if necessary and make is true,
+ * or 0 if image can't be cached, or isn't and make is false.
+ * The pixmap stays valid until the next Get(), Trim() or Flush().
+ */
+Pixmap PixmapCache::Get(Display *ndpy, Window win, LaxImage *image, int w, int h, bool make)
+{
+	if (!image || w < 1 || h < 1 || !ndpy || !win) return 0;
+	if (usable < 0) init(ndpy, win);
+	if (!usable) return 0;
+
+	long bytes = (long)w * h * 4;
+	if (bytes > budget/2) return 0; //mostly when zoomed way in, not worth pushing out everything else
+
+	for (PixmapCacheNode *node = first; node; node = node->next) {
+		if (node->image != image || node->width != w || node->height != h) continue;
+
+		 //make most recently used
+		if (node != last) {
+			unlink(node);
+			node->prev = last;
+			last->next = node;
+			last = node;
+			used += node->bytes;
+			count++;
+		}
+		return node->pixmap;
+	}
+	if (!make) return 0;
+
+	LaxImlibImage *limg = dynamic_cast<LaxImlibImage*>(image);
+	if (!limg || !limg->Image()) return 0;
+	imlib_context_set_image(limg->Image());
+	if (imlib_image_has_alpha()) return 0; //would need blending with what is under it
+
+	Trim(budget - bytes);
+
+	Pixmap pixmap = XCreatePixmap(dpy, win, w,h, depth);
+	if (!upload(image, w,h, pixmap)) {
+		XFreePixmap(dpy, pixmap);
+		return 0;
+	}
+
+	PixmapCacheNode *node = new PixmapCacheNode;
+	node->image  = image;
+	image->inc_count();
+	node->width  = w;
+	node->height = h;
+	node->pixmap = pixmap;
+	node->bytes  = bytes;
+	node->prev   = last;
+	if (last) last->next = node; else first = node;
+	last = node;
+	used += bytes;
+	count++;
+
+	return pixmap;
+}
+
+/*! Scale image to w x h straight into an XImage, and put that in pixmap.
+ * Return whether it worked.
+ */
+bool PixmapCache::upload(LaxImage *image, int w, int h, Pixmap pixmap)
+{
+	LaxImlibImage *limg = dynamic_cast<LaxImlibImage*>(image);
+	imlib_context_set_image(limg->Image());
+	int sw = imlib_image_get_width();
+	int sh = imlib_image_get_height();
+
+	XImage *ximage = NULL;
+	bool shm = false;
+
+	if (use_shm) {
+		ximage = XShmCreateImage(dpy, visual, depth, ZPixmap, NULL, &shminfo, w,h);
+		if (ximage) {
+			shm = shm_segment((long)ximage->bytes_per_line * h);
+			if (shm) {
+				 //the server must be done reading the last upload before we write over it
+				if (shm_pending) XSync(dpy, False);
+				shm_pending = false;
+				ximage->data = shminfo.shmaddr;
+			} else {
+				XDestroyImage(ximage);
+				ximage = NULL;
+			}
+		}
+	}
+
+	if (!ximage) {
+		ximage = XCreateImage(dpy, visual, depth, ZPixmap, 0, NULL, w,h, 32, 0);
+		if (!ximage) return false;
+		ximage->data = (char*)malloc((size_t)ximage->bytes_per_line * h);
+		if (!ximage->data) {
+			XDestroyImage(ximage);
+			return false;
+		}
+	}
+
+	bool ok = (ximage->bits_per_pixel == 32);
+	if (ok) {
+		unsigned int *dst = (unsigned int*)ximage->data;
+		int stride = ximage->bytes_per_line / 4;
+		const DATA32 *src = imlib_image_get_data_for_reading_only();
+
+		if (w == sw && h == sh) {
+			for (int y=0; y<h; y++) memcpy(dst + y*stride, src + y*sw, w*4);
+
+		} else if (w <= sw && h <= sh) {
+			downscale_argb(src, sw,sh,sw, dst, w,h,stride);
+
+		} else {
+			imlib_context_set_anti_alias(1);
+			Imlib_Image scaled = imlib_create_cropped_scaled_image(0,0, sw,sh, w,h);
+			if (scaled) {
+				imlib_context_set_image(scaled);
+				src = imlib_image_get_data_for_reading_only();
+				for (int y=0; y<h; y++) memcpy(dst + y*stride, src + y*w, w*4);
+				imlib_free_image();
+			} else ok = false;
+		}
+	}
+
+	if (ok) {
+		if (shm) {
+			XShmPutImage(dpy, pixmap, gc, ximage, 0,0, 0,0, w,h, False);
+			shm_pending = true;
+		} else XPutImage(dpy, pixmap, gc, ximage, 0,0, 0,0, w,h);
+	}
+
+	if (shm) ximage->data = NULL; //the segment stays for the next upload
+	XDestroyImage(ximage);
+
+	return ok;
+}
+
+//! Take node out of the list, without freeing anything.
+void PixmapCache::unlink(PixmapCacheNode *node)
+{
+	if (node->prev) node->prev->next = node->next; else first = node->next;
+	if (node->next) node->next->prev = node->prev; else last  = node->prev;
+	node->prev = node->next = NULL;
+	used -= node->bytes;
+	count--;
+}
+
+void PixmapCache::release(PixmapCacheNode *node)
+{
+	XFreePixmap(dpy, node->pixmap);
+	node->image->dec_count();
+	delete node;
+}
+
+//! Free the least recently used pixmaps until at most keep bytes are used. Returns the number freed.
+int PixmapCache::Trim(long keep)
+{
+	int n = 0;
+	while (first && used > keep) {
+		PixmapCacheNode *node = first;
+		unlink(node);
+		release(node);
+		n++;
+	}
+	return n;
+}
+
+/*! Free any pixmaps of image, for when it is about to go away, so that the cache
+ * does not keep it alive outside of whatever budget it was under. Returns the number freed.
+ */
+int PixmapCache::Forget(LaxImage *image)
+{
+	int n = 0;
+	PixmapCacheNode *node = first, *next;
+	for ( ; node; node = next) {
+		next = node->next;
+		if (node->image != image) continue;
+		unlink(node);
+		release(node);
+		n++;
+	}
+	return n;
+}
+
+//! Free all pixmaps.
+void PixmapCache::Flush()
+{
+	Trim(0);
+}
+
+
+} //namespace Liv
@@ -0,0 +1,67 @@
+#ifndef LIV_PIXMAPCACHE_H
+#define LIV_PIXMAPCACHE_H
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <lax/laximages.h>
+
+
+namespace Liv {
+
+
+//----------------------------- PixmapCacheNode --------------------------------------
+
+class PixmapCacheNode
+{
+  public:
+	PixmapCacheNode *prev, *next;
+	Laxkit::LaxImage *image; //counted, so the key stays valid while cached
+	int width, height;       //size image was scaled to
+	Pixmap pixmap;
+	long bytes;
+
+	PixmapCacheNode();
+};
+
+
+//----------------------------- PixmapCache --------------------------------------
+
+class PixmapCache
+{
+  protected:
+	PixmapCacheNode *first, *last; //first is least recently used
+	Display *dpy;
+	Visual *visual;
+	GC gc;
+	int depth;
+	int usable; //-1 not checked yet, 0 no, 1 yes
+	bool use_shm;
+	XShmSegmentInfo shminfo; //one segment for all uploads, see shm_segment()
+	long shmsize;            //bytes of it, 0 for none
+	bool shm_pending;        //the server may still be reading the segment
+
+	virtual bool init(Display *ndpy, Window win);
+	virtual bool shm_segment(long bytes);
+	virtual void free_shm_segment();
+	virtual bool upload(Laxkit::LaxImage *image, int w, int h, Pixmap pixmap);
+	virtual void unlink(PixmapCacheNode *node);
+	virtual void release(PixmapCacheNode *node);
+
+  public:
+	long budget; //in bytes of server memory
+	long used;
+	int count;
+
+	PixmapCache(long nbudget);
+	virtual ~PixmapCache();
+	virtual Pixmap Get(Display *ndpy, Window win, Laxkit::LaxImage *image, int w, int h, bool make = true);
+	virtual void Flush();
+	virtual int Trim(long keep);
+	virtual int Forget(Laxkit::LaxImage *image);
+};
+
+
+} //namespace Liv
+
+#endif
+
@@ -0,0 +1,337 @@
+#include "pnginfo.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <png.h>
+#include <zlib.h>
+#include <cstring>
+#include <cstdlib>
+
+
+namespace Liv {
+
+
+//! Max bytes of any one tEXt chunk that we bother reading.
+#define PNGINFO_MAX_TEXT  4096
+
+
+//----------------------------- PngInfo --------------------------------------
+
+/*! \class PngInfo
+ * \brief Read dimensions and thumbnail metadata from a png without decoding it.
+ *
+ * Only the chunks before the first IDAT are read. That is where IHDR lives, and where
+ * freedesktop thumbnailers put their tEXt chunks: Thumb::URI, Thumb::MTime, Thumb::Size,
+ * Thumb::Image::Width, and Thumb::Image::Height. Pixel data is never touched, so this
+ * is one open and a couple hundred bytes of reading per file.
+ */
+
+PngInfo::PngInfo()
+{
+	uri = NULL;
+	fast_write = true;
+	Clear();
+}
+
+PngInfo::~PngInfo()
+{
+	delete[] uri;
+}
+
+//! Reset everything to unknown.
+void PngInfo::Clear()
+{
+	width = height = 0;
+	orig_width = orig_height = -1;
+	orig_mtime = -1;
+	orig_size  = -1;
+	file_mtime = -1;
+	delete[] uri;
+	uri = NULL;
+}
+
+static unsigned long read_uint32(const unsigned char *b)
+{
+	return ((unsigned long)b[0]<<24) | ((unsigned long)b[1]<<16) | ((unsigned long)b[2]<<8) | (unsigned long)b[3];
+}
+
+/*! Return 0 for success, or nonzero for could not open or not a png.
+ */
+int PngInfo::Read(const char *file)
+{
+	Clear();
+	if (!file) return 1;
+
+	FILE *f = fopen(file, "rb");
+	if (!f) return 1;
+
+	int status = Read(f);
+
+	struct stat s;
+	if (status == 0 && fstat(fileno(f), &s) == 0) file_mtime = s.st_mtime;
+
+	fclose(f);
+	return status;
+}
+
+/*! Return whether uri is "file://" followed by the percent encoded path file.
+ */
+static int uri_is_file(const char *uri, const char *file)
+{
+	if (strncmp(uri, "file://", 7)) return 0;
+	uri += 7;
+
+	int c;
+	while (*uri && *file) {
+		if (*uri == '%' && uri[1] && uri[2]) {
+			char hex[3] = { uri[1], uri[2], '\0' };
+			c = strtol(hex, NULL, 16);
+			uri += 3;
+		} else c = (unsigned char)*uri++;
+
+		if (c != (unsigned char)*file) return 0;
+		file++;
+	}
+
+	return *uri == '\0' && *file == '\0';
+}
+
+/*! Check this info, as read from a freedesktop thumbnail, against the original file
+ * whose modification time is mtime.
+ *
+ * Returns 0 if the thumbnail appears current, 1 if Thumb::MTime does not match mtime,
+ * 2 if Thumb::URI names some other file, or 3 if there is no Thumb::MTime and the
+ * thumbnail file is older than the original.
+ *
+ * The uri is only checked when original is an absolute path.
+ */
+int PngInfo::IsStaleFor(const char *original, long mtime)
+{
+	if (orig_mtime >= 0) {
+		if (orig_mtime != mtime) return 1;
+	} else if (file_mtime >= 0 && file_mtime < mtime) return 3;
+
+	if (uri && original && original[0] == '/' && !uri_is_file(uri, original)) return 2;
+
+	return 0;
+}
+
+/*! Read from the current position of f, which should be the start of a png.
+ * Return 0 for success, or nonzero for not a png.
+ */
+int PngInfo::Read(FILE *f)
+{
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+
+	Clear();
+
+	unsigned char buffer[PNGINFO_MAX_TEXT+1];
+	if (fread(buffer, 1, 8, f) != 8 || memcmp(buffer, signature, 8)) return 1;
+
+	unsigned long length;
+	char type[5];
+	type[4] = '\0';
+	int found_ihdr = 0;
+
+	while (fread(buffer, 1, 8, f) == 8) {
+		length = read_uint32(buffer);
+		memcpy(type, buffer+4, 4);
+
+		if (!strcmp(type, "IDAT") || !strcmp(type, "IEND")) break;
+
+		if (!strcmp(type, "IHDR")) {
+			if (length < 8 || fread(buffer, 1, 8, f) != 8) return 2;
+			width  = read_uint32(buffer);
+			height = read_uint32(buffer+4);
+			found_ihdr = 1;
+			if (fseek(f, length-8 + 4, SEEK_CUR)) break; //+4 skips crc
+
+		} else if (!strcmp(type, "tEXt") && length <= PNGINFO_MAX_TEXT) {
+			if (fread(buffer, 1, length, f) != length) break;
+			buffer[length] = '\0';
+			if (fseek(f, 4, SEEK_CUR)) break;
+
+			 //chunk is "keyword\0text"
+			const char *key   = (const char *)buffer;
+			size_t keylen     = strnlen(key, length);
+			if (keylen == length) continue;
+			const char *value = key + keylen + 1;
+
+			if      (!strcmp(key, "Thumb::Image::Width"))  orig_width  = strtol(value, NULL, 10);
+			else if (!strcmp(key, "Thumb::Image::Height")) orig_height = strtol(value, NULL, 10);
+			else if (!strcmp(key, "Thumb::MTime"))         orig_mtime  = strtol(value, NULL, 10);
+			else if (!strcmp(key, "Thumb::Size"))          orig_size   = strtol(value, NULL, 10);
+			else if (!strcmp(key, "Thumb::URI")) {
+				delete[] uri;
+				size_t len = strlen(value);
+				uri = new char[len+1];
+				memcpy(uri, value, len+1);
+			}
+
+		} else {
+			if (fseek(f, length + 4, SEEK_CUR)) break;
+		}
+	}
+
+	return found_ihdr ? 0 : 2;
+}
+
+
+/*! Set uri, orig_mtime, and orig_size for writing into a thumbnail of original.
+ * The uri is only set if original is an absolute path.
+ */
+void PngInfo::SetOriginal(const char *original, long mtime, long size)
+{
+	static const char *hex = "0123456789ABCDEF";
+
+	orig_mtime = mtime;
+	orig_size  = size;
+	delete[] uri;
+	uri = NULL;
+	if (!original || original[0] != '/') return;
+
+	 //percent encode everything but unreserved characters and '/'
+	uri = new char[7 + 3*strlen(original) + 1];
+	strcpy(uri, "file://");
+	char *u = uri + 7;
+	for (const unsigned char *o = (const unsigned char*)original; *o; o++) {
+		if ((*o >= 'a' && *o <= 'z') || (*o >= 'A' && *o <= 'Z') || (*o >= '0' && *o <= '9')
+				|| strchr("/-_.~", *o)) {
+			*u++ = *o;
+		} else {
+			*u++ = '%';
+			*u++ = hex[*o >> 4];
+			*u++ = hex[*o & 15];
+		}
+	}
+	*u = '\0';
+}
+
+/*! Write a w x h png to file, with tEXt chunks for whichever of uri, orig_mtime, orig_size,
+ * orig_width, and orig_height are known. argb is w*h pixels of 0xAARRGGBB, as imlib uses.
+ *
+ * The png is written to a temporary file first, then renamed to file, so that nothing
+ * ever sees a partial thumbnail. Return 0 for success, nonzero for error.
+ *
+ * If fast_write, deflate runs at level 1 with the run length strategy, and every row uses
+ * the paeth filter instead of libpng trying all five. For photographic thumbnails this
+ * is 3 to 4 times faster than libpng's defaults, for files only about 1% bigger.
+ * Otherwise libpng's defaults are used.
+ */
+int PngInfo::Write(const char *file, int w, int h, const unsigned int *argb, int has_alpha)
+{
+	if (!file || !argb || w <= 0 || h <= 0) return 1;
+
+	char *tmpfile = new char[strlen(file) + 30];
+	sprintf(tmpfile, "%s.liv-%d.tmp", file, (int)getpid());
+
+	FILE *f = fopen(tmpfile, "wb");
+	if (!f) {
+		delete[] tmpfile;
+		return 1;
+	}
+
+	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop pnginfo = (png ? png_create_info_struct(png) : NULL);
+	int channels = (has_alpha ? 4 : 3);
+	unsigned char *row = new unsigned char[w * channels];
+
+	if (!pnginfo || setjmp(png_jmpbuf(png))) {
+		png_destroy_write_struct(&png, pnginfo ? &pnginfo : NULL);
+		fclose(f);
+		unlink(tmpfile);
+		delete[] tmpfile;
+		delete[] row;
+		return 1;
+	}
+
+	png_init_io(png, f);
+	png_set_IHDR(png, pnginfo, w, h, 8, has_alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
+				 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (fast_write) {
+		png_set_compression_level(png, 1);
+		png_set_compression_strategy(png, Z_RLE);
+		png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_PAETH);
+	}
+
+	 //freedesktop thumbnail metadata
+	char values[4][30];
+	png_text text[6];
+	int n = 0;
+	if (uri)             { text[n].key = (png_charp)"Thumb::URI";          text[n].text = uri; n++; }
+	if (orig_mtime >= 0) { sprintf(values[0], "%ld", orig_mtime);  text[n].key = (png_charp)"Thumb::MTime";        text[n].text = values[0]; n++; }
+	if (orig_size >= 0)  { sprintf(values[1], "%ld", orig_size);   text[n].key = (png_charp)"Thumb::Size";         text[n].text = values[1]; n++; }
+	if (orig_width > 0)  { sprintf(values[2], "%d",  orig_width);  text[n].key = (png_charp)"Thumb::Image::Width";  text[n].text = values[2]; n++; }
+	if (orig_height > 0) { sprintf(values[3], "%d",  orig_height); text[n].key = (png_charp)"Thumb::Image::Height"; text[n].text = values[3]; n++; }
+	text[n].key = (png_charp)"Software";  text[n].text = (png_charp)"liv"; n++;
+	for (int c=0; c<n; c++) {
+		text[c].compression = PNG_TEXT_COMPRESSION_NONE;
+		text[c].text_length = strlen(text[c].text);
+	}
+	png_set_text(png, pnginfo, text, n);
+
+	png_write_info(png, pnginfo);
+
+	const unsigned int *p = argb;
+	for (int y=0; y<h; y++) {
+		unsigned char *r = row;
+		for (int x=0; x<w; x++, p++) {
+			*r++ = (*p >> 16) & 0xff;
+			*r++ = (*p >>  8) & 0xff;
+			*r++ =  *p        & 0xff;
+			if (has_alpha) *r++ = (*p >> 24) & 0xff;
+		}
+		png_write_row(png, row);
+	}
+
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &pnginfo);
+	delete[] row;
+
+	int status = (fclose(f) == 0 ? 0 : 1);
+	if (status == 0) status = (rename(tmpfile, file) == 0 ? 0 : 1);
+	if (status != 0) unlink(tmpfile);
+	delete[] tmpfile;
+	return status;
+}
+
+
+//----------------------------- png decoding --------------------------------------
+
+/*! Decode a whole png in memory to a new unsigned int[] of 0xAARRGGBB, as imlib uses,
+ * or return NULL on error. Any bit depth or color type is converted to 8 bits per channel.
+ * Unlike imlib_load_image(), this is safe in any thread without locking.
+ */
+unsigned int *decode_png(const unsigned char *data, unsigned long length,
+						 int *width_ret, int *height_ret, int *has_alpha_ret)
+{
+	png_image image;
+	memset(&image, 0, sizeof(image));
+	image.version = PNG_IMAGE_VERSION;
+
+	if (!png_image_begin_read_from_memory(&image, data, length)) return NULL;
+
+	int has_alpha = (image.format & PNG_FORMAT_FLAG_ALPHA) ? 1 : 0;
+	image.format = PNG_FORMAT_RGBA;
+
+	unsigned long n = (unsigned long)image.width * image.height;
+	unsigned int *argb = new unsigned int[n];
+	if (!png_image_finish_read(&image, NULL, argb, 0, NULL)) {
+		png_image_free(&image);
+		delete[] argb;
+		return NULL;
+	}
+
+	 //rgba bytes to argb words, in place
+	unsigned char *b = (unsigned char*)argb;
+	for (unsigned long c=0; c<n; c++, b+=4)
+		argb[c] = ((unsigned int)b[3]<<24) | ((unsigned int)b[0]<<16) | ((unsigned int)b[1]<<8) | b[2];
+
+	*width_ret  = image.width;
+	*height_ret = image.height;
+	if (has_alpha_ret) *has_alpha_ret = has_alpha;
+	return argb;
+}
+
+
+} //namespace Liv
@@ -0,0 +1,42 @@
+#ifndef LIV_PNGINFO_H
+#define LIV_PNGINFO_H
+
+#include <cstdio>
+
+
+namespace Liv {
+
+
+//----------------------------- PngInfo --------------------------------------
+
+class PngInfo
+{
+  public:
+	int width, height;  //from IHDR
+	int orig_width;     //Thumb::Image::Width, or -1
+	int orig_height;    //Thumb::Image::Height, or -1
+	long orig_mtime;    //Thumb::MTime, or -1
+	long orig_size;     //Thumb::Size, or -1
+	char *uri;          //Thumb::URI, or NULL
+	long file_mtime;    //mtime of the png itself when read with Read(const char*), or -1
+	bool fast_write;    //Write() favors speed over size, default true, see Write()
+
+	PngInfo();
+	virtual ~PngInfo();
+	virtual void Clear();
+	virtual int Read(const char *file);
+	virtual int Read(FILE *f);
+	virtual int IsStaleFor(const char *original, long mtime);
+	virtual void SetOriginal(const char *original, long mtime, long size);
+	virtual int Write(const char *file, int w, int h, const unsigned int *argb, int has_alpha);
+};
+
+
+unsigned int *decode_png(const unsigned char *data, unsigned long length,
+						 int *width_ret, int *height_ret, int *has_alpha_ret);
+
+
+} //namespace Liv
+
+#endif
+
@@ -0,0 +1,218 @@
+#include "previewcache.h"
+#include "livwindow.h"
+
+#include <iostream>
+
+
+#define DBG
+using namespace std;
+
+
+namespace Liv {
+
+
+//! Default memory budget for all previews, in megabytes.
+#define LIV_DEFAULT_PREVIEW_MEMORY  256
+
+
+/*! The one cache shared by all ImageFile objects.
+ */
+PreviewCache preview_cache(LIV_DEFAULT_PREVIEW_MEMORY * 1024L * 1024L);
+
+
+//----------------------------- PreviewCacheNode --------------------------------------
+
+/*! \class PreviewCacheNode
+ * \brief Link in PreviewCache's lru list, kept inside whatever holds the preview.
+ *
+ * ImageFile has one for its preview, and each ThumbLevel has one for its image.
+ */
+
+PreviewCacheNode::PreviewCacheNode()
+{
+	prev = next = NULL;
+	bytes   = 0;
+	incache = 0;
+	owner   = NULL;
+	level   = -1;
+	frame   = 0;
+}
+
+
+//----------------------------- PreviewCache --------------------------------------
+
+/*! \class PreviewCache
+ * \brief Keep the total memory of loaded previews within a budget.
+ *
+ * Every preview image held by an ImageFile, whether loaded from disk or made in memory,
+ * is registered with Add(), and Touch()'d whenever it is used. When the total goes over
+ * budget, Trim() releases the least recently used previews with ImageFile::ReleasePreview().
+ * They get reloaded or regenerated on demand next time they are needed.
+ *
+ * Add() may be called from preview generating threads, but Trim() should only be called
+ * from the ui thread, as that is where ImageFile objects get deleted.
+ *
+ * Previews used since the last NewFrame() are what is on screen, so Trim() never releases those,
+ * even if that means staying over budget. Otherwise, with more thumbnails on screen than
+ * the budget holds, each draw would release previews that the next draw regenerates.
+ *
+ * The nodes are intrusive, so touching is O(1) no matter how many images are loaded.
+ */
+
+PreviewCache::PreviewCache(long nbudget)
+{
+	pthread_mutex_init(&mutex, NULL);
+	first = last = NULL;
+	frame  = 1;
+	budget = nbudget;
+	used   = 0;
+	count  = 0;
+}
+
+PreviewCache::~PreviewCache()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+/*! Set a new budget in bytes, and Trim() if now over budget.
+ * Returns the new budget.
+ */
+long PreviewCache::Budget(long nbudget)
+{
+	if (nbudget < 0) nbudget = 0;
+	pthread_mutex_lock(&mutex);
+	budget = nbudget;
+	pthread_mutex_unlock(&mutex);
+
+	Trim();
+	return budget;
+}
+
+/*! Add node as most recently used, with a preview of so many bytes.
+ * If node is already in the cache, its size is updated.
+ * Nothing is released here, even if this puts us over budget. See Trim().
+ */
+void PreviewCache::Add(PreviewCacheNode *node, long bytes)
+{
+	if (!node) return;
+
+	pthread_mutex_lock(&mutex);
+
+	if (node->incache) {
+		 //unlink to move to end
+		if (node->prev) node->prev->next = node->next; else first = node->next;
+		if (node->next) node->next->prev = node->prev; else last  = node->prev;
+		used -= node->bytes;
+		count--;
+	}
+
+	node->bytes   = bytes;
+	node->frame   = frame;
+	node->incache = 1;
+	node->next    = NULL;
+	node->prev    = last;
+	if (last) last->next = node; else first = node;
+	last = node;
+	used += bytes;
+	count++;
+
+	pthread_mutex_unlock(&mutex);
+}
+
+//! Mark node as most recently used.
+void PreviewCache::Touch(PreviewCacheNode *node)
+{
+	if (!node || !node->incache) return;
+
+	pthread_mutex_lock(&mutex);
+	node->frame = frame;
+	if (node->incache && node != last) {
+		if (node->prev) node->prev->next = node->next; else first = node->next;
+		node->next->prev = node->prev;
+
+		node->next = NULL;
+		node->prev = last;
+		last->next = node;
+		last = node;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/*! Remove node from the cache without releasing anything.
+ * Call this when the preview is freed by other means.
+ */
+void PreviewCache::Remove(PreviewCacheNode *node)
+{
+	if (!node || !node->incache) return;
+
+	pthread_mutex_lock(&mutex);
+	if (node->incache) {
+		if (node->prev) node->prev->next = node->next; else first = node->next;
+		if (node->next) node->next->prev = node->prev; else last  = node->prev;
+		node->prev = node->next = NULL;
+		node->incache = 0;
+		used -= node->bytes;
+		count--;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+/*! Start a new frame. Call from the ui thread before drawing everything from scratch.
+ * Whatever is Touch()'d or Add()'d after this is safe from Trim() until the next call.
+ */
+void PreviewCache::NewFrame()
+{
+	pthread_mutex_lock(&mutex);
+	frame++;
+	pthread_mutex_unlock(&mutex);
+}
+
+/*! Release least recently used previews until within budget, but none used
+ * in the current frame. Returns the number released.
+ *
+ * Only call from the ui thread.
+ */
+int PreviewCache::Trim()
+{
+	PreviewCacheNode *victims = NULL, *node;
+	int n = 0;
+
+	pthread_mutex_lock(&mutex);
+	while (used > budget && first && first->frame != frame) {
+		node = first;
+		first = node->next;
+		if (first) first->prev = NULL; else last = NULL;
+
+		used -= node->bytes;
+		count--;
+		node->incache = 0;
+		node->prev = NULL;
+		node->next = victims;
+		victims = node;
+		n++;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	release(victims);
+	return n;
+}
+
+//! Release the preview images of each node in victims. Must be called with mutex unlocked.
+void PreviewCache::release(PreviewCacheNode *victims)
+{
+	PreviewCacheNode *node;
+	while (victims) {
+		node = victims;
+		victims = node->next;
+		node->next = NULL;
+
+		DBG cerr <<"preview cache releasing "<<(node->owner && node->owner->filename ? node->owner->filename : "?")
+		DBG      <<" level "<<node->level<<", using "<<used<<" of "<<budget<<endl;
+
+		if (node->owner) node->owner->ReleasePreview(node->level);
+	}
+}
+
+
+} //namespace Liv
+
@@ -0,0 +1,61 @@
+#ifndef LIV_PREVIEWCACHE_H
+#define LIV_PREVIEWCACHE_H
+
+#include <pthread.h>
+
+
+namespace Liv {
+
+
+class ImageFile;
+
+
+//----------------------------- PreviewCacheNode --------------------------------------
+
+class PreviewCacheNode
+{
+  public:
+	PreviewCacheNode *prev, *next;
+	long bytes;
+	int incache;
+	ImageFile *owner;
+	int level; //-1 for owner->preview, else index in owner->thumbs
+	unsigned long frame; //PreviewCache::frame when last used
+
+	PreviewCacheNode();
+};
+
+
+//----------------------------- PreviewCache --------------------------------------
+
+class PreviewCache
+{
+  protected:
+	pthread_mutex_t mutex;
+	PreviewCacheNode *first, *last; //first is least recently used
+	unsigned long frame; //previews used in this frame are never released, see NewFrame()
+
+	virtual void release(PreviewCacheNode *victims);
+
+  public:
+	long budget; //in bytes
+	long used;
+	int count;
+
+	PreviewCache(long nbudget);
+	virtual ~PreviewCache();
+	virtual long Budget(long nbudget);
+	virtual void Add(PreviewCacheNode *node, long bytes);
+	virtual void Touch(PreviewCacheNode *node);
+	virtual void Remove(PreviewCacheNode *node);
+	virtual void NewFrame();
+	virtual int Trim();
+};
+
+extern PreviewCache preview_cache;
+
+
+} //namespace Liv
+
+#endif
+
@@ -0,0 +1,452 @@
+#include "scheduler.h"
+
+#include <unistd.h>
+
+#include <iostream>
+
+#define DBG
+
+
+using namespace std;
+
+
+namespace Liv {
+
+
+/*! \file
+ * One pool of worker threads for all of liv's background cpu work.
+ *
+ * Work is queued as Task objects in one of the lanes of TaskLane. Workers always take from
+ * the highest priority lane that has something. When there is more than one worker, bulk
+ * work (any lane but TASK_Interactive) is never allowed to occupy all of them, so whatever
+ * the user is actually waiting for starts right away instead of after a pile of thumbnails.
+ *
+ * Lanes can have a maximum number of queued tasks, so that producers that are faster than the
+ * workers block in Submit() rather than queueing the whole disk.
+ *
+ * Tasks can share a CancelToken, so that, for instance, all the prefetching done for one
+ * image can be abandoned at once when the user moves on. Cancelled tasks that have not started
+ * are simply dropped. Running tasks can check Cancelled() to bail early.
+ */
+
+
+//----------------------------- SharedObject --------------------------------------
+
+/*! \class SharedObject
+ * An anObject whose count can be changed from any thread, for things passed between
+ * the ui and worker threads.
+ */
+
+int SharedObject::inc_count()
+{
+	return __atomic_add_fetch(&_count, 1, __ATOMIC_ACQ_REL);
+}
+
+//! Deletes this when the count reaches 0, in whatever thread that happens.
+int SharedObject::dec_count()
+{
+	int count = __atomic_sub_fetch(&_count, 1, __ATOMIC_ACQ_REL);
+	if (count <= 0) {
+		delete this;
+		return 0;
+	}
+	return count;
+}
+
+
+//----------------------------- CancelToken --------------------------------------
+
+/*! \class CancelToken
+ * Shared flag for abandoning a group of Task objects. Safe to use from any thread.
+ */
+
+CancelToken::CancelToken()
+{
+	cancelled = 0;
+}
+
+void CancelToken::Cancel()
+{
+	__atomic_store_n(&cancelled, 1, __ATOMIC_RELEASE);
+}
+
+bool CancelToken::Cancelled()
+{
+	return __atomic_load_n(&cancelled, __ATOMIC_ACQUIRE) != 0;
+}
+
+
+//----------------------------- Task --------------------------------------
+
+/*! \class Task
+ * Unit of work for a TaskScheduler.
+ *
+ * Run() happens in a worker thread. If Run() sets wants_finish, then Finish() is called later
+ * from whatever thread calls TaskScheduler::FinishCompleted(), which is the ui thread, so that
+ * is where to touch anything not thread safe.
+ */
+
+//! Incs count of ntoken if given.
+Task::Task(CancelToken *ntoken)
+{
+	lane  = TASK_Offscreen_Thumbs;
+	state = TASK_New;
+	token = ntoken;
+	if (token) token->inc_count();
+	next = NULL;
+	wants_finish = false;
+}
+
+Task::~Task()
+{
+	if (token) token->dec_count();
+}
+
+//! True if the task's token has been cancelled.
+bool Task::Cancelled()
+{
+	return token && token->Cancelled();
+}
+
+
+//----------------------------- TaskScheduler --------------------------------------
+
+/*! \class TaskScheduler
+ * A fixed pool of worker threads, taking Task objects from prioritized lanes.
+ */
+
+//! Percent of available cpus that ThreadsForCpuLimit() uses.
+int TaskScheduler::cpu_limit = 100;
+
+//! Number of workers to use for cpu_limit percent of online cpus, at least 1.
+int TaskScheduler::ThreadsForCpuLimit()
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus < 1) ncpus = 1;
+	int n = (ncpus * cpu_limit + 50) / 100;
+	if (n < 1) n = 1;
+	if (n > ncpus) n = ncpus;
+	return n;
+}
+
+//! Start nthreads workers (at least 1).
+TaskScheduler::TaskScheduler(int nthreads)
+{
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&work_ready, NULL);
+	pthread_cond_init(&room, NULL);
+	pthread_cond_init(&task_done, NULL);
+
+	for (int c=0; c<TASK_MAX; c++) {
+		first[c] = last[c] = NULL;
+		queued[c] = 0;
+		limit[c]  = 0;
+	}
+	busy_bulk = 0;
+	shutting_down = false;
+	finished = NULL;
+	wake = NULL;
+
+	 //workers look at numthreads, so they wait until all are started
+	pthread_mutex_lock(&mutex);
+	if (nthreads < 1) nthreads = 1;
+	threads = new pthread_t[nthreads];
+	numthreads = 0;
+	for (int c=0; c<nthreads; c++) {
+		if (pthread_create(&threads[numthreads], NULL, worker, this) != 0) {
+			DBG cerr << "TaskScheduler could not start worker "<<c<<endl;
+			break;
+		}
+		numthreads++;
+	}
+	pthread_mutex_unlock(&mutex);
+	DBG cerr << "TaskScheduler started "<<numthreads<<" workers"<<endl;
+}
+
+TaskScheduler::~TaskScheduler()
+{
+	Shutdown();
+	pthread_cond_destroy(&task_done);
+	pthread_cond_destroy(&room);
+	pthread_cond_destroy(&work_ready);
+	pthread_mutex_destroy(&mutex);
+}
+
+//! Set the maximum number of tasks that can wait in lane. 0 means no limit.
+void TaskScheduler::LaneLimit(int lane, int max)
+{
+	if (lane < 0 || lane >= TASK_MAX) return;
+	pthread_mutex_lock(&mutex);
+	limit[lane] = max < 0 ? 0 : max;
+	pthread_cond_broadcast(&room);
+	pthread_mutex_unlock(&mutex);
+}
+
+//! Remove task from its lane. mutex must be held.
+void TaskScheduler::unlink(Task *task)
+{
+	int l = task->lane;
+	Task *prev = NULL;
+	for (Task *t = first[l]; t; prev = t, t = t->next) {
+		if (t != task) continue;
+		if (prev) prev->next = t->next; else first[l] = t->next;
+		if (last[l] == t) last[l] = prev;
+		t->next = NULL;
+		queued[l]--;
+		pthread_cond_broadcast(&room);
+		return;
+	}
+}
+
+/*! Queue task in lane. The scheduler takes a count of task.
+ *
+ * If the lane is full and wait is true, block until it is not, otherwise don't queue.
+ *
+ * Return 0 for queued, 1 for lane full, 2 for shutting down or bad lane.
+ */
+int TaskScheduler::Submit(Task *task, int lane, bool wait)
+{
+	if (!task || lane < 0 || lane >= TASK_MAX) return 2;
+
+	pthread_mutex_lock(&mutex);
+	while (!shutting_down && limit[lane] && queued[lane] >= limit[lane]) {
+		if (!wait) {
+			pthread_mutex_unlock(&mutex);
+			return 1;
+		}
+		pthread_cond_wait(&room, &mutex);
+	}
+	if (shutting_down) {
+		pthread_mutex_unlock(&mutex);
+		return 2;
+	}
+
+	task->inc_count();
+	task->lane  = lane;
+	task->state = TASK_Queued;
+	task->next  = NULL;
+	if (last[lane]) last[lane]->next = task; else first[lane] = task;
+	last[lane] = task;
+	queued[lane]++;
+
+	pthread_cond_signal(&work_ready);
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+/*! Move a still queued task to the end of a higher priority lane.
+ * Lane limits are ignored for this.
+ *
+ * Return 0 for moved, 1 for not queued anymore or already at least that high.
+ */
+int TaskScheduler::Promote(Task *task, int lane)
+{
+	if (!task || lane < 0 || lane >= TASK_MAX) return 1;
+
+	pthread_mutex_lock(&mutex);
+	if (task->state != TASK_Queued || task->lane <= lane) {
+		pthread_mutex_unlock(&mutex);
+		return 1;
+	}
+
+	unlink(task);
+	task->lane = lane;
+	if (last[lane]) last[lane]->next = task; else first[lane] = task;
+	last[lane] = task;
+	queued[lane]++;
+
+	pthread_cond_broadcast(&work_ready);
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+//! Block until task is not queued or running anymore.
+void TaskScheduler::Wait(Task *task)
+{
+	if (!task) return;
+	pthread_mutex_lock(&mutex);
+	while (task->state == TASK_Queued || task->state == TASK_Running)
+		pthread_cond_wait(&task_done, &mutex);
+	pthread_mutex_unlock(&mutex);
+}
+
+/*! Pop the next task to run, or NULL if there is nothing a worker may take now. mutex must be held.
+ */
+Task *TaskScheduler::next_task()
+{
+	for (int l=0; l<TASK_MAX; l++) {
+		if (!first[l]) continue;
+
+		 //keep one worker for interactive work
+		if (l != TASK_Interactive && numthreads > 1 && busy_bulk >= numthreads-1) return NULL;
+
+		Task *task = first[l];
+		first[l] = task->next;
+		if (!first[l]) last[l] = NULL;
+		task->next = NULL;
+		queued[l]--;
+		pthread_cond_broadcast(&room);
+		return task;
+	}
+	return NULL;
+}
+
+void *TaskScheduler::worker(void *data)
+{
+	TaskScheduler *sched = (TaskScheduler*)data;
+
+	pthread_mutex_lock(&sched->mutex);
+	while (true) {
+		Task *task = NULL;
+		while (!sched->shutting_down && !(task = sched->next_task()))
+			pthread_cond_wait(&sched->work_ready, &sched->mutex);
+		if (!task) break;
+
+		bool bulk = (task->lane != TASK_Interactive);
+		if (bulk) sched->busy_bulk++;
+		task->state = TASK_Running;
+		pthread_mutex_unlock(&sched->mutex);
+
+		bool cancelled = task->Cancelled();
+		if (!cancelled) task->Run();
+
+		pthread_mutex_lock(&sched->mutex);
+		if (bulk) {
+			sched->busy_bulk--;
+			pthread_cond_signal(&sched->work_ready);
+		}
+		task->state = cancelled ? TASK_Cancelled : TASK_Done;
+
+		bool keep = (!cancelled && task->wants_finish);
+		if (keep) {
+			task->next = sched->finished;
+			sched->finished = task;
+		}
+		pthread_cond_broadcast(&sched->task_done);
+		pthread_mutex_unlock(&sched->mutex);
+
+		if (!keep) task->dec_count();
+		else if (sched->wake) sched->wake();
+
+		pthread_mutex_lock(&sched->mutex);
+	}
+	pthread_mutex_unlock(&sched->mutex);
+
+	return NULL;
+}
+
+/*! For tasks whose Run() hands the rest of their work to threads of their own: queue task
+ * for FinishCompleted() as if a worker had just run it, whatever its wants_finish.
+ * The scheduler takes a count of task.
+ *
+ * Return 0 for queued, or 1 for shutting down, in which case Finish() is never called.
+ */
+int TaskScheduler::Completed(Task *task)
+{
+	if (!task) return 1;
+
+	pthread_mutex_lock(&mutex);
+	if (shutting_down) {
+		pthread_mutex_unlock(&mutex);
+		return 1;
+	}
+	task->inc_count();
+	task->state = TASK_Done;
+	task->next = finished;
+	finished = task;
+	pthread_mutex_unlock(&mutex);
+
+	if (wake) wake();
+	return 0;
+}
+
+/*! Call Finish() on tasks that have run and asked for it, in the order they finished.
+ * Call only from the ui thread.
+ *
+ * Returns the number of tasks finished.
+ */
+int TaskScheduler::FinishCompleted()
+{
+	pthread_mutex_lock(&mutex);
+	Task *list = finished;
+	finished = NULL;
+	pthread_mutex_unlock(&mutex);
+
+	 //list is newest first
+	Task *ordered = NULL;
+	while (list) {
+		Task *t = list;
+		list = t->next;
+		t->next = ordered;
+		ordered = t;
+	}
+
+	int n = 0;
+	while (ordered) {
+		Task *t = ordered;
+		ordered = t->next;
+		t->next = NULL;
+		t->Finish();
+		t->dec_count();
+		n++;
+	}
+	return n;
+}
+
+/*! Drop all queued tasks, let running ones complete, and stop the workers.
+ * Tasks still waiting for Finish() are released without it.
+ */
+void TaskScheduler::Shutdown()
+{
+	pthread_mutex_lock(&mutex);
+	if (shutting_down && !numthreads) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	shutting_down = true;
+
+	Task *dropped = NULL;
+	for (int l=0; l<TASK_MAX; l++) {
+		while (first[l]) {
+			Task *t = first[l];
+			first[l] = t->next;
+			t->state = TASK_Cancelled;
+			t->next = dropped;
+			dropped = t;
+		}
+		last[l] = NULL;
+		queued[l] = 0;
+	}
+	pthread_cond_broadcast(&work_ready);
+	pthread_cond_broadcast(&room);
+	pthread_cond_broadcast(&task_done);
+	pthread_mutex_unlock(&mutex);
+
+	while (dropped) {
+		Task *t = dropped;
+		dropped = t->next;
+		t->next = NULL;
+		t->dec_count();
+	}
+
+	for (int c=0; c<numthreads; c++) pthread_join(threads[c], NULL);
+	delete[] threads;
+	threads = NULL;
+
+	pthread_mutex_lock(&mutex);
+	numthreads = 0;
+	Task *list = finished;
+	finished = NULL;
+	pthread_mutex_unlock(&mutex);
+
+	while (list) {
+		Task *t = list;
+		list = t->next;
+		t->next = NULL;
+		t->dec_count();
+	}
+}
+
+
+} //namespace Liv
+
@@ -0,0 +1,128 @@
+#ifndef LIV_SCHEDULER_H
+#define LIV_SCHEDULER_H
+
+#include <pthread.h>
+#include <lax/anobject.h>
+
+
+namespace Liv {
+
+
+//! Lanes of TaskScheduler, highest priority first.
+enum TaskLane {
+	TASK_Interactive,      //what the user is waiting on right now
+	TASK_Prefetch,         //full images the user is likely to look at next
+	TASK_Visible_Thumbs,   //previews of thumbnails on screen
+	TASK_Offscreen_Thumbs, //previews of everything else
+	TASK_Metadata,         //exif and such
+	TASK_Hashing,          //file content hashes
+	TASK_MAX
+};
+
+enum TaskState {
+	TASK_New,
+	TASK_Queued,
+	TASK_Running,
+	TASK_Done,
+	TASK_Cancelled
+};
+
+
+//----------------------------- SharedObject --------------------------------------
+
+class SharedObject : public Laxkit::anObject
+{
+  public:
+	virtual int inc_count();
+	virtual int dec_count();
+};
+
+
+//----------------------------- CancelToken --------------------------------------
+
+class CancelToken : public SharedObject
+{
+  protected:
+	int cancelled;
+
+  public:
+	CancelToken();
+	virtual const char *whattype() { return "CancelToken"; }
+	virtual void Cancel();
+	virtual bool Cancelled();
+};
+
+
+//----------------------------- Task --------------------------------------
+
+class Task : public SharedObject
+{
+	friend class TaskScheduler;
+
+  protected:
+	int lane;
+	int state;
+	CancelToken *token;
+	Task *next; //in a lane of its scheduler, or its finished list
+
+  public:
+	bool wants_finish; //if true after Run(), Finish() gets called in the ui thread
+
+	Task(CancelToken *ntoken = NULL);
+	virtual ~Task();
+	virtual const char *whattype() { return "Task"; }
+	virtual void Run() = 0;
+	virtual void Finish() {}
+	virtual bool Cancelled();
+	virtual int Lane() { return lane; }
+	virtual int State() { return state; }
+};
+
+
+//----------------------------- TaskScheduler --------------------------------------
+
+class TaskScheduler : public SharedObject
+{
+  protected:
+	pthread_mutex_t mutex;
+	pthread_cond_t work_ready; //a task was queued, or a worker became free
+	pthread_cond_t room;       //a lane has room
+	pthread_cond_t task_done;  //some task finished running
+	Task *first[TASK_MAX], *last[TASK_MAX];
+	int queued[TASK_MAX];
+	int limit[TASK_MAX];
+	pthread_t *threads;
+	int numthreads;
+	int busy_bulk;             //workers running anything but TASK_Interactive
+	bool shutting_down;
+	Task *finished;            //waiting for FinishCompleted()
+
+	virtual Task *next_task();
+	virtual void unlink(Task *task);
+	static void *worker(void *data);
+
+  public:
+	static int cpu_limit;      //percent of cpus to use, see ThreadsForCpuLimit()
+	static int ThreadsForCpuLimit();
+
+	void (*wake)();            //called from workers when a task is ready for FinishCompleted()
+
+	TaskScheduler(int nthreads);
+	virtual ~TaskScheduler();
+	virtual const char *whattype() { return "TaskScheduler"; }
+
+	virtual int NumThreads() { return numthreads; }
+	virtual void LaneLimit(int lane, int max);
+	virtual int Submit(Task *task, int lane, bool wait);
+	virtual int Promote(Task *task, int lane);
+	virtual void Wait(Task *task);
+	virtual int Completed(Task *task);
+	virtual int FinishCompleted();
+	virtual void Shutdown();
+};
+
+
+} //namespace Liv
+
+#endif
+
@@ -0,0 +1,777 @@
+#include "thumbpack.h"
+
+#include <lax/strmanip.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+
+
+#define DBG
+using namespace std;
+using namespace LaxFiles;
+
+
+namespace Liv {
+
+
+/*! \file
+ * Per directory thumbnail packs.
+ *
+ * In (dir)/.thumbnails/ there are two append-only files:
+ *
+ *   liv-thumbs-2.index : header, then one ThumbPackIndexRecord per thumbnail, each followed by
+ *                        the null terminated file name, padded to 8 bytes
+ *   liv-thumbs-2.pack  : header, then one zlib stream per thumbnail, each 8 byte aligned
+ *
+ * Each stream is the thumbnail's 32 bit ARGB pixels (imlib's DATA32), with every byte after the
+ * first pixel of a row stored as the difference from the same byte of the pixel to its left,
+ * like png's Sub filter. That packs photographic thumbnails to about what png does, which
+ * matters for packs that live on removable drives, and alpha of opaque images costs next to
+ * nothing. Decode() inflates straight from the mapped pack into the image's own buffer, and undoes
+ * the filter in place, so there is no read() and no intermediate copy. The index is small, so
+ * opening a directory costs one read of it and a single mmap.
+ *
+ * Everything is native endian. A pack with a different byte order or version fails the header
+ * check and is ignored, but never overwritten, since it may still be good for whichever liv made it.
+ * Later records for the same name override earlier ones. A record with THUMBPACK_FAILED and no
+ * pixels notes that no thumbnail could be made of that version of the file. Pixels are always written
+ * before their index record, so an interrupted write just leaves some unreferenced pixels.
+ *
+ * Writers hold flock(LOCK_EX) on both files, pack first, and readers of the index hold
+ * LOCK_SH on it, so several liv processes can share a directory.
+ */
+
+
+#define THUMBPACK_VERSION     2
+#define THUMBPACK_BYTE_ORDER  0x01020304
+#define THUMBPACK_RECORD      0x5448564c  //"LVHT" on little endian
+#define THUMBPACK_MAX_DIM     1024
+#define THUMBPACK_ALPHA       1  //record flags
+#define THUMBPACK_FAILED      2
+#define THUMBPACK_INDEX_NAME  "liv-thumbs-2.index"
+#define THUMBPACK_PACK_NAME   "liv-thumbs-2.pack"
+
+//! Thumbnails are packed once and read many times, so favor size over speed.
+#define THUMBPACK_DEFLATE_LEVEL  6
+
+//! The pack is mapped in windows of this many bytes, so it needs remapping only this often as it grows.
+#define THUMBPACK_MAP_CHUNK   (64L * 1024 * 1024)
+
+//! At most this many packs keep their files open and mapped, see thumb_pack_used().
+#define THUMBPACK_MAX_OPEN    32
+
+struct ThumbPackHeader
+{
+	char magic[8];       //"LIVTHIDX" or "LIVTHPIX"
+	uint32_t version;
+	uint32_t byte_order; //THUMBPACK_BYTE_ORDER
+};
+
+struct ThumbPackIndexRecord
+{
+	uint32_t magic;       //THUMBPACK_RECORD
+	uint32_t record_size; //including this header, name, and padding
+	int64_t  file_size;
+	int64_t  file_mtime;
+	int64_t  offset;      //of pixels in pack file
+	uint32_t packed_size; //bytes of pixels in pack file
+	uint32_t reserved;
+	uint32_t width, height;
+	uint32_t orig_width, orig_height;
+	uint32_t flags;       //THUMBPACK_ALPHA, THUMBPACK_FAILED
+	uint32_t name_len;    //not including terminating null
+};
+
+//! Round up to multiple of 8.
+static long pad8(long l) { return (l + 7) & ~7L; }
+
+static int check_header(int fd, const char *magic, long filesize)
+{
+	if (filesize < (long)sizeof(ThumbPackHeader)) return 1;
+
+	ThumbPackHeader header;
+	if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) return 1;
+	if (strncmp(header.magic, magic, 8)) return 1;
+	if (header.version != THUMBPACK_VERSION || header.byte_order != THUMBPACK_BYTE_ORDER) return 1;
+	return 0;
+}
+
+static int write_header(int fd, const char *magic)
+{
+	ThumbPackHeader header;
+	memcpy(header.magic, magic, 8);
+	header.version    = THUMBPACK_VERSION;
+	header.byte_order = THUMBPACK_BYTE_ORDER;
+	if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) return 1;
+	return 0;
+}
+
+/*! Filter and deflate w x h pixels, see the file comment. Returns new[]'d data,
+ * with its size in size_ret, or NULL on error.
+ */
+static unsigned char *encode_pixels(const unsigned int *argb, int w, int h, long *size_ret)
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (deflateInit(&z, THUMBPACK_DEFLATE_LEVEL) != Z_OK) return NULL;
+
+	long rowbytes = (long)w * 4;
+	uLong bound = deflateBound(&z, rowbytes * h);
+	unsigned char *out = new unsigned char[bound];
+	unsigned char *row = new unsigned char[rowbytes];
+	z.next_out  = out;
+	z.avail_out = bound;
+
+	int status = Z_OK;
+	for (int y=0; y<h && status == Z_OK; y++) {
+		const unsigned char *p = (const unsigned char*)(argb + (long)y*w);
+		memcpy(row, p, 4);
+		for (long c=4; c<rowbytes; c++) row[c] = p[c] - p[c-4];
+
+		z.next_in  = row;
+		z.avail_in = rowbytes;
+		status = deflate(&z, y == h-1 ? Z_FINISH : Z_NO_FLUSH);
+		if (status == Z_OK && z.avail_in) status = Z_BUF_ERROR;
+	}
+
+	long size = z.total_out;
+	deflateEnd(&z);
+	delete[] row;
+
+	if (status != Z_STREAM_END) {
+		delete[] out;
+		return NULL;
+	}
+	*size_ret = size;
+	return out;
+}
+
+/*! Inflate size bytes of data into w x h pixels at argb, and undo the filter.
+ * Return 0 for success.
+ */
+static int decode_pixels(const char *data, long size, unsigned int *argb, int w, int h)
+{
+	z_stream z;
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK) return 1;
+
+	long rowbytes = (long)w * 4;
+	z.next_in   = (Bytef*)data;
+	z.avail_in  = size;
+	z.next_out  = (Bytef*)argb;
+	z.avail_out = rowbytes * h;
+	int status = inflate(&z, Z_FINISH);
+	bool ok = (status == Z_STREAM_END && z.avail_out == 0);
+	inflateEnd(&z);
+	if (!ok) return 1;
+
+	for (int y=0; y<h; y++) {
+		unsigned char *p = (unsigned char*)(argb + (long)y*w);
+		for (long c=4; c<rowbytes; c++) p[c] += p[c-4];
+	}
+	return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	return strcmp(((const ThumbPackEntry*)a)->name, ((const ThumbPackEntry*)b)->name);
+}
+
+
+//----------------------------- ThumbPackEntry --------------------------------------
+
+/*! \class ThumbPackEntry
+ * \brief Index info about one thumbnail in a ThumbPack.
+ */
+
+ThumbPackEntry::ThumbPackEntry()
+{
+	name        = NULL;
+	file_size   = -1;
+	file_mtime  = -1;
+	offset      = -1;
+	packed_size = 0;
+	width       = height = 0;
+	orig_width  = orig_height = 0;
+	has_alpha   = 0;
+	failed      = 0;
+}
+
+
+//----------------------------- ThumbPack --------------------------------------
+
+/*! \class ThumbPack
+ * \brief Memory mapped, append-only thumbnail store for one directory, used for LIV_Local_Thumbs.
+ *
+ * The pack travels with the directory, so thumbnails made once are reused on any machine
+ * the directory ends up on. If the directory is not writable, existing packs are still read.
+ *
+ * Lookup() and Decode() are meant for the ui thread, Append() for preview generating threads.
+ * All are protected by an internal mutex.
+ */
+
+ThumbPack::ThumbPack(const char *ndir)
+{
+	pthread_mutex_init(&mutex, NULL);
+	dir       = newstr(ndir);
+	opened    = 0;
+	writable  = 0;
+	foreign   = 0;
+	indexfd   = packfd = -1;
+	packlen   = 0;
+	indexlen  = 0;
+	map       = NULL;
+	maplen    = 0;
+	n = max   = 0;
+	entries   = NULL;
+	hash_next = NULL;
+	lru_prev  = lru_next = NULL;
+	in_lru    = 0;
+
+	indexfile = newstr(dir);
+	appendstr(indexfile, "/.thumbnails/" THUMBPACK_INDEX_NAME);
+	packfile = newstr(dir);
+	appendstr(packfile, "/.thumbnails/" THUMBPACK_PACK_NAME);
+}
+
+ThumbPack::~ThumbPack()
+{
+	if (map) munmap(map, maplen);
+
+	for (int c=0; c<n; c++) delete[] entries[c].name;
+	delete[] entries;
+
+	close_files();
+
+	delete[] dir;
+	delete[] indexfile;
+	delete[] packfile;
+	pthread_mutex_destroy(&mutex);
+}
+
+/*! Let go of the files, the map and the index, until the pack is next used.
+ * Open() reads them in again then. The registry does this to packs not used in a while,
+ * so that a walk over many directories does not run out of file descriptors.
+ */
+void ThumbPack::Close()
+{
+	pthread_mutex_lock(&mutex);
+
+	if (map) munmap(map, maplen);
+	map = NULL;
+	maplen = 0;
+	close_files();
+
+	for (int c=0; c<n; c++) delete[] entries[c].name;
+	delete[] entries;
+	entries = NULL;
+	n = max = 0;
+
+	opened   = 0;
+	writable = 0;
+	packlen  = 0;
+	indexlen = 0;
+
+	pthread_mutex_unlock(&mutex);
+}
+
+/*! Open the files if they exist, and read in the index. Only tries once until Close().
+ * Must be called with mutex locked. Returns 0 for success, nonzero for no usable pack.
+ */
+int ThumbPack::Open()
+{
+	if (opened) return (indexfd >= 0 && packfd >= 0) ? 0 : 1;
+	opened = 1;
+
+	writable = 1;
+	indexfd = open(indexfile, O_RDWR);
+	if (indexfd < 0) {
+		writable = 0;
+		indexfd = open(indexfile, O_RDONLY);
+	}
+	if (indexfd < 0) return 1;
+	packfd = open(packfile, writable ? O_RDWR : O_RDONLY);
+	if (packfd < 0) {
+		close(indexfd);
+		indexfd = -1;
+		return 1;
+	}
+
+	 //a writer in another process might be halfway through creating it
+	flock(indexfd, LOCK_SH);
+
+	struct stat istat, pstat;
+	if (fstat(indexfd, &istat) != 0 || fstat(packfd, &pstat) != 0
+			|| check_header(indexfd, "LIVTHIDX", istat.st_size)
+			|| check_header(packfd,  "LIVTHPIX", pstat.st_size)) {
+		 //unusable for now, see create()
+		DBG cerr <<"ignoring bad thumbnail pack in "<<dir<<endl;
+		flock(indexfd, LOCK_UN);
+		close_files();
+		return 1;
+	}
+	packlen = pstat.st_size;
+	indexlen = sizeof(ThumbPackHeader);
+	read_index(istat.st_size);
+
+	flock(indexfd, LOCK_UN);
+
+	DBG cerr <<"thumbnail pack for "<<dir<<" has "<<n<<" entries"<<endl;
+	return 0;
+}
+
+void ThumbPack::close_files()
+{
+	if (indexfd >= 0) close(indexfd);
+	if (packfd  >= 0) close(packfd);
+	indexfd = packfd = -1;
+}
+
+/*! Read in index records from indexlen up to end of the index file, advancing indexlen past
+ * whatever was complete. Records that point past packlen are skipped.
+ * Must be called with mutex locked, and a flock on indexfd.
+ */
+void ThumbPack::read_index(long end)
+{
+	if (end <= indexlen) return;
+
+	char *index = (char*)mmap(NULL, end, PROT_READ, MAP_PRIVATE, indexfd, 0);
+	if (index == MAP_FAILED) return;
+
+	long pos = indexlen;
+	ThumbPackEntry entry;
+	while (pos + (long)sizeof(ThumbPackIndexRecord) <= end) {
+		ThumbPackIndexRecord *record = (ThumbPackIndexRecord*)(index + pos);
+		if (record->magic != THUMBPACK_RECORD
+				|| record->record_size < sizeof(ThumbPackIndexRecord) + record->name_len + 1
+				|| pos + (long)record->record_size > end)
+			break;
+
+		if ((record->flags & THUMBPACK_FAILED)
+			|| (record->width > 0 && record->height > 0
+				&& record->width <= THUMBPACK_MAX_DIM && record->height <= THUMBPACK_MAX_DIM
+				&& record->packed_size > 0
+				&& record->offset >= (int64_t)sizeof(ThumbPackHeader)
+				&& record->offset + (int64_t)record->packed_size <= packlen)) {
+			entry.name        = (char*)record + sizeof(ThumbPackIndexRecord);
+			entry.file_size   = record->file_size;
+			entry.file_mtime  = record->file_mtime;
+			entry.offset      = record->offset;
+			entry.packed_size = record->packed_size;
+			entry.width       = record->width;
+			entry.height      = record->height;
+			entry.orig_width  = record->orig_width;
+			entry.orig_height = record->orig_height;
+			entry.has_alpha   = (record->flags & THUMBPACK_ALPHA) ? 1 : 0;
+			entry.failed      = (record->flags & THUMBPACK_FAILED) ? 1 : 0;
+			if (entry.name[record->name_len] == '\0') set_entry(&entry);
+		}
+
+		pos += record->record_size;
+	}
+	indexlen = pos;
+
+	munmap(index, end);
+}
+
+/*! Binary search for name. Return index in entries, or -1 if not found.
+ * If not found and insert_at != NULL, it gets where name should be inserted.
+ */
+int ThumbPack::find(const char *name, int *insert_at)
+{
+	int lo = 0, hi = n-1, mid, cmp;
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		cmp = strcmp(name, entries[mid].name);
+		if (cmp == 0) return mid;
+		if (cmp < 0) hi = mid-1; else lo = mid+1;
+	}
+	if (insert_at) *insert_at = lo;
+	return -1;
+}
+
+/*! Copy entry into entries, replacing any with the same name. Must be called with mutex locked.
+ */
+int ThumbPack::set_entry(ThumbPackEntry *entry)
+{
+	int where = 0;
+	int i = find(entry->name, &where);
+
+	if (i >= 0) {
+		char *name = entries[i].name;
+		entries[i] = *entry;
+		entries[i].name = name;
+		return i;
+	}
+
+	if (n == max) {
+		max = (max ? max*2 : 64);
+		ThumbPackEntry *newentries = new ThumbPackEntry[max];
+		if (n) memcpy(newentries, entries, n*sizeof(ThumbPackEntry));
+		delete[] entries;
+		entries = newentries;
+	}
+	if (where < n) memmove(entries+where+1, entries+where, (n-where)*sizeof(ThumbPackEntry));
+	entries[where] = *entry;
+	entries[where].name = newstr(entry->name);
+	n++;
+	return where;
+}
+
+/*! If there is a valid thumbnail for name of the given original size and mtime, return 0
+ * and fill entry_ret (if not NULL) with its info. entry_ret->name is set to NULL.
+ * Return 1 for no entry, 2 for entry that is out of date, 3 for a current record that
+ * no thumbnail could be made.
+ */
+int ThumbPack::Lookup(const char *name, long file_size, long file_mtime, ThumbPackEntry *entry_ret)
+{
+	pthread_mutex_lock(&mutex);
+	Open();
+	bool open_files = (indexfd >= 0);
+
+	int status = 1;
+	int i = (n ? find(name, NULL) : -1);
+	if (i >= 0) {
+		if (entries[i].file_size != file_size || entries[i].file_mtime != file_mtime) status = 2;
+		else if (entries[i].failed) status = 3;
+		else {
+			status = 0;
+			if (entry_ret) {
+				*entry_ret = entries[i];
+				entry_ret->name = NULL;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&mutex);
+	if (open_files) thumb_pack_used(this);
+	return status;
+}
+
+/*! Return the mapping of the pack, making sure it covers bytes up to end, which must be
+ * within packlen. There is only ever one mapping. It is a read only window rounded up to
+ * THUMBPACK_MAP_CHUNK, so appends only need a new one once they grow past that, and the old
+ * one is unmapped then. Nothing may hold pointers into it without the mutex.
+ * Must be called with mutex locked.
+ */
+char *ThumbPack::map_to(long end)
+{
+	if (map && maplen >= end) return map;
+	if (packfd < 0 || end > packlen) return NULL;
+
+	if (map) munmap(map, maplen);
+	maplen = (packlen + THUMBPACK_MAP_CHUNK) / THUMBPACK_MAP_CHUNK * THUMBPACK_MAP_CHUNK;
+	map = (char*)mmap(NULL, maplen, PROT_READ, MAP_SHARED, packfd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		maplen = 0;
+	}
+	return map;
+}
+
+/*! Inflate entry's pixels from the mapped pack into argb, which must have room for
+ * entry->width * entry->height pixels. entry should be from Lookup().
+ * Returns 0 for success, nonzero for error.
+ */
+int ThumbPack::Decode(const ThumbPackEntry *entry, unsigned int *argb)
+{
+	if (!entry || !argb || entry->offset < 0 || entry->packed_size <= 0) return 1;
+
+	pthread_mutex_lock(&mutex);
+	 //the pack might have been closed since Lookup()
+	char *m = (Open() == 0 ? map_to(entry->offset + entry->packed_size) : NULL);
+	int status = (m ? decode_pixels(m + entry->offset, entry->packed_size, argb, entry->width, entry->height) : 1);
+	pthread_mutex_unlock(&mutex);
+
+	if (m) thumb_pack_used(this);
+	return status;
+}
+
+//! Create dir/.thumbnails if necessary. Return 0 for exists or created.
+int ThumbPack::make_dir()
+{
+	char *thumbdir = newstr(dir);
+	appendstr(thumbdir, "/.thumbnails");
+	int status = mkdir(thumbdir, 0755);
+	if (status != 0) {
+		struct stat s;
+		status = (stat(thumbdir, &s) == 0 && S_ISDIR(s.st_mode)) ? 0 : 1;
+	}
+	delete[] thumbdir;
+	return status;
+}
+
+/*! Open the pack files for writing, creating them if they do not exist, for when Open()
+ * found no usable pack. Files that already have something in them are only used if they
+ * pass the header check, they are never cleared. Must be called with mutex locked.
+ * Returns 0 for success.
+ */
+int ThumbPack::create()
+{
+	close_files();
+	writable = 0;
+
+	if (foreign || make_dir() != 0) return 1;
+	indexfd = open(indexfile, O_RDWR|O_CREAT, 0644);
+	packfd  = open(packfile,  O_RDWR|O_CREAT, 0644);
+	if (indexfd < 0 || packfd < 0) {
+		close_files();
+		return 1;
+	}
+
+	 //another liv might be creating the same pack right now
+	flock(packfd, LOCK_EX);
+	flock(indexfd, LOCK_EX);
+
+	int status = 1;
+	struct stat istat, pstat;
+	if (fstat(indexfd, &istat) == 0 && fstat(packfd, &pstat) == 0) {
+		status = 0;
+		if (istat.st_size) status |= check_header(indexfd, "LIVTHIDX", istat.st_size);
+		if (pstat.st_size) status |= check_header(packfd,  "LIVTHPIX", pstat.st_size);
+		if (status == 0 && istat.st_size == 0) status |= write_header(indexfd, "LIVTHIDX");
+		if (status == 0 && pstat.st_size == 0) status |= write_header(packfd,  "LIVTHPIX");
+	}
+
+	if (status == 0) {
+		 //pick up whatever the other liv put in meanwhile
+		packlen = (pstat.st_size ? pstat.st_size : (long)sizeof(ThumbPackHeader));
+		indexlen = sizeof(ThumbPackHeader);
+		read_index(istat.st_size);
+		writable = 1;
+	} else {
+		DBG cerr <<"not touching thumbnail pack of another version in "<<dir<<endl;
+		foreign = 1;
+	}
+
+	flock(indexfd, LOCK_UN);
+	flock(packfd, LOCK_UN);
+	if (status != 0) close_files();
+	return status;
+}
+
+/*! Add a thumbnail to the pack, creating the pack files if necessary.
+ * argb must be width*height 32 bit pixels, as from imlib_image_get_data_for_reading_only().
+ * If argb is NULL, record that no thumbnail could be made of this version of the file instead.
+ * Returns 0 for success, nonzero for error, such as the directory not being writable.
+ */
+int ThumbPack::Append(const char *name, long file_size, long file_mtime, int orig_width, int orig_height,
+					  int width, int height, int has_alpha, const unsigned int *argb)
+{
+	if (!name) return 1;
+	if (argb && (width <= 0 || height <= 0 || width > THUMBPACK_MAX_DIM || height > THUMBPACK_MAX_DIM))
+		return 1;
+	if (!argb) width = height = has_alpha = 0;
+
+	 //all the cpu work before any locks
+	long packedsize = 0;
+	unsigned char *packed = NULL;
+	if (argb) {
+		packed = encode_pixels(argb, width, height, &packedsize);
+		if (!packed) return 1;
+	}
+
+	pthread_mutex_lock(&mutex);
+	Open();
+
+	if (((indexfd < 0 || packfd < 0) && create() != 0) || !writable) {
+		pthread_mutex_unlock(&mutex);
+		delete[] packed;
+		return 1;
+	}
+
+	 //other liv processes might be appending too
+	flock(packfd, LOCK_EX);
+	flock(indexfd, LOCK_EX);
+
+	int status = 1;
+	struct stat pstat, istat;
+	if (fstat(packfd, &pstat) == 0 && fstat(indexfd, &istat) == 0) {
+		 //records other processes added since we last looked
+		if (pstat.st_size > packlen) packlen = pstat.st_size;
+		read_index(istat.st_size);
+
+		long offset = pad8(pstat.st_size);
+
+		int namelen = strlen(name);
+		long recordsize = pad8(sizeof(ThumbPackIndexRecord) + namelen + 1);
+		char *buffer = new char[recordsize];
+		memset(buffer, 0, recordsize);
+
+		ThumbPackIndexRecord *record = (ThumbPackIndexRecord*)buffer;
+		record->magic       = THUMBPACK_RECORD;
+		record->record_size = recordsize;
+		record->file_size   = file_size;
+		record->file_mtime  = file_mtime;
+		record->offset      = offset;
+		record->packed_size = packedsize;
+		record->width       = width;
+		record->height      = height;
+		record->orig_width  = orig_width;
+		record->orig_height = orig_height;
+		record->flags       = (has_alpha ? THUMBPACK_ALPHA : 0) | (argb ? 0 : THUMBPACK_FAILED);
+		record->name_len    = namelen;
+		memcpy(buffer + sizeof(ThumbPackIndexRecord), name, namelen);
+
+		 //pixels first, so an interrupted write never leaves a record pointing at garbage
+		if ((!packedsize || pwrite(packfd, packed, packedsize, offset) == (ssize_t)packedsize)
+				&& pwrite(indexfd, buffer, recordsize, istat.st_size) == (ssize_t)recordsize) {
+			status = 0;
+			if (packedsize) packlen = offset + packedsize;
+			indexlen = istat.st_size + recordsize;
+
+			ThumbPackEntry entry;
+			entry.name        = (char*)name;
+			entry.file_size   = file_size;
+			entry.file_mtime  = file_mtime;
+			entry.offset      = offset;
+			entry.packed_size = packedsize;
+			entry.width       = width;
+			entry.height      = height;
+			entry.orig_width  = orig_width;
+			entry.orig_height = orig_height;
+			entry.has_alpha   = has_alpha;
+			entry.failed      = (argb ? 0 : 1);
+			set_entry(&entry);
+		}
+
+		delete[] buffer;
+	}
+
+	flock(indexfd, LOCK_UN);
+	flock(packfd, LOCK_UN);
+
+	pthread_mutex_unlock(&mutex);
+	delete[] packed;
+	thumb_pack_used(this);
+	return status;
+}
+
+
+//----------------------------- pack registry --------------------------------------
+
+static pthread_mutex_t thumb_packs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ThumbPack **thumb_packs = NULL; //hash table of all packs, chained by hash_next
+static int thumb_packs_size = 0;
+static int num_thumb_packs = 0;
+static ThumbPack *lru_first = NULL, *lru_last = NULL; //packs with files open, most recently used first
+static int num_open_packs = 0;
+
+static unsigned int thumb_pack_hash(const char *dir)
+{
+	unsigned int h = 2166136261u; //fnv-1a
+	for ( ; *dir; dir++) h = (h ^ (unsigned char)*dir) * 16777619u;
+	return h;
+}
+
+//! Double the hash table. Must be called with thumb_packs_mutex locked.
+static void grow_thumb_packs()
+{
+	int newsize = (thumb_packs_size ? thumb_packs_size*2 : 64);
+	ThumbPack **newpacks = new ThumbPack*[newsize];
+	memset(newpacks, 0, newsize*sizeof(ThumbPack*));
+
+	for (int c=0; c<thumb_packs_size; c++) {
+		ThumbPack *pack = thumb_packs[c], *next;
+		for ( ; pack; pack = next) {
+			next = pack->hash_next;
+			unsigned int i = thumb_pack_hash(pack->dir) % newsize;
+			pack->hash_next = newpacks[i];
+			newpacks[i] = pack;
+		}
+	}
+
+	delete[] thumb_packs;
+	thumb_packs = newpacks;
+	thumb_packs_size = newsize;
+}
+
+/*! Note that pack, which has files open, was just used. If that makes more than
+ * THUMBPACK_MAX_OPEN packs with files open, the least recently used one is closed.
+ * Must NOT be called with any pack's mutex locked.
+ */
+void thumb_pack_used(ThumbPack *pack)
+{
+	ThumbPack *closing = NULL;
+
+	pthread_mutex_lock(&thumb_packs_mutex);
+	if (pack != lru_first) {
+		if (pack->in_lru) {
+			pack->lru_prev->lru_next = pack->lru_next;
+			if (pack->lru_next) pack->lru_next->lru_prev = pack->lru_prev;
+			else lru_last = pack->lru_prev;
+		} else {
+			pack->in_lru = 1;
+			num_open_packs++;
+		}
+		pack->lru_prev = NULL;
+		pack->lru_next = lru_first;
+		if (lru_first) lru_first->lru_prev = pack;
+		lru_first = pack;
+		if (!lru_last) lru_last = pack;
+	}
+
+	if (num_open_packs > THUMBPACK_MAX_OPEN) {
+		closing = lru_last;
+		lru_last = closing->lru_prev;
+		lru_last->lru_next = NULL;
+		closing->lru_prev = closing->lru_next = NULL;
+		closing->in_lru = 0;
+		num_open_packs--;
+	}
+	pthread_mutex_unlock(&thumb_packs_mutex);
+
+	 //if it is in use again meanwhile, it just gets opened again
+	if (closing) {
+		DBG cerr <<"closing thumbnail pack for "<<closing->dir<<endl;
+		closing->Close();
+	}
+}
+
+/*! Return the ThumbPack for file's directory, creating one if necessary.
+ * Packs are never freed, as ImageFile::thumbpack pointers to them are not counted,
+ * but only THUMBPACK_MAX_OPEN of them keep files open, see thumb_pack_used().
+ */
+ThumbPack *thumb_pack_for_file(const char *file)
+{
+	if (!file) return NULL;
+
+	const char *slash = strrchr(file, '/');
+	char *dir;
+	if (!slash) dir = newstr(".");
+	else if (slash == file) dir = newstr("/");
+	else dir = newnstr(file, slash - file);
+
+	pthread_mutex_lock(&thumb_packs_mutex);
+
+	if (num_thumb_packs >= thumb_packs_size) grow_thumb_packs();
+	unsigned int i = thumb_pack_hash(dir) % thumb_packs_size;
+
+	ThumbPack *pack = thumb_packs[i];
+	while (pack && strcmp(pack->dir, dir)) pack = pack->hash_next;
+
+	if (!pack) {
+		pack = new ThumbPack(dir);
+		pack->hash_next = thumb_packs[i];
+		thumb_packs[i] = pack;
+		num_thumb_packs++;
+	}
+
+	pthread_mutex_unlock(&thumb_packs_mutex);
+
+	delete[] dir;
+	return pack;
+}
+
+
+} //namespace Liv
+
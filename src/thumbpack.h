@@ -0,0 +1,82 @@
+#ifndef LIV_THUMBPACK_H
+#define LIV_THUMBPACK_H
+
+#include <pthread.h>
+
+
+namespace Liv {
+
+
+//----------------------------- ThumbPackEntry --------------------------------------
+
+class ThumbPackEntry
+{
+  public:
+	char *name;          //file name, without directory
+	long file_size;      //st_size of the original when the thumbnail was made
+	long file_mtime;     //st_mtime of the original when the thumbnail was made
+	long offset;         //of pixel data in the pack file
+	long packed_size;    //bytes of pixel data in the pack file
+	int width, height;   //thumbnail pixel size
+	int orig_width, orig_height;
+	int has_alpha;
+	int failed;          //no thumbnail could be made of this version of the file
+
+	ThumbPackEntry();
+};
+
+
+//----------------------------- ThumbPack --------------------------------------
+
+class ThumbPack
+{
+  protected:
+	pthread_mutex_t mutex;
+	int opened;
+	int writable;
+	int foreign; //files exist that are not ours to write, see create()
+
+	char *indexfile, *packfile;
+	int indexfd, packfd;
+	long packlen;  //bytes of pack file we know to be valid
+	long indexlen; //bytes of index file read in so far
+
+	char *map;     //read only window onto packfile, see map_to()
+	long maplen;
+
+	int n, max;
+	ThumbPackEntry *entries; //sorted by name, one per name
+
+	virtual int Open();
+	virtual int create();
+	virtual void close_files();
+	virtual void read_index(long end);
+	virtual int find(const char *name, int *insert_at);
+	virtual int set_entry(ThumbPackEntry *entry);
+	virtual int make_dir();
+	virtual char *map_to(long end);
+
+  public:
+	char *dir;
+	ThumbPack *hash_next;          //in the registry, protected by its mutex, see thumb_pack_for_file()
+	ThumbPack *lru_prev, *lru_next; //among packs that have files open, also the registry's
+	int in_lru;
+
+	ThumbPack(const char *ndir);
+	virtual ~ThumbPack();
+	virtual void Close();
+	virtual int Lookup(const char *name, long file_size, long file_mtime, ThumbPackEntry *entry_ret);
+	virtual int Decode(const ThumbPackEntry *entry, unsigned int *argb);
+	virtual int Append(const char *name, long file_size, long file_mtime, int orig_width, int orig_height,
+					   int width, int height, int has_alpha, const unsigned int *argb);
+	virtual int NumEntries() { return n; }
+};
+
+ThumbPack *thumb_pack_for_file(const char *file);
+void thumb_pack_used(ThumbPack *pack);
+
+
+} //namespace Liv
+
+#endif
+